@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CachedEnergyMeterDataProvider.h"
+
+#include <android-base/logging.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+CachedEnergyMeterDataProvider::CachedEnergyMeterDataProvider(
+        std::unique_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+        std::chrono::milliseconds maxAge, std::chrono::milliseconds maxSkew)
+    : mMeter(std::move(meter)),
+      kMaxAge(maxAge),
+      kMaxSkew(maxSkew),
+      mSnapshotSkewMs(0),
+      mSkewViolations(0),
+      mSnapshotValid(false) {}
+
+ndk::ScopedAStatus CachedEnergyMeterDataProvider::readMeterLocked() {
+    std::vector<EnergyMeasurement> reading;
+    ndk::ScopedAStatus status = mMeter->readEnergyMeter({}, &reading);
+    if (!status.isOk()) {
+        LOG(ERROR) << "Failed to read energy meter";
+        return status;
+    }
+    std::sort(reading.begin(), reading.end(),
+              [](const EnergyMeasurement &a, const EnergyMeasurement &b) { return a.id < b.id; });
+
+    // The common timestamp is that of the channel sampled the longest ago
+    int64_t commonMs = INT64_MAX;
+    for (const auto &m : reading) {
+        if (m.timestampMs > 0) {
+            commonMs = std::min(commonMs, m.timestampMs);
+        }
+    }
+
+    std::vector<EnergyMeasurement> aligned = reading;
+    int64_t skewMs = 0;
+    for (size_t i = 0; i < reading.size(); i++) {
+        const EnergyMeasurement &cur = reading[i];
+        if (cur.timestampMs <= commonMs) {
+            continue;
+        }
+
+        const EnergyMeasurement *prev =
+                i < mRaw.size() && mRaw[i].id == cur.id && mRaw[i].timestampMs < cur.timestampMs
+                        ? &mRaw[i] : nullptr;
+        if (prev && prev->timestampMs <= commonMs) {
+            const double fraction = double(commonMs - prev->timestampMs) /
+                                    (cur.timestampMs - prev->timestampMs);
+            aligned[i].energyUWs =
+                    prev->energyUWs + std::llround((cur.energyUWs - prev->energyUWs) * fraction);
+            aligned[i].durationMs -= cur.timestampMs - commonMs;
+            aligned[i].timestampMs = commonMs;
+        } else if (prev) {
+            // Both samples are newer than the common timestamp; the older one is closer
+            aligned[i] = *prev;
+            skewMs = std::max(skewMs, prev->timestampMs - commonMs);
+        } else {
+            skewMs = std::max(skewMs, cur.timestampMs - commonMs);
+        }
+    }
+
+    mRaw = std::move(reading);
+    mSnapshot = std::move(aligned);
+    mSnapshotSkewMs = skewMs;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus CachedEnergyMeterDataProvider::refreshLocked() {
+    const auto now = std::chrono::steady_clock::now();
+    if (mSnapshotValid && now - mSnapshotTime < kMaxAge) {
+        return ndk::ScopedAStatus::ok();
+    }
+
+    ndk::ScopedAStatus status = readMeterLocked();
+    // With the reading just taken as the previous sample, one more read can usually bracket
+    // the common timestamp on every channel
+    if (status.isOk() && mSnapshotSkewMs > kMaxSkew.count()) {
+        status = readMeterLocked();
+    }
+    if (!status.isOk()) {
+        mSnapshotValid = false;
+        return status;
+    }
+    if (mSnapshotSkewMs > kMaxSkew.count()) {
+        // Served anyway: the skewed channels keep their own timestamps, which readers can see.
+        // Persistent skew would log on every sweep otherwise.
+        if (mSkewViolations++ % 100 == 0) {
+            LOG(WARNING) << "Energy meter channels skewed by " << mSnapshotSkewMs
+                         << " ms after re-read (max " << kMaxSkew.count() << " ms, "
+                         << mSkewViolations << " times)";
+        }
+    }
+
+    mSnapshotTime = now;
+    mSnapshotValid = true;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus CachedEnergyMeterDataProvider::readEnergyMeter(
+        const std::vector<int32_t> &in_channelIds, std::vector<EnergyMeasurement> *_aidl_return) {
+    std::scoped_lock lock(mLock);
+
+    ndk::ScopedAStatus status = refreshLocked();
+    if (!status.isOk()) {
+        return status;
+    }
+    return copyLocked(in_channelIds, _aidl_return);
+}
+
+ndk::ScopedAStatus CachedEnergyMeterDataProvider::copyLocked(
+        const std::vector<int32_t> &in_channelIds, std::vector<EnergyMeasurement> *_aidl_return) {
+    if (in_channelIds.empty()) {
+        *_aidl_return = mSnapshot;
+        return ndk::ScopedAStatus::ok();
+    }
+
+    _aidl_return->reserve(in_channelIds.size());
+    for (const auto &channelId : in_channelIds) {
+        // check for invalid ids
+        if (channelId < 0 || channelId >= mSnapshot.size() ||
+            mSnapshot[channelId].id != channelId) {
+            return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_ARGUMENT);
+        }
+        _aidl_return->emplace_back(mSnapshot[channelId]);
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+uint64_t CachedEnergyMeterDataProvider::getSkewViolations() {
+    std::scoped_lock lock(mLock);
+    return mSkewViolations;
+}
+
+ndk::ScopedAStatus CachedEnergyMeterDataProvider::getEnergyMeterInfo(
+        std::vector<Channel> *_aidl_return) {
+    return mMeter->getEnergyMeterInfo(_aidl_return);
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CpuClusterEnergyConsumer.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/logging.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+// Weight of a new meter/model ratio in the calibration
+static const double kCalibrationWeight = 0.25;
+// Bounds of the calibration, so that a single bad meter read cannot derail the model
+static const double kMinScale = 0.25;
+static const double kMaxScale = 4.0;
+
+static int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            ::android::base::boot_clock::now().time_since_epoch()).count();
+}
+
+static double interpolate(const std::map<int32_t, int32_t> &table, int32_t freqMhz) {
+    auto hi = table.lower_bound(freqMhz);
+    if (hi == table.end()) {
+        return std::prev(hi)->second;
+    }
+    if (hi->first == freqMhz || hi == table.begin()) {
+        return hi->second;
+    }
+    auto lo = std::prev(hi);
+    return lo->second + double(hi->second - lo->second) * (freqMhz - lo->first) /
+                                (hi->first - lo->first);
+}
+
+CpuClusterEnergyConsumer::CpuClusterEnergyConsumer(
+        std::shared_ptr<PowerStats> p, std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+        const std::string &name, const std::set<std::string> &channelNames,
+        const std::string &policyStatsPath, const std::vector<std::string> &coreEntityNames,
+        const std::map<int32_t, int32_t> &freqCoeffs, int64_t meterPeriodMs)
+    : kName(name),
+      kTimeInStatePath(policyStatsPath + "/time_in_state"),
+      kMeterPeriodMs(meterPeriodMs),
+      kClockTicksPerSecond(sysconf(_SC_CLK_TCK)),
+      kFreqCoeffs(freqCoeffs),
+      mPowerStats(p),
+      mMeter(meter),
+      mHaveBaseline(false),
+      mScale(1.0),
+      mModelSinceMeterUWs(0),
+      mLastMeterUWs(-1),
+      mLastMeterReadMs(0),
+      mEnergyUWs(0) {
+    std::vector<Channel> channels;
+    mMeter->getEnergyMeterInfo(&channels);
+    for (const auto &c : channels) {
+        if (channelNames.count(c.name)) {
+            mChannelIds.push_back(c.id);
+        }
+    }
+    if (mChannelIds.size() != channelNames.size()) {
+        LOG(INFO) << kName << ": not all energy meter channels were found, model is uncalibrated";
+        mChannelIds.clear();
+    }
+
+    std::vector<PowerEntity> entities;
+    mPowerStats->getPowerEntityInfo(&entities);
+    for (const auto &entity : entities) {
+        if (std::find(coreEntityNames.begin(), coreEntityNames.end(), entity.name) !=
+            coreEntityNames.end()) {
+            mCoreEntityIds.push_back(entity.id);
+        }
+    }
+    if (mCoreEntityIds.size() != coreEntityNames.size()) {
+        LOG(ERROR) << kName << ": not all core entities were found, using the energy meter only";
+        mCoreEntityIds.clear();
+    }
+
+    mFd.reset(TEMP_FAILURE_RETRY(open(kTimeInStatePath.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (mFd == -1) {
+        PLOG(ERROR) << kName << ": failed to open " << kTimeInStatePath
+                    << ", using the energy meter only";
+    }
+}
+
+bool CpuClusterEnergyConsumer::readFullyBusyEnergyLocked(double *energyUWs, int64_t *elapsedMs) {
+    if (mFd == -1 || kFreqCoeffs.empty() || kClockTicksPerSecond <= 0) {
+        return false;
+    }
+    const ssize_t n = TEMP_FAILURE_RETRY(pread(mFd, mBuffer, sizeof(mBuffer) - 1, 0));
+    if (n <= 0) {
+        PLOG(ERROR) << kName << ": failed to read " << kTimeInStatePath;
+        return false;
+    }
+    mBuffer[n] = '\0';
+
+    // Rows are "<frequency kHz> <clock ticks>"
+    *energyUWs = 0;
+    *elapsedMs = 0;
+    char *cp = mBuffer;
+    while (*cp) {
+        char *next;
+        const int64_t freqKhz = strtoll(cp, &next, 10);
+        if (next == cp) {
+            break;
+        }
+        cp = next;
+        const int64_t ticks = strtoll(cp, &next, 10);
+        if (next == cp) {
+            break;
+        }
+        cp = next;
+
+        int64_t &last = mLastTicks[freqKhz];
+        const int64_t deltaMs = (ticks - last) * 1000 / kClockTicksPerSecond;
+        last = ticks;
+        if (mHaveBaseline && deltaMs > 0) {
+            // mW * ms = uWs
+            *energyUWs += deltaMs * interpolate(kFreqCoeffs, freqKhz / 1000);
+            *elapsedMs += deltaMs;
+        }
+    }
+    return true;
+}
+
+bool CpuClusterEnergyConsumer::readCoreDownTimeLocked(int64_t *downMs) {
+    std::vector<StateResidencyResult> results;
+    if (mCoreEntityIds.empty() ||
+        !mPowerStats->getStateResidency(mCoreEntityIds, &results).isOk()) {
+        return false;
+    }
+
+    // Cores report a single DOWN state
+    *downMs = 0;
+    for (const auto &result : results) {
+        for (const auto &residency : result.stateResidencyData) {
+            int64_t &last = mLastDownMs[result.id];
+            *downMs += std::max<int64_t>(0, residency.totalTimeInStateMs - last);
+            last = residency.totalTimeInStateMs;
+        }
+    }
+    return true;
+}
+
+bool CpuClusterEnergyConsumer::updateModelLocked() {
+    double fullyBusyUWs;
+    int64_t elapsedMs;
+    int64_t downMs;
+    if (!readFullyBusyEnergyLocked(&fullyBusyUWs, &elapsedMs) || !readCoreDownTimeLocked(&downMs)) {
+        mHaveBaseline = false;
+        return false;
+    }
+
+    if (mHaveBaseline && elapsedMs > 0) {
+        const double busy = std::clamp(
+                1.0 - double(downMs) / (double(mCoreEntityIds.size()) * elapsedMs), 0.0, 1.0);
+        mModelSinceMeterUWs += busy * fullyBusyUWs;
+    }
+    mHaveBaseline = true;
+    return true;
+}
+
+bool CpuClusterEnergyConsumer::calibrateLocked(int64_t now) {
+    std::vector<EnergyMeasurement> measurements;
+    if (!mMeter->readEnergyMeter(mChannelIds, &measurements).isOk() ||
+        measurements.size() != mChannelIds.size()) {
+        // Meter busy or unavailable; keep answering from the model and retry next period
+        return false;
+    }
+    mLastMeterReadMs = now;
+
+    int64_t meterUWs = 0;
+    for (const auto &m : measurements) {
+        meterUWs += m.energyUWs;
+    }
+
+    if (mLastMeterUWs >= 0 && mModelSinceMeterUWs > 0) {
+        const double ratio = (meterUWs - mLastMeterUWs) / mModelSinceMeterUWs;
+        if (ratio > 0) {
+            mScale += kCalibrationWeight * (ratio - mScale);
+            mScale = std::clamp(mScale, kMinScale, kMaxScale);
+        }
+    }
+
+    // The model only extrapolates from the latest reading
+    mLastMeterUWs = meterUWs;
+    mModelSinceMeterUWs = 0;
+    return true;
+}
+
+std::optional<EnergyConsumerResult> CpuClusterEnergyConsumer::getEnergyConsumed() {
+    std::scoped_lock lock(mLock);
+
+    const int64_t now = nowMs();
+    const bool modeled = updateModelLocked();
+    bool metered = false;
+    if (!mChannelIds.empty() && (!modeled || now - mLastMeterReadMs >= kMeterPeriodMs)) {
+        metered = calibrateLocked(now);
+    }
+    if (!modeled && !metered) {
+        LOG(ERROR) << kName << ": neither the model nor the energy meter is available";
+        return {};
+    }
+
+    const int64_t estimateUWs = std::max<int64_t>(mLastMeterUWs, 0) +
+                                std::llround(mScale * mModelSinceMeterUWs);
+    mEnergyUWs = std::max(mEnergyUWs, estimateUWs);
+    return EnergyConsumerResult{.timestampMs = now, .energyUWs = mEnergyUWs};
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DisplayEnergyConsumer.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include <cmath>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+DisplayEnergyConsumer::DisplayEnergyConsumer(
+        std::shared_ptr<PowerStats> p, std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+        const std::string &name, const std::set<std::string> &channelNames,
+        const std::string &entityName, const std::map<int32_t, int32_t> &refreshRateCoeffs,
+        int32_t fullBrightnessMw, const std::string &backlightPath)
+    : kName(name),
+      kFullBrightnessMw(fullBrightnessMw),
+      kBacklightPath(backlightPath),
+      mPowerStats(p),
+      mMeter(meter),
+      mEntityId(-1),
+      mMaxBrightness(0),
+      mEnergyUWs(0) {
+    std::vector<Channel> channels;
+    mMeter->getEnergyMeterInfo(&channels);
+    for (const auto &c : channels) {
+        if (channelNames.count(c.name)) {
+            mChannelIds.push_back(c.id);
+        }
+    }
+    if (!mChannelIds.empty() && mChannelIds.size() == channelNames.size()) {
+        return;
+    }
+    mChannelIds.clear();
+
+    // No display rail on this device; model the energy instead
+    std::vector<PowerEntity> entities;
+    mPowerStats->getPowerEntityInfo(&entities);
+    for (const auto &entity : entities) {
+        if (entity.name != entityName) {
+            continue;
+        }
+        mEntityId = entity.id;
+        for (const auto &state : entity.states) {
+            const size_t at = state.name.find('@');
+            if (at == std::string::npos) {
+                continue;
+            }
+            const int32_t rate = std::lround(strtod(state.name.c_str() + at + 1, nullptr));
+            auto coeff = refreshRateCoeffs.find(rate);
+            if (coeff != refreshRateCoeffs.end()) {
+                mStateCoeffs[state.id] = coeff->second;
+            }
+        }
+    }
+    if (mEntityId == -1) {
+        LOG(ERROR) << kName << ": neither energy meter channels nor " << entityName << " found";
+    }
+
+    std::string maxBrightness;
+    if (!::android::base::ReadFileToString(kBacklightPath + "max_brightness", &maxBrightness) ||
+        !::android::base::ParseInt(::android::base::Trim(maxBrightness), &mMaxBrightness) ||
+        mMaxBrightness <= 0) {
+        LOG(ERROR) << kName << ": failed to read max brightness, brightness is not modeled";
+        mMaxBrightness = 0;
+    }
+}
+
+double DisplayEnergyConsumer::getBrightnessFraction() {
+    if (mMaxBrightness == 0) {
+        return 0;
+    }
+
+    std::string state;
+    if (::android::base::ReadFileToString(kBacklightPath + "state", &state) &&
+        ::android::base::StartsWith(state, "Off")) {
+        return 0;
+    }
+
+    std::string value;
+    int64_t brightness;
+    if (!::android::base::ReadFileToString(kBacklightPath + "brightness", &value) ||
+        !::android::base::ParseInt(::android::base::Trim(value), &brightness, int64_t(0))) {
+        return 0;
+    }
+    return std::min(1.0, double(brightness) / mMaxBrightness);
+}
+
+std::optional<EnergyConsumerResult> DisplayEnergyConsumer::getMeteredEnergy() {
+    std::vector<EnergyMeasurement> measurements;
+    if (!mMeter->readEnergyMeter(mChannelIds, &measurements).isOk()) {
+        LOG(ERROR) << "Failed to read energy meter";
+        return {};
+    }
+
+    int64_t totalEnergyUWs = 0;
+    int64_t timestampMs = 0;
+    for (const auto &m : measurements) {
+        totalEnergyUWs += m.energyUWs;
+        timestampMs = m.timestampMs;
+    }
+    return EnergyConsumerResult{.timestampMs = timestampMs, .energyUWs = totalEnergyUWs};
+}
+
+std::optional<EnergyConsumerResult> DisplayEnergyConsumer::getModeledEnergyLocked() {
+    std::vector<StateResidencyResult> results;
+    if (mEntityId == -1 || !mPowerStats->getStateResidency({mEntityId}, &results).isOk()) {
+        return {};
+    }
+
+    const double brightnessMw = kFullBrightnessMw * getBrightnessFraction();
+    for (const auto &result : results) {
+        for (const auto &residency : result.stateResidencyData) {
+            auto coeff = mStateCoeffs.find(residency.id);
+            // The first read only takes a baseline: the residency accumulated before it was
+            // spent at brightness levels that are no longer known.
+            auto [last, inserted] = mLastTimeMs.try_emplace(residency.id,
+                                                            residency.totalTimeInStateMs);
+            if (inserted) {
+                continue;
+            }
+            const int64_t deltaMs = residency.totalTimeInStateMs - last->second;
+            last->second = residency.totalTimeInStateMs;
+            if (coeff == mStateCoeffs.end() || deltaMs <= 0) {
+                continue;
+            }
+            // mW * ms = uWs
+            mEnergyUWs += std::llround(deltaMs * (coeff->second + brightnessMw));
+        }
+    }
+
+    const int64_t timestampMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            ::android::base::boot_clock::now().time_since_epoch()).count();
+    return EnergyConsumerResult{.timestampMs = timestampMs, .energyUWs = mEnergyUWs};
+}
+
+std::optional<EnergyConsumerResult> DisplayEnergyConsumer::getEnergyConsumed() {
+    if (!mChannelIds.empty()) {
+        return getMeteredEnergy();
+    }
+
+    std::scoped_lock lock(mLock);
+    return getModeledEnergyLocked();
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
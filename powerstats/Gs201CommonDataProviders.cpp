@@ -16,38 +16,77 @@
 
 #include <PowerStatsAidl.h>
 #include <Gs201CommonDataProviders.h>
+#include <AcpmStatsStateResidencyDataProvider.h>
 #include <AdaptiveDvfsStateResidencyDataProvider.h>
 #include <AocTimedStateResidencyDataProvider.h>
-#include <DevfreqStateResidencyDataProvider.h>
+#include <CachedEnergyMeterDataProvider.h>
+#include <CpuClusterEnergyConsumer.h>
+#include <DisplayEnergyConsumer.h>
 #include <DisplayMrrStateResidencyDataProvider.h>
 #include <DvfsStateResidencyDataProvider.h>
+#include <Gs201PowerStats.h>
+#include <LazyDataProviders.h>
+#include <MultiDevfreqStateResidencyDataProvider.h>
+#include <PcieAspmMonitor.h>
+#include <PowerStatsProfiler.h>
+#include <PowerStatsSharedMemoryExporter.h>
+#include <RailEnergyConsumer.h>
+#include <ResidencyHistoryStore.h>
+#include <SocSleepStallDetector.h>
+#include <StateResidencySubscriptionManager.h>
 #include <UfsStateResidencyDataProvider.h>
+#include <UidAttributionEnergyConsumer.h>
 #include <dataproviders/GenericStateResidencyDataProvider.h>
 #include <dataproviders/IioEnergyMeterDataProvider.h>
-#include <dataproviders/PowerStatsEnergyConsumer.h>
-#include <dataproviders/PowerStatsEnergyAttribution.h>
 #include <dataproviders/PixelStateResidencyDataProvider.h>
 #include <dataproviders/WlanStateResidencyDataProvider.h>
 
+#include <android-base/chrono_utils.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android/binder_manager.h>
 #include <android/binder_process.h>
 #include <log/log.h>
 
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+using aidl::android::hardware::power::stats::AcpmStatsStateResidencyDataProvider;
 using aidl::android::hardware::power::stats::AdaptiveDvfsStateResidencyDataProvider;
 using aidl::android::hardware::power::stats::AocTimedStateResidencyDataProvider;
-using aidl::android::hardware::power::stats::DevfreqStateResidencyDataProvider;
+using aidl::android::hardware::power::stats::CachedEnergyMeterDataProvider;
+using aidl::android::hardware::power::stats::CpuClusterEnergyConsumer;
+using aidl::android::hardware::power::stats::DisplayEnergyConsumer;
 using aidl::android::hardware::power::stats::DisplayMrrStateResidencyDataProvider;
 using aidl::android::hardware::power::stats::DvfsStateResidencyDataProvider;
+using aidl::android::hardware::power::stats::EnergyConsumer;
 using aidl::android::hardware::power::stats::UfsStateResidencyDataProvider;
+using aidl::android::hardware::power::stats::UidAttributionEnergyConsumer;
 using aidl::android::hardware::power::stats::EnergyConsumerType;
 using aidl::android::hardware::power::stats::GenericStateResidencyDataProvider;
+using aidl::android::hardware::power::stats::Gs201PowerStats;
 using aidl::android::hardware::power::stats::IioEnergyMeterDataProvider;
+using aidl::android::hardware::power::stats::LazyEnergyConsumer;
+using aidl::android::hardware::power::stats::LazyInitializer;
+using aidl::android::hardware::power::stats::MultiDevfreqStateResidencyDataProvider;
+using aidl::android::hardware::power::stats::PcieAspmMonitor;
 using aidl::android::hardware::power::stats::PixelStateResidencyDataProvider;
-using aidl::android::hardware::power::stats::PowerStatsEnergyConsumer;
+using aidl::android::hardware::power::stats::PowerEntity;
+using aidl::android::hardware::power::stats::RailBreakdown;
+using aidl::android::hardware::power::stats::RailBreakdownTracker;
+using aidl::android::hardware::power::stats::RailEnergyConsumer;
+using aidl::android::hardware::power::stats::PowerStatsProfiler;
+using aidl::android::hardware::power::stats::PowerStatsSharedMemoryExporter;
+using aidl::android::hardware::power::stats::ResidencyHistoryStore;
+using aidl::android::hardware::power::stats::SocSleepStallDetector;
+using aidl::android::hardware::power::stats::State;
+using aidl::android::hardware::power::stats::StateResidencySubscriptionManager;
 using aidl::android::hardware::power::stats::WlanStateResidencyDataProvider;
 
+namespace acpm = aidl::android::hardware::power::stats::acpm;
+
 // TODO (b/181070764) (b/182941084):
 // Remove this when Wifi/BT energy consumption models are available or revert before ship
 using aidl::android::hardware::power::stats::EnergyConsumerResult;
@@ -55,10 +94,11 @@ using aidl::android::hardware::power::stats::Channel;
 using aidl::android::hardware::power::stats::EnergyMeasurement;
 class PlaceholderEnergyConsumer : public PowerStats::IEnergyConsumer {
   public:
-    PlaceholderEnergyConsumer(std::shared_ptr<PowerStats> p, EnergyConsumerType type,
-            std::string name) : kType(type), kName(name), mPowerStats(p), mChannelId(-1) {
+    PlaceholderEnergyConsumer(std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+            EnergyConsumerType type, std::string name)
+        : kType(type), kName(name), mMeter(meter), mChannelId(-1) {
         std::vector<Channel> channels;
-        mPowerStats->getEnergyMeterInfo(&channels);
+        mMeter->getEnergyMeterInfo(&channels);
 
         for (const auto &c : channels) {
             if (c.name == "VSYS_PWR_WLAN_BT") {
@@ -74,7 +114,7 @@ class PlaceholderEnergyConsumer : public PowerStats::IEnergyConsumer {
         int64_t timestampMs = 0;
         if (mChannelId != -1) {
             std::vector<EnergyMeasurement> measurements;
-            if (mPowerStats->readEnergyMeter({mChannelId}, &measurements).isOk()) {
+            if (mMeter->readEnergyMeter({mChannelId}, &measurements).isOk()) {
                 for (const auto &m : measurements) {
                     totalEnergyUWs += m.energyUWs;
                     timestampMs = m.timestampMs;
@@ -96,23 +136,145 @@ class PlaceholderEnergyConsumer : public PowerStats::IEnergyConsumer {
   private:
     const EnergyConsumerType kType;
     const std::string kName;
-    std::shared_ptr<PowerStats> mPowerStats;
+    std::shared_ptr<PowerStats::IEnergyMeterDataProvider> mMeter;
     int32_t mChannelId;
 };
 
+/**
+ * The energy meter set on a PowerStats, read through its public methods, so that a cache can
+ * sit in front of it without being what IPowerStats clients read.
+ */
+class PowerStatsEnergyMeter : public PowerStats::IEnergyMeterDataProvider {
+  public:
+    explicit PowerStatsEnergyMeter(std::shared_ptr<PowerStats> p) : mPowerStats(p) {}
+
+    ndk::ScopedAStatus readEnergyMeter(const std::vector<int32_t> &in_channelIds,
+                                       std::vector<EnergyMeasurement> *_aidl_return) override {
+        auto p = mPowerStats.lock();
+        if (!p) {
+            return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+        }
+        return p->readEnergyMeter(in_channelIds, _aidl_return);
+    }
+
+    ndk::ScopedAStatus getEnergyMeterInfo(std::vector<Channel> *_aidl_return) override {
+        auto p = mPowerStats.lock();
+        if (!p) {
+            return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+        }
+        return p->getEnergyMeterInfo(_aidl_return);
+    }
+
+  private:
+    // The consumers holding the cache are owned by p
+    const std::weak_ptr<PowerStats> mPowerStats;
+};
+
+// Meter reads issued within this window are served from one ODPM snapshot, so a single
+// getEnergyConsumed sweep over all consumers costs one read of both PMICs.
+static const std::chrono::milliseconds METER_COALESCE_WINDOW(50);
+
+/**
+ * Returns the process-wide cache the energy consumers read the meter of p through, creating it
+ * on first use. Only the consumers share its snapshots: readEnergyMeter on p always reads the
+ * PMICs, so IPowerStats clients never get a stale measurement.
+ */
+static std::shared_ptr<CachedEnergyMeterDataProvider> getEnergyMeterCache(
+        std::shared_ptr<PowerStats> p) {
+    // Largest tolerated distance between the sample times of the two PMICs in a snapshot
+    static const std::chrono::milliseconds METER_MAX_SKEW(20);
+    static std::mutex lock;
+    static std::shared_ptr<CachedEnergyMeterDataProvider> cache;
+
+    std::scoped_lock guard(lock);
+    if (!cache) {
+        cache = std::make_shared<CachedEnergyMeterDataProvider>(
+                std::make_unique<PowerStatsEnergyMeter>(p), METER_COALESCE_WINDOW,
+                METER_MAX_SKEW);
+    }
+    return cache;
+}
+
+/**
+ * Returns path, an absolute sysfs or devfs path, under sysfsRoot, e.g. a tree of fixtures.
+ */
+static std::string rooted(const std::string &sysfsRoot, const std::string &path) {
+    if (sysfsRoot.empty() || sysfsRoot == "/") {
+        return path;
+    }
+    return (sysfsRoot.back() == '/' ? sysfsRoot.substr(0, sysfsRoot.size() - 1) : sysfsRoot) +
+           path;
+}
+
+/**
+ * Returns whether the energy meter of p has all of the given channels, setting missing to the
+ * first one it does not have otherwise.
+ */
+static bool hasEnergyMeterChannels(std::shared_ptr<PowerStats> p,
+                                   const std::set<std::string> &channels,
+                                   std::string *missing = nullptr) {
+    std::vector<Channel> meterChannels;
+    p->getEnergyMeterInfo(&meterChannels);
+    for (const auto &channel : channels) {
+        if (std::none_of(meterChannels.begin(), meterChannels.end(),
+                         [&channel](const Channel &c) { return c.name == channel; })) {
+            if (missing) {
+                *missing = channel;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Registers an energy consumer by type and name only, provided the energy meter has all of the
+ * given channels. The consumer itself is created on first query or by the idle-time warmup.
+ */
+static void addLazyEnergyConsumer(std::shared_ptr<PowerStats> p, EnergyConsumerType type,
+                                  const std::string &name, const std::set<std::string> &channels,
+                                  LazyEnergyConsumer::Factory factory) {
+    // Like createMeterConsumer, do not advertise a consumer that could only report part of
+    // its rails
+    std::string missing;
+    if (!hasEnergyMeterChannels(p, channels, &missing)) {
+        LOG(ERROR) << "Energy meter channel " << missing << " not found, " << name
+                   << " energy consumer not added";
+        return;
+    }
+    p->addEnergyConsumer(std::make_unique<LazyEnergyConsumer>(type, name, std::move(factory)));
+}
+
+/**
+ * Registers a consumer summing the given energy meter rails. The per-rail split of its reads is
+ * available through RailBreakdownTracker, and dumped by dumpRailBreakdowns.
+ */
+static void addMeterConsumer(std::shared_ptr<PowerStats> p, EnergyConsumerType type,
+                             const std::string &name, const std::set<std::string> &channels) {
+    addLazyEnergyConsumer(p, type, name, channels, [p, type, name, channels] {
+        return std::make_unique<RailEnergyConsumer>(getEnergyMeterCache(p), type, name,
+                                                    channels);
+    });
+}
+
 void addPlaceholderEnergyConsumers(std::shared_ptr<PowerStats> p) {
-    p->addEnergyConsumer(
-            std::make_unique<PlaceholderEnergyConsumer>(p, EnergyConsumerType::WIFI, "Wifi"));
-    p->addEnergyConsumer(
-            std::make_unique<PlaceholderEnergyConsumer>(p, EnergyConsumerType::BLUETOOTH, "BT"));
+    // Placeholders report 0 without their channel
+    addLazyEnergyConsumer(p, EnergyConsumerType::WIFI, "Wifi", {}, [p] {
+        return std::make_unique<PlaceholderEnergyConsumer>(getEnergyMeterCache(p),
+                                                           EnergyConsumerType::WIFI, "Wifi");
+    });
+    addLazyEnergyConsumer(p, EnergyConsumerType::BLUETOOTH, "BT", {}, [p] {
+        return std::make_unique<PlaceholderEnergyConsumer>(getEnergyMeterCache(p),
+                                                           EnergyConsumerType::BLUETOOTH, "BT");
+    });
 }
 
-void addAoC(std::shared_ptr<PowerStats> p) {
+void addAoC(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
     // When the given timeout is 0, the timeout will be replaced with "120ms * statesCount".
     static const uint64_t TIMEOUT_MILLIS = 0;
     // AoC clock is synced from "libaoc.c"
     static const uint64_t AOC_CLOCK = 24576;
-    std::string prefix = "/sys/devices/platform/19000000.aoc/control/";
+    std::string prefix = rooted(sysfsRoot, "/sys/devices/platform/19000000.aoc/control/");
 
     // Add AoC cores (a32, ff1, hf0, and hf1)
     std::vector<std::pair<std::string, std::string>> coreIds = {
@@ -164,18 +326,18 @@ void addAoC(std::shared_ptr<PowerStats> p) {
             generateGenericStateResidencyConfigs(restartCountConfig, restartCountHeaders),
             "AoC-Count", "");
     p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
-            "/sys/devices/platform/19000000.aoc/restart_count", cfgs));
+            rooted(sysfsRoot, "/sys/devices/platform/19000000.aoc/restart_count"), cfgs));
 }
 
-void addDvfsStats(std::shared_ptr<PowerStats> p) {
+void addDvfsStats(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
     // A constant to represent the number of nanoseconds in one millisecond
     const int NS_TO_MS = 1000000;
-    std::string path = "/sys/devices/platform/acpm_stats/fvp_stats";
+    std::string path = rooted(sysfsRoot, "/sys/devices/platform/acpm_stats/fvp_stats");
 
     std::vector<std::pair<std::string, std::string>> adpCfgs = {
-        std::make_pair("CL0", "/sys/devices/system/cpu/cpufreq/policy0/stats"),
-        std::make_pair("CL1", "/sys/devices/system/cpu/cpufreq/policy4/stats"),
-        std::make_pair("CL2", "/sys/devices/system/cpu/cpufreq/policy6/stats")
+        std::make_pair("CL0", rooted(sysfsRoot, "/sys/devices/system/cpu/cpufreq/policy0/stats")),
+        std::make_pair("CL1", rooted(sysfsRoot, "/sys/devices/system/cpu/cpufreq/policy4/stats")),
+        std::make_pair("CL2", rooted(sysfsRoot, "/sys/devices/system/cpu/cpufreq/policy6/stats"))
     };
     p->addStateResidencyDataProvider(std::make_unique<AdaptiveDvfsStateResidencyDataProvider>(
             path, NS_TO_MS, adpCfgs));
@@ -203,7 +365,7 @@ void addDvfsStats(std::shared_ptr<PowerStats> p) {
             path, NS_TO_MS, cfgs));
 }
 
-void addSoC(std::shared_ptr<PowerStats> p) {
+void addSoC(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
     // A constant to represent the number of nanoseconds in one millisecond.
     const int NS_TO_MS = 1000000;
 
@@ -270,53 +432,123 @@ void addSoC(std::shared_ptr<PowerStats> p) {
             "SLC-REQ", "SLC_REQ:");
 
     p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
-            "/sys/devices/platform/acpm_stats/soc_stats", cfgs));
+            rooted(sysfsRoot, "/sys/devices/platform/acpm_stats/soc_stats"), cfgs));
+}
+
+/**
+ * Watches the SoC entities added by addSoC for screen-off windows without deep sleep and blames
+ * the subsystem holding MIF or SLC up. The stalls are dumped with the HAL.
+ */
+void addSocSleepStallDetector(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
+    // Long enough for the SoC to have settled into deep sleep after the screen goes off
+    static const std::chrono::minutes STALL_WINDOW(1);
+
+    auto detector = std::make_unique<SocSleepStallDetector>(p,
+            std::vector<SocSleepStallDetector::Requester>{
+                    {"AOC", "MIF-REQ", "AOC"},
+                    {"GSA", "MIF-REQ", "GSA"},
+                    {"TPU", "MIF-REQ", "TPU"},
+                    {"AOC-SLC", "SLC-REQ", "AOC"},
+            },
+            rooted(sysfsRoot, "/sys/class/backlight/panel0-backlight/state"));
+    // Owned by p, which lives as long as the service. The SoC entities are registered by
+    // addSoC; reads only begin once the subscription manager is started.
+    SocSleepStallDetector *d = detector.get();
+    d->start(getStateResidencySubscriptionManager(p), STALL_WINDOW);
+    Gs201PowerStats::addDumpSection("SoC sleep stalls", [d](std::ostream &out) { d->dump(out); });
+    p->addStateResidencyDataProvider(std::move(detector));
 }
 
 void setEnergyMeter(std::shared_ptr<PowerStats> p) {
+    // Not deferred: every energy consumer checks its channels at registration, so the IIO
+    // devices are scanned during registration either way. The consumers read the meter through
+    // getEnergyMeterCache.
     std::vector<std::string> deviceNames { "s2mpg12-odpm", "s2mpg13-odpm" };
     p->setEnergyMeterDataProvider(std::make_unique<IioEnergyMeterDataProvider>(deviceNames, true));
 }
 
-void addCPUclusters(std::shared_ptr<PowerStats> p) {
-    // A constant to represent the number of nanoseconds in one millisecond.
-    const int NS_TO_MS = 1000000;
+static constexpr std::array<std::string_view, 11> CPU_ENTITIES = {
+        "CORE00", "CORE01", "CORE02", "CORE03", "CORE10", "CORE11",
+        "CORE20", "CORE21", "CLUSTER0", "CLUSTER1", "CLUSTER2"};
+static constexpr auto CPU_ENTITY_HASH = acpm::buildPerfectHash(CPU_ENTITIES);
+static_assert(CPU_ENTITY_HASH.valid, "No perfect hash found for the CPU entities");
+
+static void addCpuClusterConsumer(std::shared_ptr<PowerStats> p, const std::string &name,
+                                  const std::string &rail, const std::string &policyStatsPath,
+                                  const std::vector<std::string> &cores,
+                                  const std::map<int32_t, int32_t> &freqCoeffs,
+                                  int64_t meterPeriodMs) {
+    // The model runs without the rail, uncalibrated, so the rail is not required here
+    addLazyEnergyConsumer(p, EnergyConsumerType::CPU_CLUSTER, name, {},
+            [p, name, rail, policyStatsPath, cores, freqCoeffs, meterPeriodMs] {
+        return std::make_unique<CpuClusterEnergyConsumer>(p, getEnergyMeterCache(p), name,
+                std::set<std::string>{rail},
+                policyStatsPath, cores, freqCoeffs, meterPeriodMs);
+    });
+}
 
-    std::function<uint64_t(uint64_t)> acpmNsToMs = [](uint64_t a) { return a / NS_TO_MS; };
-    const GenericStateResidencyDataProvider::StateResidencyConfig cpuStateConfig = {
-            .entryCountSupported = true,
-            .entryCountPrefix = "down_count:",
-            .totalTimeSupported = true,
-            .totalTimePrefix = "total_down_time_ns:",
-            .totalTimeTransform = acpmNsToMs,
-            .lastEntrySupported = true,
-            .lastEntryPrefix = "last_down_time_ns:",
-            .lastEntryTransform = acpmNsToMs,
+void addCPUclusters(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
+    static constexpr acpm::Format CPU_STATS_FORMAT = {
+            .stateName = "DOWN",
+            .countKey = "down_count",
+            .timeKey = "total_down_time_ns",
+            .lastKey = "last_down_time_ns",
     };
 
-    const std::vector<std::pair<std::string, std::string>> cpuStateHeaders = {
-            std::make_pair("DOWN", ""),
+    p->addStateResidencyDataProvider(
+            std::make_unique<AcpmStatsStateResidencyDataProvider<CPU_ENTITIES.size()>>(
+                    rooted(sysfsRoot, "/sys/devices/platform/acpm_stats/core_stats"),
+                    CPU_STATS_FORMAT,
+                    CPU_ENTITIES, CPU_ENTITY_HASH));
+
+    // The cluster model below is not calibrated yet: the coefficients are estimates, not
+    // measurements. Until they are measured, a cluster whose rail is on the energy meter is a
+    // plain rail consumer, as before, unless vendor.powerstats.cpu_model is set to evaluate the
+    // model. A cluster without its rail falls back to the model, which is better than no
+    // consumer at all.
+    const bool useModel = ::android::base::GetBoolProperty("vendor.powerstats.cpu_model", false);
+
+    // With the model, the cluster rail is read at most once per period, so that frequent
+    // queries do not each need a PMIC read
+    const int64_t meterPeriodMs = ::android::base::GetUintProperty<uint64_t>(
+            "vendor.powerstats.cpu_meter_period_ms", 1000);
+
+    // Frequency (MHz) to cluster power (mW) with every core busy
+    const std::map<int32_t, int32_t> cl0Coeffs = {
+        {300,   10},
+        {1000,  45},
+        {1803, 160}};
+    const std::map<int32_t, int32_t> cl1Coeffs = {
+        {400,   60},
+        {1500, 330},
+        {2348, 900}};
+    const std::map<int32_t, int32_t> cl2Coeffs = {
+        {500,   120},
+        {1800,  700},
+        {2850, 2100}};
+
+    const std::string cpufreq = rooted(sysfsRoot, "/sys/devices/system/cpu/cpufreq/");
+    auto addCluster = [&](const std::string &name, const std::string &rail,
+                          const std::string &policyStatsPath,
+                          const std::vector<std::string> &cores,
+                          const std::map<int32_t, int32_t> &freqCoeffs) {
+        if (!useModel && hasEnergyMeterChannels(p, {rail})) {
+            addMeterConsumer(p, EnergyConsumerType::CPU_CLUSTER, name, {rail});
+        } else {
+            addCpuClusterConsumer(p, name, rail, policyStatsPath, cores, freqCoeffs,
+                                  meterPeriodMs);
+        }
     };
 
-    std::vector<GenericStateResidencyDataProvider::PowerEntityConfig> cfgs;
-    for (std::string name : {"CORE00", "CORE01", "CORE02", "CORE03", "CORE10", "CORE11",
-                                "CORE20", "CORE21", "CLUSTER0", "CLUSTER1", "CLUSTER2"}) {
-        cfgs.emplace_back(generateGenericStateResidencyConfigs(cpuStateConfig, cpuStateHeaders),
-            name, name);
-    }
-
-    p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
-            "/sys/devices/platform/acpm_stats/core_stats", cfgs));
-
-    p->addEnergyConsumer(PowerStatsEnergyConsumer::createMeterConsumer(p,
-            EnergyConsumerType::CPU_CLUSTER, "CPUCL0", {"S4M_VDD_CPUCL0"}));
-    p->addEnergyConsumer(PowerStatsEnergyConsumer::createMeterConsumer(p,
-            EnergyConsumerType::CPU_CLUSTER, "CPUCL1", {"S3M_VDD_CPUCL1"}));
-    p->addEnergyConsumer(PowerStatsEnergyConsumer::createMeterConsumer(p,
-            EnergyConsumerType::CPU_CLUSTER, "CPUCL2", {"S2M_VDD_CPUCL2"}));
+    addCluster("CPUCL0", "S4M_VDD_CPUCL0", cpufreq + "policy0/stats",
+               {"CORE00", "CORE01", "CORE02", "CORE03"}, cl0Coeffs);
+    addCluster("CPUCL1", "S3M_VDD_CPUCL1", cpufreq + "policy4/stats",
+               {"CORE10", "CORE11"}, cl1Coeffs);
+    addCluster("CPUCL2", "S2M_VDD_CPUCL2", cpufreq + "policy6/stats",
+               {"CORE20", "CORE21"}, cl2Coeffs);
 }
 
-void addGPU(std::shared_ptr<PowerStats> p) {
+void addGPU(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
     // Add gpu energy consumer
     std::map<std::string, int32_t> stateCoeffs;
 
@@ -334,16 +566,20 @@ void addGPU(std::shared_ptr<PowerStats> p) {
         {"762000", 3452},
         {"848000", 4044}};
 
-    p->addEnergyConsumer(PowerStatsEnergyConsumer::createMeterAndAttrConsumer(p,
-            EnergyConsumerType::OTHER, "GPU", {"S8S_VDD_G3D_L2", "S2S_VDD_G3D"},
-            {{UID_TIME_IN_STATE, "/sys/devices/platform/28000000.mali/uid_time_in_state"}},
-            stateCoeffs));
-
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>("GPU",
-            "/sys/devices/platform/28000000.mali"));
+    const std::set<std::string> channels = {"S8S_VDD_G3D_L2", "S2S_VDD_G3D"};
+    const std::string path =
+            rooted(sysfsRoot, "/sys/devices/platform/28000000.mali/uid_time_in_state");
+    addLazyEnergyConsumer(p, EnergyConsumerType::OTHER, "GPU", channels,
+            [p, channels, path, stateCoeffs] {
+        return std::make_unique<UidAttributionEnergyConsumer>(getEnergyMeterCache(p),
+                EnergyConsumerType::OTHER, "GPU",
+                channels, path, stateCoeffs);
+    });
+
+    // GPU frequency residency is reported by addDevfreq together with the other domains
 }
 
-void addMobileRadio(std::shared_ptr<PowerStats> p)
+void addMobileRadio(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot)
 {
     // A constant to represent the number of microseconds in one millisecond.
     const int US_TO_MS = 1000;
@@ -370,14 +606,13 @@ void addMobileRadio(std::shared_ptr<PowerStats> p)
             "MODEM", "");
 
     p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
-            "/sys/devices/platform/cpif/modem/power_stats", cfgs));
+            rooted(sysfsRoot, "/sys/devices/platform/cpif/modem/power_stats"), cfgs));
 
-    p->addEnergyConsumer(PowerStatsEnergyConsumer::createMeterConsumer(p,
-            EnergyConsumerType::MOBILE_RADIO, "MODEM",
-            {"VSYS_PWR_MODEM", "VSYS_PWR_RFFE", "VSYS_PWR_MMWAVE"}));
+    addMeterConsumer(p, EnergyConsumerType::MOBILE_RADIO, "MODEM",
+            {"VSYS_PWR_MODEM", "VSYS_PWR_RFFE", "VSYS_PWR_MMWAVE"});
 }
 
-void addGNSS(std::shared_ptr<PowerStats> p)
+void addGNSS(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot)
 {
     // A constant to represent the number of microseconds in one millisecond.
     const int US_TO_MS = 1000;
@@ -407,13 +642,12 @@ void addGNSS(std::shared_ptr<PowerStats> p)
             "GPS", "");
 
     p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
-            "/dev/bbd_pwrstat", cfgs));
+            rooted(sysfsRoot, "/dev/bbd_pwrstat"), cfgs));
 
-    p->addEnergyConsumer(PowerStatsEnergyConsumer::createMeterConsumer(p,
-            EnergyConsumerType::GNSS, "GPS", {"L9S_GNSS_CORE"}));
+    addMeterConsumer(p, EnergyConsumerType::GNSS, "GPS", {"L9S_GNSS_CORE"});
 }
 
-void addPCIe(std::shared_ptr<PowerStats> p) {
+void addPCIe(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
     // Add PCIe power entities for Modem and WiFi
     const GenericStateResidencyDataProvider::StateResidencyConfig pcieStateConfig = {
         .entryCountSupported = true,
@@ -435,7 +669,7 @@ void addPCIe(std::shared_ptr<PowerStats> p) {
     };
 
     p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
-            "/sys/devices/platform/11920000.pcie/power_stats", pcieModemCfgs));
+            rooted(sysfsRoot, "/sys/devices/platform/11920000.pcie/power_stats"), pcieModemCfgs));
 
     // Add PCIe - WiFi
     const std::vector<GenericStateResidencyDataProvider::PowerEntityConfig> pcieWifiCfgs = {
@@ -444,10 +678,30 @@ void addPCIe(std::shared_ptr<PowerStats> p) {
     };
 
     p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
-            "/sys/devices/platform/14520000.pcie/power_stats", pcieWifiCfgs));
+            rooted(sysfsRoot, "/sys/devices/platform/14520000.pcie/power_stats"), pcieWifiCfgs));
 }
 
-void addWifi(std::shared_ptr<PowerStats> p) {
+/**
+ * Rates the ASPM efficiency of the modem and Wi-Fi PCIe links while their device is idle. The
+ * ratings are reported as power entities and dumped with the HAL.
+ */
+void addPcieAspmMonitor(std::shared_ptr<PowerStats> p) {
+    static const std::chrono::seconds ASPM_WINDOW(30);
+
+    auto monitor = std::make_unique<PcieAspmMonitor>(p, std::vector<PcieAspmMonitor::LinkConfig>{
+            {"Modem", "PCIe-Modem", "MODEM", "SLEEP", ""},
+            {"WiFi", "PCIe-WiFi", "WIFI", "ASLEEP", "WIFI-PCIE"},
+    });
+    // Owned by p, which lives as long as the service. The link entities are registered by
+    // addMobileRadio, addPCIe and addWifi; reads only begin once the subscription manager is
+    // started.
+    PcieAspmMonitor *m = monitor.get();
+    m->start(getStateResidencySubscriptionManager(p), ASPM_WINDOW);
+    Gs201PowerStats::addDumpSection("PCIe ASPM", [m](std::ostream &out) { m->dump(out); });
+    p->addStateResidencyDataProvider(std::move(monitor));
+}
+
+void addWifi(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
     // The transform function converts microseconds to milliseconds.
     std::function<uint64_t(uint64_t)> usecToMs = [](uint64_t a) { return a / 1000; };
     const GenericStateResidencyDataProvider::StateResidencyConfig stateConfig = {
@@ -488,88 +742,63 @@ void addWifi(std::shared_ptr<PowerStats> p) {
                 "WIFI-PCIE"}
     };
 
-    p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>("/sys/wifi/power_stats",
-            cfgs));
+    p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
+            rooted(sysfsRoot, "/sys/wifi/power_stats"), cfgs));
 }
 
-void addWlan(std::shared_ptr<PowerStats> p) {
+void addWlan(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
     p->addStateResidencyDataProvider(std::make_unique<WlanStateResidencyDataProvider>(
             "WLAN",
-            "/sys/kernel/wifi/power_stats"));
+            rooted(sysfsRoot, "/sys/kernel/wifi/power_stats")));
 }
 
-void addUfs(std::shared_ptr<PowerStats> p) {
-    p->addStateResidencyDataProvider(std::make_unique<UfsStateResidencyDataProvider>("/sys/bus/platform/devices/14700000.ufs/ufs_stats/"));
+void addUfs(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
+    p->addStateResidencyDataProvider(std::make_unique<UfsStateResidencyDataProvider>(
+            rooted(sysfsRoot, "/sys/bus/platform/devices/14700000.ufs/ufs_stats/")));
 }
 
-void addPowerDomains(std::shared_ptr<PowerStats> p) {
-    // A constant to represent the number of nanoseconds in one millisecond.
-    const int NS_TO_MS = 1000000;
-
-    std::function<uint64_t(uint64_t)> acpmNsToMs = [](uint64_t a) { return a / NS_TO_MS; };
-    const GenericStateResidencyDataProvider::StateResidencyConfig cpuStateConfig = {
-            .entryCountSupported = true,
-            .entryCountPrefix = "on_count:",
-            .totalTimeSupported = true,
-            .totalTimePrefix = "total_on_time_ns:",
-            .totalTimeTransform = acpmNsToMs,
-            .lastEntrySupported = true,
-            .lastEntryPrefix = "last_on_time_ns:",
-            .lastEntryTransform = acpmNsToMs,
-    };
-
-    const std::vector<std::pair<std::string, std::string>> cpuStateHeaders = {
-            std::make_pair("ON", ""),
+static constexpr std::array<std::string_view, 20> POWER_DOMAINS = {
+        "pd-aur", "pd-tpu", "pd-bo", "pd-tnr", "pd-gdc", "pd-mcsc", "pd-itp",
+        "pd-ipp", "pd-g3aa", "pd-dns", "pd-pdp", "pd-csis",
+        "pd-mfc", "pd-g2d", "pd-disp", "pd-dpu", "pd-hsi0",
+        "pd-g3d", "pd-embedded_g3d", "pd-eh"};
+static constexpr auto POWER_DOMAIN_HASH = acpm::buildPerfectHash(POWER_DOMAINS);
+static_assert(POWER_DOMAIN_HASH.valid, "No perfect hash found for the power domains");
+
+void addPowerDomains(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
+    static constexpr acpm::Format PD_STATS_FORMAT = {
+            .stateName = "ON",
+            .countKey = "on_count",
+            .timeKey = "total_on_time_ns",
+            .lastKey = "last_on_time_ns",
     };
 
-    std::vector<GenericStateResidencyDataProvider::PowerEntityConfig> cfgs;
-    for (std::string name : {"pd-aur", "pd-tpu", "pd-bo", "pd-tnr", "pd-gdc", "pd-mcsc", "pd-itp",
-                                "pd-ipp", "pd-g3aa", "pd-dns", "pd-pdp", "pd-csis",
-                                "pd-mfc", "pd-g2d", "pd-disp", "pd-dpu", "pd-hsi0",
-                                "pd-g3d", "pd-embedded_g3d", "pd-eh"}) {
-        cfgs.emplace_back(generateGenericStateResidencyConfigs(cpuStateConfig, cpuStateHeaders),
-            name, name + ":");
-    }
-
-    p->addStateResidencyDataProvider(std::make_unique<GenericStateResidencyDataProvider>(
-            "/sys/devices/platform/acpm_stats/pd_stats", cfgs));
+    p->addStateResidencyDataProvider(
+            std::make_unique<AcpmStatsStateResidencyDataProvider<POWER_DOMAINS.size()>>(
+                    rooted(sysfsRoot, "/sys/devices/platform/acpm_stats/pd_stats"), PD_STATS_FORMAT,
+                    POWER_DOMAINS, POWER_DOMAIN_HASH));
 }
 
-void addDevfreq(std::shared_ptr<PowerStats> p) {
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>(
-            "MIF",
-            "/sys/devices/platform/17000010.devfreq_mif/devfreq/17000010.devfreq_mif"));
-
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>(
-            "INT",
-            "/sys/devices/platform/17000020.devfreq_int/devfreq/17000020.devfreq_int"));
-
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>(
-            "INTCAM",
-            "/sys/devices/platform/17000030.devfreq_intcam/devfreq/17000030.devfreq_intcam"));
-
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>(
-            "DISP",
-            "/sys/devices/platform/17000040.devfreq_disp/devfreq/17000040.devfreq_disp"));
-
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>(
-            "CAM",
-            "/sys/devices/platform/17000050.devfreq_cam/devfreq/17000050.devfreq_cam"));
-
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>(
-            "TNR",
-            "/sys/devices/platform/17000060.devfreq_tnr/devfreq/17000060.devfreq_tnr"));
-
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>(
-            "MFC",
-            "/sys/devices/platform/17000070.devfreq_mfc/devfreq/17000070.devfreq_mfc"));
+void addDevfreq(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
+    const std::string platform = rooted(sysfsRoot, "/sys/devices/platform/");
+    const std::vector<std::pair<std::string, std::string>> domains = {
+        {"MIF", platform + "17000010.devfreq_mif/devfreq/17000010.devfreq_mif"},
+        {"INT", platform + "17000020.devfreq_int/devfreq/17000020.devfreq_int"},
+        {"INTCAM", platform + "17000030.devfreq_intcam/devfreq/17000030.devfreq_intcam"},
+        {"DISP", platform + "17000040.devfreq_disp/devfreq/17000040.devfreq_disp"},
+        {"CAM", platform + "17000050.devfreq_cam/devfreq/17000050.devfreq_cam"},
+        {"TNR", platform + "17000060.devfreq_tnr/devfreq/17000060.devfreq_tnr"},
+        {"MFC", platform + "17000070.devfreq_mfc/devfreq/17000070.devfreq_mfc"},
+        {"BO", platform + "17000080.devfreq_bo/devfreq/17000080.devfreq_bo"},
+        {"GPU", platform + "28000000.mali"},
+    };
 
-    p->addStateResidencyDataProvider(std::make_unique<DevfreqStateResidencyDataProvider>(
-            "BO",
-            "/sys/devices/platform/17000080.devfreq_bo/devfreq/17000080.devfreq_bo"));
+    // All domains are served by one provider that reads them in a single pass
+    p->addStateResidencyDataProvider(
+            std::make_unique<MultiDevfreqStateResidencyDataProvider>(domains));
 }
 
-void addTPU(std::shared_ptr<PowerStats> p) {
+void addTPU(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
     std::map<std::string, int32_t> stateCoeffs;
 
     stateCoeffs = {
@@ -579,10 +808,14 @@ void addTPU(std::shared_ptr<PowerStats> p) {
         {"845000",  30},
         {"1066000", 40}};
 
-    p->addEnergyConsumer(PowerStatsEnergyConsumer::createMeterAndAttrConsumer(p,
-            EnergyConsumerType::OTHER, "TPU", {"S10M_VDD_TPU"},
-            {{UID_TIME_IN_STATE, "/sys/class/edgetpu/edgetpu-soc/device/tpu_usage"}},
-            stateCoeffs));
+    const std::set<std::string> channels = {"S10M_VDD_TPU"};
+    const std::string path = rooted(sysfsRoot, "/sys/class/edgetpu/edgetpu-soc/device/tpu_usage");
+    addLazyEnergyConsumer(p, EnergyConsumerType::OTHER, "TPU", channels,
+            [p, channels, path, stateCoeffs] {
+        return std::make_unique<UidAttributionEnergyConsumer>(getEnergyMeterCache(p),
+                EnergyConsumerType::OTHER, "TPU",
+                channels, path, stateCoeffs);
+    });
 }
 
 /**
@@ -592,22 +825,19 @@ void addTPU(std::shared_ptr<PowerStats> p) {
  * vendor service register callbacks to provide state residency data for their given pwoer entity.
  */
 void addPixelStateResidencyDataProvider(std::shared_ptr<PowerStats> p) {
-
     auto pixelSdp = std::make_unique<PixelStateResidencyDataProvider>();
 
     pixelSdp->addEntity("Bluetooth", {{0, "Idle"}, {1, "Active"}, {2, "Tx"}, {3, "Rx"}});
 
+    // Not deferred: the vendor service must be up before the Bluetooth HAL registers its
+    // callback
     pixelSdp->start();
 
     p->addStateResidencyDataProvider(std::move(pixelSdp));
 }
 
 void addCamera(std::shared_ptr<PowerStats> p) {
-    p->addEnergyConsumer(PowerStatsEnergyConsumer::createMeterConsumer(
-            p,
-            EnergyConsumerType::CAMERA,
-            "CAMERA",
-            {"VSYS_PWR_CAM"}));
+    addMeterConsumer(p, EnergyConsumerType::CAMERA, "CAMERA", {"VSYS_PWR_CAM"});
 }
 
 void addDisplayMrrByEntity(std::shared_ptr<PowerStats> p, std::string name, std::string path) {
@@ -615,28 +845,302 @@ void addDisplayMrrByEntity(std::shared_ptr<PowerStats> p, std::string name, std:
             name, path));
 }
 
-void addDisplayMrr(std::shared_ptr<PowerStats> p) {
-    addDisplayMrrByEntity(p, "Display", "/sys/class/drm/card0/device/primary-panel/");
-}
-
-void addGs201CommonDataProviders(std::shared_ptr<PowerStats> p) {
-    setEnergyMeter(p);
-
-    addPixelStateResidencyDataProvider(p);
-    addAoC(p);
-    addDvfsStats(p);
-    addSoC(p);
-    addCPUclusters(p);
-    addGPU(p);
-    addMobileRadio(p);
-    addGNSS(p);
-    addPCIe(p);
-    addWifi(p);
-    addUfs(p);
-    addPowerDomains(p);
-    addDevfreq(p);
-    addTPU(p);
-    addCamera(p);
+void addDisplayMrr(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
+    addDisplayMrrByEntity(p, "Display",
+                          rooted(sysfsRoot, "/sys/class/drm/card0/device/primary-panel/"));
+
+    const std::set<std::string> channels = {"VSYS_PWR_DISPLAY"};
+
+    // The panel model below is not calibrated yet: the coefficients are estimates, not
+    // measurements. Until they are measured, a device without the display rail has no DISPLAY
+    // consumer, as before, unless vendor.powerstats.display_model is set to evaluate it.
+    if (!::android::base::GetBoolProperty("vendor.powerstats.display_model", false)) {
+        addMeterConsumer(p, EnergyConsumerType::DISPLAY, "DISPLAY", channels);
+        return;
+    }
+
+    // Refresh rate (Hz) to panel power (mW) at zero brightness
+    const std::map<int32_t, int32_t> refreshRateCoeffs = {
+        {10,  60},
+        {30,  90},
+        {60, 150},
+        {90, 190},
+        {120, 230}};
+    // Additional panel power (mW) at maximum brightness
+    const int32_t fullBrightnessMw = 700;
+
+    const std::string backlightPath = rooted(sysfsRoot, "/sys/class/backlight/panel0-backlight/");
+
+    // Falls back to the model when the rail is missing, so the rail is not required here
+    addLazyEnergyConsumer(p, EnergyConsumerType::DISPLAY, "DISPLAY", {},
+            [p, channels, refreshRateCoeffs, fullBrightnessMw, backlightPath] {
+        return std::make_unique<DisplayEnergyConsumer>(p, getEnergyMeterCache(p), "DISPLAY",
+                channels, "Display",
+                refreshRateCoeffs, fullBrightnessMw, backlightPath);
+    });
+}
+
+// Deferred providers are initialized this long after registration unless queried earlier.
+// Background readers wait as long for the device specific providers to be registered.
+static std::chrono::milliseconds getWarmupDelay() {
+    return std::chrono::milliseconds(
+            ::android::base::GetUintProperty<uint64_t>("vendor.powerstats.warmup_delay_ms", 5000));
+}
+
+/**
+ * Optionally publishes all residencies and energy consumer totals into a seqlock-protected
+ * shared memory region for vendor clients that poll at a high rate, see openPowerStatsShm.
+ * Disabled unless vendor.powerstats.shm_export_period_ms is set to a non-zero update period.
+ */
+void startSharedMemoryExport(std::shared_ptr<PowerStats> p) {
+    static std::unique_ptr<PowerStatsSharedMemoryExporter> exporter;
+    const uint64_t periodMs =
+            ::android::base::GetUintProperty<uint64_t>("vendor.powerstats.shm_export_period_ms", 0);
+
+    if (periodMs == 0 || exporter) {
+        return;
+    }
+
+    exporter = std::make_unique<PowerStatsSharedMemoryExporter>(p,
+            std::chrono::milliseconds(periodMs));
+    exporter->start(getWarmupDelay());
+}
+
+static std::mutex gHistoryLock;
+static std::shared_ptr<ResidencyHistoryStore> gHistory;
+
+/**
+ * Prints the change of every state and energy consumer over the last hour of history.
+ */
+static void dumpResidencyHistory(std::weak_ptr<PowerStats> wp, std::ostream &out) {
+    static const int64_t DUMP_WINDOW_MS = 60 * 60 * 1000;
+
+    auto p = wp.lock();
+    auto history = getResidencyHistoryStore();
+    if (!p || !history) {
+        return;
+    }
+
+    const int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            ::android::base::boot_clock::now().time_since_epoch()).count();
+    std::vector<ResidencyHistoryStore::Sample> samples;
+    history->query(nowMs - DUMP_WINDOW_MS, nowMs, &samples);
+    if (samples.empty()) {
+        out << "No history yet\n";
+        return;
+    }
+
+    std::map<std::pair<int32_t, int32_t>, std::pair<int64_t, int64_t>> residencies;
+    std::map<int32_t, int64_t> energies;
+    for (const auto &sample : samples) {
+        for (const auto &result : sample.residencies) {
+            for (const auto &residency : result.stateResidencyData) {
+                auto &total = residencies[{result.id, residency.id}];
+                total.first += residency.totalTimeInStateMs;
+                total.second += residency.totalStateEntryCount;
+            }
+        }
+        for (const auto &energy : sample.energies) {
+            energies[energy.id] += energy.energyUWs;
+        }
+    }
+
+    std::vector<PowerEntity> entities;
+    std::vector<EnergyConsumer> consumers;
+    p->getPowerEntityInfo(&entities);
+    p->getEnergyConsumerInfo(&consumers);
+
+    const int64_t startMs = samples.front().startMs;
+    out << "Since " << (nowMs - startMs) / 1000 << " s ago, in " << samples.size()
+        << " samples (" << history->getEncodedSize() << " bytes held):\n";
+    for (const auto &entity : entities) {
+        for (const auto &state : entity.states) {
+            auto it = residencies.find({entity.id, state.id});
+            if (it != residencies.end()) {
+                out << "  " << entity.name << "." << state.name << ": " << it->second.first
+                    << " ms, " << it->second.second << " entries\n";
+            }
+        }
+    }
+    for (const auto &consumer : consumers) {
+        auto it = energies.find(consumer.id);
+        if (it != energies.end()) {
+            out << "  " << consumer.name << ": " << it->second << " uWs\n";
+        }
+    }
+}
+
+/**
+ * Keeps a downsampled history of all residencies and energy consumer totals, dumped with the
+ * HAL. Each read covers every provider, so it is off unless vendor.powerstats.history_enabled
+ * is set, and reads every vendor.powerstats.history_period_ms (1 minute by default).
+ */
+void startResidencyHistory(std::shared_ptr<PowerStats> p) {
+    if (!::android::base::GetBoolProperty("vendor.powerstats.history_enabled", false)) {
+        return;
+    }
+    const uint64_t periodMs = std::max<uint64_t>(1000,
+            ::android::base::GetUintProperty<uint64_t>("vendor.powerstats.history_period_ms",
+                                                       60 * 1000));
+
+    std::scoped_lock guard(gHistoryLock);
+    if (gHistory) {
+        return;
+    }
+
+    gHistory = std::make_shared<ResidencyHistoryStore>(p, std::chrono::milliseconds(periodMs));
+    // Leave the deferred providers alone until their warmup
+    gHistory->start(getWarmupDelay());
+    Gs201PowerStats::addDumpSection("Residency history",
+            [wp = std::weak_ptr<PowerStats>(p)](std::ostream &out) {
+                dumpResidencyHistory(wp, out);
+            });
+}
+
+/**
+ * Returns the history started by startResidencyHistory, or nullptr if it is disabled.
+ */
+std::shared_ptr<ResidencyHistoryStore> getResidencyHistoryStore() {
+    std::scoped_lock guard(gHistoryLock);
+    return gHistory;
+}
+
+/**
+ * Profiles the query paths once the deferred providers are warmed up, when
+ * vendor.powerstats.profile_iterations is set, and logs calls that exceed their latency budget.
+ */
+void startProfiling(std::shared_ptr<PowerStats> p) {
+    const int32_t iterations =
+            ::android::base::GetIntProperty<int32_t>("vendor.powerstats.profile_iterations", 0);
+    if (iterations <= 0) {
+        return;
+    }
+
+    std::thread([p, iterations] {
+        // p99 latency budgets of a query over everything
+        static const std::map<std::string, int64_t> P99_BUDGETS_US = {
+            {"getStateResidency", 50000},
+            {"getEnergyConsumed", 10000},
+            {"readEnergyMeter",    5000}};
+
+        // Profile the steady state, after the warmup, with every call missing the meter cache
+        std::this_thread::sleep_for(getWarmupDelay() * 2);
+        PowerStatsProfiler(p).runAndCheck(iterations, METER_COALESCE_WINDOW * 2, P99_BUDGETS_US);
+    }).detach();
+}
+
+/**
+ * Returns the process-wide residency subscription manager, creating it on first use. All
+ * in-HAL clients share it so that subscribers with the same cadence share one read of the
+ * providers registered by addGs201CommonDataProviders. It reads nothing until the warmup
+ * delay has passed.
+ */
+std::shared_ptr<StateResidencySubscriptionManager> getStateResidencySubscriptionManager(
+        std::shared_ptr<PowerStats> p) {
+    static std::mutex lock;
+    static std::shared_ptr<StateResidencySubscriptionManager> manager;
+
+    std::scoped_lock guard(lock);
+    if (!manager) {
+        manager = std::make_shared<StateResidencySubscriptionManager>(p);
+    }
+    return manager;
+}
+
+/**
+ * Dumps the per-rail split of the last read of every consumer that keeps one. The dump does not
+ * read the consumers itself, so that it leaves their state as the clients last saw it.
+ */
+static void dumpRailBreakdowns(std::weak_ptr<PowerStats> wp, std::ostream &out) {
+    auto p = wp.lock();
+    if (!p) {
+        return;
+    }
+
+    out << "Meter snapshots served above the skew limit: "
+        << getEnergyMeterCache(p)->getSkewViolations() << "\n";
+    std::vector<EnergyConsumer> consumers;
+    p->getEnergyConsumerInfo(&consumers);
+    for (const auto &consumer : consumers) {
+        RailBreakdown breakdown;
+        if (!RailBreakdownTracker::getLast(consumer.name, &breakdown)) {
+            continue;
+        }
+        out << consumer.name << " (t=" << breakdown.timestampMs << " ms, averaged over "
+            << breakdown.windowMs << " ms, rails skewed by " << breakdown.skewMs << " ms):\n";
+        for (const auto &rail : breakdown.rails) {
+            out << "  " << rail.rail << ": " << rail.energyUWs << " uWs, "
+                << rail.averagePowerUW << " uW\n";
+        }
+    }
+}
+
+/**
+ * Starts everything that reads the providers from a background thread: residency subscribers,
+ * the optional exports and history, and the warmup of the deferred providers. PowerStats does
+ * not lock its provider lists, and device services register their own providers after the
+ * common ones, so no background read happens before the warmup delay.
+ */
+static void startBackgroundReaders(std::shared_ptr<PowerStats> p) {
+    getStateResidencySubscriptionManager(p)->start(getWarmupDelay());
+    startSharedMemoryExport(p);
+    startResidencyHistory(p);
+    startProfiling(p);
+    LazyInitializer::startWarmup(getWarmupDelay());
+}
+
+/**
+ * Registers the providers common to gs201 devices. The kernel nodes are read under sysfsRoot,
+ * "/" on device. Any other root, e.g. the fixtures of the query benchmark, leaves out what
+ * does not read kernel nodes: the IIO energy meter, which the caller sets beforehand, the
+ * Pixel vendor service and the background readers.
+ */
+void addGs201CommonDataProviders(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot) {
+    const bool onDevice = sysfsRoot.empty() || sysfsRoot == "/";
+    const auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    std::ostringstream steps;
+    auto timed = [&](const char *name, const std::function<void()> &add) {
+        add();
+        const auto now = std::chrono::steady_clock::now();
+        steps << " " << name << "="
+              << std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+        last = now;
+    };
+
+    if (onDevice) {
+        timed("EnergyMeter", [&] { setEnergyMeter(p); });
+        timed("Pixel", [&] { addPixelStateResidencyDataProvider(p); });
+    }
+    timed("AoC", [&] { addAoC(p, sysfsRoot); });
+    timed("DvfsStats", [&] { addDvfsStats(p, sysfsRoot); });
+    timed("SoC", [&] { addSoC(p, sysfsRoot); });
+    timed("SocSleepStallDetector", [&] { addSocSleepStallDetector(p, sysfsRoot); });
+    timed("CPUclusters", [&] { addCPUclusters(p, sysfsRoot); });
+    timed("GPU", [&] { addGPU(p, sysfsRoot); });
+    timed("MobileRadio", [&] { addMobileRadio(p, sysfsRoot); });
+    timed("GNSS", [&] { addGNSS(p, sysfsRoot); });
+    timed("PCIe", [&] { addPCIe(p, sysfsRoot); });
+    timed("Wifi", [&] { addWifi(p, sysfsRoot); });
+    timed("PcieAspmMonitor", [&] { addPcieAspmMonitor(p); });
+    timed("Ufs", [&] { addUfs(p, sysfsRoot); });
+    timed("PowerDomains", [&] { addPowerDomains(p, sysfsRoot); });
+    timed("Devfreq", [&] { addDevfreq(p, sysfsRoot); });
+    timed("TPU", [&] { addTPU(p, sysfsRoot); });
+    timed("Camera", [&] { addCamera(p); });
+
+    Gs201PowerStats::addDumpSection("Rail breakdown",
+            [wp = std::weak_ptr<PowerStats>(p)](std::ostream &out) {
+                dumpRailBreakdowns(wp, out);
+            });
+
+    LOG(INFO) << "Common data providers registered in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(last - start).count()
+              << " us (per step, us:" << steps.str() << ")";
+
+    if (onDevice) {
+        startBackgroundReaders(p);
+    }
 }
 
 void addNFC(std::shared_ptr<PowerStats> p, const std::string& path) {
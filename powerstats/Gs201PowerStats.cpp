@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Gs201PowerStats.h"
+
+#include <android-base/file.h>
+#include <unistd.h>
+
+#include <sstream>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+std::mutex Gs201PowerStats::sSectionsLock;
+std::vector<std::pair<std::string, Gs201PowerStats::DumpSection>> Gs201PowerStats::sSections;
+
+void Gs201PowerStats::addDumpSection(const std::string &title, DumpSection section) {
+    std::scoped_lock lock(sSectionsLock);
+    sSections.emplace_back(title, std::move(section));
+}
+
+binder_status_t Gs201PowerStats::dump(int fd, const char **args, uint32_t numArgs) {
+    const binder_status_t status = PowerStats::dump(fd, args, numArgs);
+
+    std::scoped_lock lock(sSectionsLock);
+    for (const auto &[title, section] : sSections) {
+        std::ostringstream out;
+        out << "\n============= " << title << " =============\n";
+        section(out);
+        ::android::base::WriteStringToFd(out.str(), fd);
+    }
+    fsync(fd);
+    return status;
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LazyDataProviders.h"
+
+#include <android-base/logging.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+// Objects that have not been initialized yet
+static std::mutex gPendingLock;
+static std::vector<LazyInitializer *> gPending;
+
+LazyInitializer::LazyInitializer(const std::string &name) : kName(name) {
+    std::scoped_lock lock(gPendingLock);
+    gPending.push_back(this);
+}
+
+LazyInitializer::~LazyInitializer() {
+    std::scoped_lock lock(gPendingLock);
+    gPending.erase(std::remove(gPending.begin(), gPending.end(), this), gPending.end());
+}
+
+void LazyInitializer::ensureInitialized() {
+    std::call_once(mOnce, [this] {
+        const auto start = std::chrono::steady_clock::now();
+        initialize();
+        const auto elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        LOG(INFO) << kName << " initialized in " << elapsedUs << " us";
+
+        std::scoped_lock lock(gPendingLock);
+        gPending.erase(std::remove(gPending.begin(), gPending.end(), this), gPending.end());
+    });
+}
+
+void LazyInitializer::warmupAll() {
+    const auto start = std::chrono::steady_clock::now();
+    while (true) {
+        LazyInitializer *next;
+        {
+            std::scoped_lock lock(gPendingLock);
+            if (gPending.empty()) {
+                break;
+            }
+            next = gPending.front();
+        }
+        // Removes itself from the pending list
+        next->ensureInitialized();
+    }
+    const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    LOG(INFO) << "Deferred data providers warmed up in " << elapsedMs << " ms";
+}
+
+void LazyInitializer::startWarmup(std::chrono::milliseconds delay) {
+    std::thread([delay] {
+        std::this_thread::sleep_for(delay);
+        // Warmup only needs to finish before the first query; keep it out of the way
+        setpriority(PRIO_PROCESS, gettid(), 10);
+        warmupAll();
+    }).detach();
+}
+
+LazyEnergyConsumer::LazyEnergyConsumer(EnergyConsumerType type, const std::string &name,
+                                       Factory factory)
+    : LazyInitializer(name), kType(type), kName(name), mFactory(std::move(factory)) {}
+
+void LazyEnergyConsumer::initialize() {
+    mConsumer = mFactory();
+    mFactory = nullptr;
+    if (!mConsumer) {
+        LOG(ERROR) << "Failed to create energy consumer " << kName;
+    }
+}
+
+std::optional<EnergyConsumerResult> LazyEnergyConsumer::getEnergyConsumed() {
+    ensureInitialized();
+    if (!mConsumer) {
+        return {};
+    }
+    return mConsumer->getEnergyConsumed();
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MultiDevfreqStateResidencyDataProvider.h"
+
+#include <android-base/logging.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+
+static const std::string nameSuffix = "-DVFS";
+static const std::string timeInStateSuffix = "/time_in_state";
+static const std::string transStatSuffix = "/trans_stat";
+// Initial size of the read buffer, and the size past which a node is not read
+static const size_t kInitialBufferSize = 8192;
+static const size_t kMaxBufferSize = 1 << 20;
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+MultiDevfreqStateResidencyDataProvider::MultiDevfreqStateResidencyDataProvider(
+        const std::vector<std::pair<std::string, std::string>> &domains)
+    : mBuffer(kInitialBufferSize) {
+    std::scoped_lock lock(mLock);
+
+    mDomains.reserve(domains.size());
+    for (const auto &[name, path] : domains) {
+        Domain domain = {.name = name + nameSuffix, .path = path, .transStat = false,
+                         .initialized = false};
+        if (!initDomain(&domain)) {
+            LOG(ERROR) << "Failed to initialize devfreq domain " << name << ", will retry";
+        }
+        mDomains.emplace_back(std::move(domain));
+    }
+}
+
+bool MultiDevfreqStateResidencyDataProvider::initDomain(Domain *domain) {
+    if (domain->initialized) {
+        return true;
+    }
+    if ((domain->fd == -1 && !openDomain(domain)) || preadDomain(domain) <= 0) {
+        return false;
+    }
+    domain->frequencies.clear();
+    domain->initialized = parseDomain(*domain, &domain->frequencies, nullptr);
+    return domain->initialized;
+}
+
+bool MultiDevfreqStateResidencyDataProvider::openDomain(Domain *domain) {
+    for (bool transStat : {domain->transStat, !domain->transStat}) {
+        const std::string node =
+                domain->path + (transStat ? transStatSuffix : timeInStateSuffix);
+        domain->fd.reset(TEMP_FAILURE_RETRY(open(node.c_str(), O_RDONLY | O_CLOEXEC)));
+        if (domain->fd != -1) {
+            domain->transStat = transStat;
+            return true;
+        }
+    }
+    PLOG(ERROR) << "Failed to open devfreq stats under " << domain->path;
+    return false;
+}
+
+ssize_t MultiDevfreqStateResidencyDataProvider::preadDomain(Domain *domain) {
+    for (;;) {
+        ssize_t n = TEMP_FAILURE_RETRY(pread(domain->fd, mBuffer.data(), mBuffer.size() - 1, 0));
+        if (n < 0) {
+            PLOG(ERROR) << "Failed to read devfreq stats of " << domain->name;
+            domain->fd.reset();
+            return n;
+        }
+        // A read that fills the buffer may have been cut short; grow it and read again
+        if (static_cast<size_t>(n) == mBuffer.size() - 1) {
+            if (mBuffer.size() >= kMaxBufferSize) {
+                LOG(ERROR) << "Devfreq stats of " << domain->name << " exceed "
+                           << kMaxBufferSize << " bytes";
+                return -1;
+            }
+            mBuffer.resize(mBuffer.size() * 2);
+            continue;
+        }
+        mBuffer[n] = '\0';
+        return n;
+    }
+}
+
+bool MultiDevfreqStateResidencyDataProvider::parseDomain(
+        const Domain &domain, std::vector<int64_t> *frequencies,
+        std::vector<StateResidency> *residencies) {
+    const size_t states = frequencies ? 0 : domain.frequencies.size();
+    size_t row = 0;
+    char *cp = mBuffer.data();
+
+    if (residencies) {
+        residencies->assign(states, StateResidency());
+        for (size_t i = 0; i < states; i++) {
+            (*residencies)[i].id = i;
+        }
+    }
+
+    while (*cp) {
+        char *end = strchrnul(cp, '\n');
+        char *next;
+
+        // trans_stat rows look like "*  421000000:  0  3 ...  1234"; its header lines and
+        // the trailing "Total transition" line do not start with a number.
+        while (*cp == ' ' || *cp == '*') cp++;
+        int64_t frequency = strtoll(cp, &next, 10);
+        if (next != cp && next <= end && (!domain.transStat || *next == ':')) {
+            if (frequencies) {
+                frequencies->push_back(frequency);
+            } else if (row >= states || domain.frequencies[row] != frequency) {
+                LOG(ERROR) << "Unexpected frequency table change in " << domain.name;
+                return false;
+            }
+
+            cp = domain.transStat ? next + 1 : next;
+            int64_t value = 0;
+            for (size_t col = 0;; col++) {
+                int64_t v = strtoll(cp, &next, 10);
+                if (next == cp || next > end) {
+                    break;
+                }
+                cp = next;
+                // In trans_stat the leading columns are transitions into each frequency
+                if (residencies && domain.transStat && col < states) {
+                    (*residencies)[col].totalStateEntryCount += v;
+                }
+                value = v;
+            }
+            if (residencies) {
+                (*residencies)[row].totalTimeInStateMs = value;
+            }
+            row++;
+        }
+
+        cp = *end ? end + 1 : end;
+    }
+
+    if (frequencies) {
+        return !frequencies->empty();
+    }
+    return row == states;
+}
+
+bool MultiDevfreqStateResidencyDataProvider::getStateResidencies(
+        std::unordered_map<std::string, std::vector<StateResidency>> *residencies) {
+    std::scoped_lock lock(mLock);
+
+    for (auto &domain : mDomains) {
+        if (!initDomain(&domain)) {
+            continue;
+        }
+        if ((domain.fd == -1 && !openDomain(&domain)) || preadDomain(&domain) <= 0) {
+            continue;
+        }
+
+        std::vector<StateResidency> stateResidencies;
+        if (parseDomain(domain, nullptr, &stateResidencies)) {
+            residencies->emplace(domain.name, std::move(stateResidencies));
+        }
+    }
+
+    return true;
+}
+
+std::unordered_map<std::string, std::vector<State>>
+MultiDevfreqStateResidencyDataProvider::getInfo() {
+    std::scoped_lock lock(mLock);
+    std::unordered_map<std::string, std::vector<State>> info;
+
+    for (auto &domain : mDomains) {
+        if (!initDomain(&domain)) {
+            continue;
+        }
+        int32_t id = 0;
+        std::vector<State> states;
+        states.reserve(domain.frequencies.size());
+        for (const auto frequency : domain.frequencies) {
+            states.push_back({.id = id++, .name = std::to_string(frequency / 1000) + "MHz"});
+        }
+        info.emplace(domain.name, std::move(states));
+    }
+
+    return info;
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PcieAspmMonitor.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/logging.h>
+
+#include <algorithm>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+static const std::string kEntitySuffix = "-ASPM";
+enum : int32_t { STATE_ACTIVE = 0, STATE_EFFICIENT, STATE_REGRESSED, STATE_COUNT };
+static const std::vector<std::string> kStateNames = {"ACTIVE", "EFFICIENT", "REGRESSED"};
+
+// Windows with less idle time than this share say little about the link power management
+static const double kMinIdleRatio = 0.5;
+// An idle link is expected to spend most of its time in L1.2...
+static const double kMinL12IdleRatio = 0.8;
+// ...and to be down or in L1.x for most of the idle time...
+static const double kMaxUpWhileIdleRatio = 0.2;
+// ...without being woken out of L1 more than a few times a second
+static const double kMaxIdleL1ExitsPerSecond = 10;
+static const size_t kMaxEvents = 32;
+
+PcieAspmMonitor::PcieAspmMonitor(std::shared_ptr<PowerStats> p, std::vector<LinkConfig> links)
+    : mPowerStats(p), mSubscription(-1), mResolved(false) {
+    for (auto &config : links) {
+        Link link = {.config = std::move(config),
+                     .linkId = -1,
+                     .upState = -1,
+                     .idleId = -1,
+                     .idleState = -1,
+                     .aspmId = -1,
+                     .l0State = -1,
+                     .l12State = -1,
+                     .currentState = -1,
+                     .hasReport = false};
+        link.residencies.resize(STATE_COUNT);
+        for (int32_t i = 0; i < STATE_COUNT; i++) {
+            link.residencies[i].id = i;
+        }
+        mLinks.push_back(std::move(link));
+    }
+}
+
+PcieAspmMonitor::~PcieAspmMonitor() {
+    auto manager = mManager.lock();
+    if (manager && mSubscription != -1) {
+        manager->unsubscribe(mSubscription);
+    }
+}
+
+void PcieAspmMonitor::start(std::shared_ptr<StateResidencySubscriptionManager> manager,
+                            std::chrono::milliseconds window) {
+    std::vector<std::string> entities;
+    for (const auto &link : mLinks) {
+        for (const auto &name : {link.config.linkEntity, link.config.idleEntity,
+                                 link.config.aspmEntity}) {
+            if (!name.empty() && std::find(entities.begin(), entities.end(), name) ==
+                                         entities.end()) {
+                entities.push_back(name);
+            }
+        }
+    }
+
+    mManager = manager;
+    mSubscription = manager->subscribe(entities, window, {.timeInStateMs = 0, .entryCount = 0},
+            [this](const std::vector<StateResidencySubscriptionManager::StateDelta> &deltas) {
+                onDeltas(deltas);
+            });
+    if (mSubscription == -1) {
+        LOG(ERROR) << "PCIe ASPM monitoring disabled";
+    }
+}
+
+bool PcieAspmMonitor::resolveStatesLocked() {
+    auto p = mPowerStats.lock();
+    if (!p) {
+        return false;
+    }
+    std::vector<PowerEntity> entities;
+    p->getPowerEntityInfo(&entities);
+
+    auto find = [&entities](const std::string &entityName, const std::string &stateName,
+                            int32_t *entityId, int32_t *stateId) {
+        for (const auto &entity : entities) {
+            if (entity.name != entityName) {
+                continue;
+            }
+            *entityId = entity.id;
+            for (const auto &state : entity.states) {
+                if (state.name == stateName) {
+                    *stateId = state.id;
+                }
+            }
+        }
+    };
+
+    bool any = false;
+    for (auto &link : mLinks) {
+        find(link.config.linkEntity, "UP", &link.linkId, &link.upState);
+        find(link.config.idleEntity, link.config.idleState, &link.idleId, &link.idleState);
+        if (!link.config.aspmEntity.empty()) {
+            find(link.config.aspmEntity, "L0", &link.aspmId, &link.l0State);
+            find(link.config.aspmEntity, "L1_2", &link.aspmId, &link.l12State);
+        }
+        if (link.upState == -1 || link.idleState == -1) {
+            LOG(ERROR) << "PCIe link entities of " << link.config.name << " not found";
+        } else {
+            any = true;
+        }
+    }
+
+    mResolved = true;
+    return any;
+}
+
+void PcieAspmMonitor::onDeltas(
+        const std::vector<StateResidencySubscriptionManager::StateDelta> &deltas) {
+    // Subscribed with a zero threshold: every delta covers the time since the previous read
+    const int64_t elapsedMs = deltas.front().elapsedMs;
+    const int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            ::android::base::boot_clock::now().time_since_epoch()).count();
+
+    std::unique_lock lock(mLock);
+    if (elapsedMs <= 0 || (!mResolved && !resolveStatesLocked())) {
+        return;
+    }
+
+    auto find = [&deltas](int32_t entityId, int32_t stateId) -> const StateResidency * {
+        for (const auto &delta : deltas) {
+            if (delta.entityId == entityId && delta.residency.id == stateId) {
+                return &delta.residency;
+            }
+        }
+        return nullptr;
+    };
+
+    std::vector<Event> regressions;
+    for (auto &link : mLinks) {
+        if (link.upState == -1 || link.idleState == -1) {
+            continue;
+        }
+
+        // States absent from the deltas did not change
+        const StateResidency *idle = find(link.idleId, link.idleState);
+        const StateResidency *up = find(link.linkId, link.upState);
+        const int64_t idleMs = idle ? std::min(idle->totalTimeInStateMs, elapsedMs) : 0;
+        const int64_t upMs = up ? std::min(up->totalTimeInStateMs, elapsedMs) : 0;
+
+        Report report = {.timestampMs = nowMs,
+                         .windowMs = elapsedMs,
+                         .idleMs = idleMs,
+                         .l12IdleRatio = -1,
+                         .l1ExitsPerSecond = -1,
+                         .upWhileIdleMs = std::max<int64_t>(0, upMs + idleMs - elapsedMs),
+                         .regressed = false};
+        if (link.aspmId != -1 && link.l0State != -1 && link.l12State != -1) {
+            const StateResidency *l0 = find(link.aspmId, link.l0State);
+            const StateResidency *l12 = find(link.aspmId, link.l12State);
+            report.l1ExitsPerSecond = (l0 ? l0->totalStateEntryCount : 0) * 1000.0 / elapsedMs;
+            if (idleMs > 0) {
+                report.l12IdleRatio =
+                        std::min(1.0, (l12 ? l12->totalTimeInStateMs : 0) / double(idleMs));
+            }
+        }
+
+        int32_t state = STATE_ACTIVE;
+        if (idleMs >= kMinIdleRatio * elapsedMs) {
+            report.regressed = (report.l12IdleRatio >= 0 &&
+                                report.l12IdleRatio < kMinL12IdleRatio) ||
+                               report.l1ExitsPerSecond > kMaxIdleL1ExitsPerSecond ||
+                               report.upWhileIdleMs > kMaxUpWhileIdleRatio * idleMs;
+            state = report.regressed ? STATE_REGRESSED : STATE_EFFICIENT;
+        }
+
+        StateResidency &residency = link.residencies[state];
+        residency.totalTimeInStateMs += elapsedMs;
+        if (state != link.currentState) {
+            residency.totalStateEntryCount++;
+            residency.lastEntryTimestampMs = nowMs - elapsedMs;
+            if (state == STATE_REGRESSED) {
+                regressions.push_back({.link = link.config.name, .report = report});
+            }
+        }
+        link.currentState = state;
+        link.report = report;
+        link.hasReport = true;
+    }
+
+    for (const auto &event : regressions) {
+        mEvents.push_back(event);
+        if (mEvents.size() > kMaxEvents) {
+            mEvents.pop_front();
+        }
+    }
+    lock.unlock();
+
+    for (const auto &event : regressions) {
+        LOG(WARNING) << "PCIe ASPM regressed on " << event.link << ": idle "
+                     << event.report.idleMs << "/" << event.report.windowMs << " ms, L1.2 "
+                     << event.report.l12IdleRatio << " of idle, " << event.report.l1ExitsPerSecond
+                     << " L1 exits/s, up while idle >= " << event.report.upWhileIdleMs << " ms";
+    }
+}
+
+std::unordered_map<std::string, PcieAspmMonitor::Report> PcieAspmMonitor::getReports() {
+    std::scoped_lock lock(mLock);
+    std::unordered_map<std::string, Report> reports;
+    for (const auto &link : mLinks) {
+        if (link.hasReport) {
+            reports.emplace(link.config.name, link.report);
+        }
+    }
+    return reports;
+}
+
+std::vector<PcieAspmMonitor::Event> PcieAspmMonitor::getEvents() {
+    std::scoped_lock lock(mLock);
+    return std::vector<Event>(mEvents.begin(), mEvents.end());
+}
+
+static void dumpReport(const PcieAspmMonitor::Report &report, std::ostream &out) {
+    out << "at " << report.timestampMs << " ms: idle " << report.idleMs << "/" << report.windowMs
+        << " ms, L1.2 " << report.l12IdleRatio << " of idle, " << report.l1ExitsPerSecond
+        << " L1 exits/s, up while idle >= " << report.upWhileIdleMs << " ms"
+        << (report.regressed ? ", REGRESSED" : "") << "\n";
+}
+
+void PcieAspmMonitor::dump(std::ostream &out) {
+    for (const auto &[link, report] : getReports()) {
+        out << "  " << link << " latest ";
+        dumpReport(report, out);
+    }
+    out << "Regressions:\n";
+    for (const auto &event : getEvents()) {
+        out << "  " << event.link << " ";
+        dumpReport(event.report, out);
+    }
+}
+
+bool PcieAspmMonitor::getStateResidencies(
+        std::unordered_map<std::string, std::vector<StateResidency>> *residencies) {
+    std::scoped_lock lock(mLock);
+    for (const auto &link : mLinks) {
+        residencies->emplace(link.config.name + kEntitySuffix, link.residencies);
+    }
+    return true;
+}
+
+std::unordered_map<std::string, std::vector<State>> PcieAspmMonitor::getInfo() {
+    std::vector<State> states;
+    for (int32_t i = 0; i < STATE_COUNT; i++) {
+        states.push_back({.id = i, .name = kStateNames[i]});
+    }
+
+    std::unordered_map<std::string, std::vector<State>> info;
+    for (const auto &link : mLinks) {
+        info.emplace(link.config.name + kEntitySuffix, states);
+    }
+    return info;
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
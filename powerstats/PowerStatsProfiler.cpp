@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PowerStatsProfiler.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+// Read syscalls counted for reading /proc/thread-self/io once (the data, then EOF)
+static const int64_t kIoReadSyscalls = 2;
+
+static int64_t readSyscallCount() {
+    std::string io;
+    if (!::android::base::ReadFileToString("/proc/thread-self/io", &io)) {
+        return 0;
+    }
+
+    int64_t count = 0;
+    for (const auto &line : ::android::base::Split(io, "\n")) {
+        for (const char *prefix : {"syscr: ", "syscw: "}) {
+            int64_t value;
+            if (::android::base::StartsWith(line, prefix) &&
+                ::android::base::ParseInt(line.substr(strlen(prefix)), &value)) {
+                count += value;
+            }
+        }
+    }
+    return count;
+}
+
+PowerStatsProfiler::PowerStatsProfiler(std::shared_ptr<PowerStats> p) : mPowerStats(p) {}
+
+std::vector<PowerStatsProfiler::CallStats> PowerStatsProfiler::run(
+        int32_t iterations, std::chrono::milliseconds spacing) {
+    std::vector<CallStats> stats;
+    auto p = mPowerStats.lock();
+    if (!p || iterations <= 0) {
+        return stats;
+    }
+
+    const std::vector<std::pair<std::string, std::function<void()>>> calls = {
+            {"getStateResidency",
+             [&p] {
+                 std::vector<StateResidencyResult> results;
+                 p->getStateResidency({}, &results);
+             }},
+            {"getEnergyConsumed",
+             [&p] {
+                 std::vector<EnergyConsumerResult> results;
+                 p->getEnergyConsumed({}, &results);
+             }},
+            {"readEnergyMeter",
+             [&p] {
+                 std::vector<EnergyMeasurement> results;
+                 p->readEnergyMeter({}, &results);
+             }},
+    };
+
+    std::vector<int64_t> latenciesUs(iterations);
+    for (const auto &[name, call] : calls) {
+        const int64_t syscallsBefore = readSyscallCount();
+
+        for (int32_t i = 0; i < iterations; i++) {
+            // Sleeping does not read or write, so the syscall count is unaffected
+            std::this_thread::sleep_for(spacing);
+            const auto start = std::chrono::steady_clock::now();
+            call();
+            latenciesUs[i] = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
+
+        const int64_t syscalls = readSyscallCount() - syscallsBefore - kIoReadSyscalls;
+
+        std::sort(latenciesUs.begin(), latenciesUs.end());
+        stats.push_back({.call = name,
+                         .iterations = iterations,
+                         .p50Us = latenciesUs[iterations / 2],
+                         .p99Us = latenciesUs[std::min(iterations - 1, iterations * 99 / 100)],
+                         .maxUs = latenciesUs[iterations - 1],
+                         .readWriteSyscallsPerCall =
+                                 std::max<int64_t>(0, syscalls) / double(iterations)});
+    }
+    return stats;
+}
+
+bool PowerStatsProfiler::runAndCheck(int32_t iterations, std::chrono::milliseconds spacing,
+                                     const std::map<std::string, int64_t> &p99BudgetsUs) {
+    bool withinBudget = true;
+    for (const auto &s : run(iterations, spacing)) {
+        LOG(INFO) << s.call << " x" << s.iterations << ": p50 " << s.p50Us << " us, p99 "
+                  << s.p99Us << " us, max " << s.maxUs << " us, " << s.readWriteSyscallsPerCall
+                  << " read/write syscalls/call";
+
+        auto budget = p99BudgetsUs.find(s.call);
+        if (budget != p99BudgetsUs.end() && s.p99Us > budget->second) {
+            LOG(WARNING) << s.call << " p99 latency " << s.p99Us << " us exceeds its budget of "
+                         << budget->second << " us";
+            withinBudget = false;
+        }
+    }
+    return withinBudget;
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PowerStatsSharedMemoryExporter.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/logging.h>
+#include <cutils/ashmem.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+PowerStatsSharedMemoryExporter::PowerStatsSharedMemoryExporter(std::shared_ptr<PowerStats> p,
+                                                               std::chrono::milliseconds period)
+    : mPowerStats(p),
+      kPeriod(period),
+      mRegion(nullptr),
+      mRegionSize(0),
+      mHeader(nullptr),
+      mResidencies(nullptr),
+      mEnergies(nullptr),
+      mStopping(false) {}
+
+PowerStatsSharedMemoryExporter::~PowerStatsSharedMemoryExporter() {
+    {
+        std::scoped_lock lock(mLock);
+        mStopping = true;
+    }
+    mCv.notify_all();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+    if (mServerThread.joinable()) {
+        // Wakes up the pending accept
+        shutdown(mSocket, SHUT_RDWR);
+        mServerThread.join();
+    }
+    if (mRegion) {
+        munmap(mRegion, mRegionSize);
+    }
+}
+
+void PowerStatsSharedMemoryExporter::start(std::chrono::milliseconds initialDelay) {
+    mThread = std::thread(&PowerStatsSharedMemoryExporter::run, this, initialDelay);
+
+    mSocket.reset(TEMP_FAILURE_RETRY(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)));
+    if (mSocket == -1) {
+        PLOG(ERROR) << "Failed to create the shared memory export socket";
+        return;
+    }
+    sockaddr_un addr = {.sun_family = AF_UNIX};
+    memcpy(addr.sun_path + 1, kPowerStatsShmSocketName, sizeof(kPowerStatsShmSocketName) - 1);
+    const socklen_t addrLen = offsetof(sockaddr_un, sun_path) + sizeof(kPowerStatsShmSocketName);
+    if (bind(mSocket, reinterpret_cast<sockaddr *>(&addr), addrLen) || listen(mSocket, 4)) {
+        PLOG(ERROR) << "Failed to listen on @" << kPowerStatsShmSocketName;
+        mSocket.reset();
+        return;
+    }
+    mServerThread = std::thread(&PowerStatsSharedMemoryExporter::serve, this);
+}
+
+bool PowerStatsSharedMemoryExporter::mapRegion() {
+    auto p = mPowerStats.lock();
+    if (!p) {
+        return false;
+    }
+
+    std::vector<PowerEntity> entities;
+    std::vector<EnergyConsumer> consumers;
+    p->getPowerEntityInfo(&entities);
+    p->getEnergyConsumerInfo(&consumers);
+
+    size_t stateCount = 0;
+    for (const auto &entity : entities) {
+        if (entity.id >= mEntityOffsets.size()) {
+            mEntityOffsets.resize(entity.id + 1, 0);
+        }
+        mEntityOffsets[entity.id] = stateCount;
+        stateCount += entity.states.size();
+    }
+    for (size_t i = 0; i < consumers.size(); i++) {
+        if (consumers[i].id >= mConsumerOffsets.size()) {
+            mConsumerOffsets.resize(consumers[i].id + 1, 0);
+        }
+        mConsumerOffsets[consumers[i].id] = i;
+    }
+
+    const size_t size = sizeof(PowerStatsShmHeader) + stateCount * sizeof(PowerStatsShmResidency) +
+                        consumers.size() * sizeof(PowerStatsShmEnergy);
+
+    ::android::base::unique_fd fd(ashmem_create_region("powerstats_counters", size));
+    if (fd == -1) {
+        PLOG(ERROR) << "Failed to create the shared memory region";
+        return false;
+    }
+    void *region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to map the shared memory region";
+        return false;
+    }
+    // Only this mapping may write; the fd handed to readers maps read-only
+    if (ashmem_set_prot_region(fd, PROT_READ)) {
+        PLOG(ERROR) << "Failed to restrict the shared memory region";
+        munmap(region, size);
+        return false;
+    }
+
+    mRegion = region;
+    mRegionSize = size;
+    mHeader = new (region) PowerStatsShmHeader();
+    mResidencies = reinterpret_cast<PowerStatsShmResidency *>(mHeader + 1);
+    mEnergies = reinterpret_cast<PowerStatsShmEnergy *>(mResidencies + stateCount);
+
+    for (const auto &entity : entities) {
+        PowerStatsShmResidency *r = &mResidencies[mEntityOffsets[entity.id]];
+        for (const auto &state : entity.states) {
+            *r++ = {.entityId = entity.id, .stateId = state.id};
+        }
+    }
+    for (size_t i = 0; i < consumers.size(); i++) {
+        mEnergies[i] = {.consumerId = consumers[i].id};
+    }
+
+    mHeader->magic = kPowerStatsShmMagic;
+    mHeader->version = kPowerStatsShmVersion;
+    mHeader->entityStateCount = stateCount;
+    mHeader->consumerCount = consumers.size();
+    mHeader->sequence.store(0, std::memory_order_release);
+    mRegionFd = std::move(fd);
+
+    LOG(INFO) << "Exporting " << stateCount << " residencies and " << consumers.size()
+              << " energy consumers on @" << kPowerStatsShmSocketName;
+    return true;
+}
+
+void PowerStatsSharedMemoryExporter::update() {
+    auto p = mPowerStats.lock();
+    if (!p) {
+        return;
+    }
+
+    // Collect everything before entering the write section so readers retry as little as
+    // possible.
+    std::vector<StateResidencyResult> residencies;
+    std::vector<EnergyConsumerResult> energies;
+    p->getStateResidency({}, &residencies);
+    p->getEnergyConsumed({}, &energies);
+    const int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            ::android::base::boot_clock::now().time_since_epoch()).count();
+
+    const uint32_t seq = mHeader->sequence.load(std::memory_order_relaxed);
+    mHeader->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const size_t stateCount = mHeader->entityStateCount;
+    for (const auto &result : residencies) {
+        if (result.id < 0 || result.id >= mEntityOffsets.size()) {
+            continue;
+        }
+        const size_t offset = mEntityOffsets[result.id];
+        for (const auto &residency : result.stateResidencyData) {
+            // State ids are normally the index of the state within its entity
+            size_t i = offset + residency.id;
+            if (i >= stateCount || mResidencies[i].entityId != result.id ||
+                mResidencies[i].stateId != residency.id) {
+                for (i = offset; i < stateCount && mResidencies[i].entityId == result.id; i++) {
+                    if (mResidencies[i].stateId == residency.id) {
+                        break;
+                    }
+                }
+                if (i >= stateCount || mResidencies[i].entityId != result.id) {
+                    continue;
+                }
+            }
+            mResidencies[i].totalTimeInStateMs = residency.totalTimeInStateMs;
+            mResidencies[i].totalStateEntryCount = residency.totalStateEntryCount;
+            mResidencies[i].lastEntryTimestampMs = residency.lastEntryTimestampMs;
+        }
+    }
+    for (const auto &energy : energies) {
+        if (energy.id < 0 || energy.id >= mConsumerOffsets.size()) {
+            continue;
+        }
+        PowerStatsShmEnergy *e = &mEnergies[mConsumerOffsets[energy.id]];
+        e->timestampMs = energy.timestampMs;
+        e->energyUWs = energy.energyUWs;
+    }
+    mHeader->timestampMs = nowMs;
+
+    mHeader->sequence.store(seq + 2, std::memory_order_release);
+}
+
+void PowerStatsSharedMemoryExporter::run(std::chrono::milliseconds initialDelay) {
+    std::unique_lock lock(mLock);
+
+    // The layout is mapped on the first update, so it must come after the providers registered
+    // after the common set
+    std::chrono::milliseconds delay = std::max(initialDelay, kPeriod);
+    while (!mStopping) {
+        mCv.wait_for(lock, delay, [this] { return mStopping; });
+        delay = kPeriod;
+        if (mStopping) {
+            break;
+        }
+        if (!mRegion && !mapRegion()) {
+            LOG(ERROR) << "Shared memory export disabled";
+            break;
+        }
+        lock.unlock();
+        update();
+        lock.lock();
+    }
+}
+
+void PowerStatsSharedMemoryExporter::serve() {
+    while (true) {
+        ::android::base::unique_fd client(
+                TEMP_FAILURE_RETRY(accept4(mSocket, nullptr, nullptr, SOCK_CLOEXEC)));
+        if (client == -1) {
+            if (errno == ECONNABORTED) {
+                continue;
+            }
+            // Including the shutdown by the destructor
+            break;
+        }
+
+        // Clients connecting before the first update are turned away and retry
+        std::scoped_lock lock(mLock);
+        if (mRegionFd == -1) {
+            continue;
+        }
+        const uint64_t size = mRegionSize;
+        if (::android::base::SendFileDescriptors(client, &size, sizeof(size), mRegionFd.get()) !=
+            sizeof(size)) {
+            PLOG(WARNING) << "Failed to send the shared memory region";
+        }
+    }
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
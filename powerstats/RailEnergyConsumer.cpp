@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RailEnergyConsumer.h"
+
+#include <android-base/logging.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+static std::mutex gTrackersLock;
+static std::unordered_map<std::string, RailBreakdownTracker *> gTrackers;
+
+RailBreakdownTracker::RailBreakdownTracker(
+        std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter, const std::string &consumer,
+        const std::set<std::string> &rails)
+    : kConsumer(consumer), mComplete(false) {
+    std::vector<Channel> channels;
+    meter->getEnergyMeterInfo(&channels);
+    for (const auto &c : channels) {
+        if (rails.count(c.name)) {
+            mChannelIds.push_back(c.id);
+            mRails.push_back(c.name);
+        }
+    }
+    mComplete = !rails.empty() && mChannelIds.size() == rails.size();
+    if (!mComplete) {
+        LOG(ERROR) << kConsumer << ": not all energy meter channels were found";
+    }
+
+    std::scoped_lock lock(gTrackersLock);
+    gTrackers[kConsumer] = this;
+}
+
+RailBreakdownTracker::~RailBreakdownTracker() {
+    std::scoped_lock lock(gTrackersLock);
+    auto it = gTrackers.find(kConsumer);
+    if (it != gTrackers.end() && it->second == this) {
+        gTrackers.erase(it);
+    }
+}
+
+void RailBreakdownTracker::update(const std::vector<EnergyMeasurement> &measurements) {
+    std::scoped_lock lock(mLock);
+    if (measurements.size() != mChannelIds.size()) {
+        return;
+    }
+    // Reads served from the same meter snapshot do not open a new window
+    if (!mLatest.empty() && measurements[0].timestampMs == mLatest[0].timestampMs) {
+        return;
+    }
+    mPrevious = std::move(mLatest);
+    mLatest = measurements;
+}
+
+bool RailBreakdownTracker::get(RailBreakdown *breakdown) {
+    std::scoped_lock lock(mLock);
+    if (mLatest.empty()) {
+        return false;
+    }
+
+    const auto [oldest, newest] = std::minmax_element(mLatest.begin(), mLatest.end(),
+            [](const EnergyMeasurement &a, const EnergyMeasurement &b) {
+                return a.timestampMs < b.timestampMs;
+            });
+    breakdown->timestampMs = mLatest[0].timestampMs;
+    breakdown->windowMs = mPrevious.empty() ? 0 : mLatest[0].timestampMs - mPrevious[0].timestampMs;
+    breakdown->skewMs = newest->timestampMs - oldest->timestampMs;
+    breakdown->rails.clear();
+    for (size_t i = 0; i < mLatest.size(); i++) {
+        int64_t averagePowerUW = 0;
+        if (breakdown->windowMs > 0) {
+            averagePowerUW = (mLatest[i].energyUWs - mPrevious[i].energyUWs) * 1000 /
+                             breakdown->windowMs;
+        }
+        breakdown->rails.push_back({.rail = mRails[i],
+                                    .energyUWs = mLatest[i].energyUWs,
+                                    .averagePowerUW = averagePowerUW});
+    }
+    return true;
+}
+
+bool RailBreakdownTracker::query(std::shared_ptr<PowerStats> p, const std::string &consumer,
+                                 RailBreakdown *breakdown) {
+    std::vector<EnergyConsumer> consumers;
+    p->getEnergyConsumerInfo(&consumers);
+    for (const auto &c : consumers) {
+        if (c.name == consumer) {
+            std::vector<EnergyConsumerResult> results;
+            p->getEnergyConsumed({c.id}, &results);
+            break;
+        }
+    }
+    return getLast(consumer, breakdown);
+}
+
+bool RailBreakdownTracker::getLast(const std::string &consumer, RailBreakdown *breakdown) {
+    std::scoped_lock lock(gTrackersLock);
+    auto it = gTrackers.find(consumer);
+    return it != gTrackers.end() && it->second->get(breakdown);
+}
+
+RailEnergyConsumer::RailEnergyConsumer(
+        std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter, EnergyConsumerType type,
+        const std::string &name, const std::set<std::string> &rails)
+    : kType(type), kName(name), mMeter(meter), mTracker(meter, name, rails) {}
+
+std::optional<EnergyConsumerResult> RailEnergyConsumer::getEnergyConsumed() {
+    if (!mTracker.isComplete()) {
+        return {};
+    }
+
+    std::vector<EnergyMeasurement> measurements;
+    if (!mMeter->readEnergyMeter(mTracker.getChannelIds(), &measurements).isOk() ||
+        measurements.size() != mTracker.getChannelIds().size()) {
+        LOG(ERROR) << "Failed to read energy meter";
+        return {};
+    }
+    mTracker.update(measurements);
+
+    int64_t totalEnergyUWs = 0;
+    int64_t timestampMs = 0;
+    for (const auto &m : measurements) {
+        totalEnergyUWs += m.energyUWs;
+        timestampMs = m.timestampMs;
+    }
+    return EnergyConsumerResult{.timestampMs = timestampMs, .energyUWs = totalEnergyUWs};
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ResidencyHistoryStore.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/logging.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+static const int64_t MS_PER_MINUTE = 60 * 1000;
+static const int64_t MS_PER_DAY = 24 * 60 * MS_PER_MINUTE;
+
+static int64_t bootTimeMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            ::android::base::boot_clock::now().time_since_epoch()).count();
+}
+
+static void putVarint(uint64_t v, std::vector<uint8_t> *out) {
+    while (v >= 0x80) {
+        out->push_back(static_cast<uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    out->push_back(static_cast<uint8_t>(v));
+}
+
+static void putSigned(int64_t v, std::vector<uint8_t> *out) {
+    // Zigzag so that small negative values stay short
+    putVarint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63), out);
+}
+
+static bool getVarint(const uint8_t **cp, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *cp < end && shift < 64; shift += 7) {
+        const uint8_t byte = *(*cp)++;
+        *v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool getSigned(const uint8_t **cp, const uint8_t *end, int64_t *v) {
+    uint64_t u;
+    if (!getVarint(cp, end, &u)) {
+        return false;
+    }
+    *v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+    return true;
+}
+
+/*
+ * Each changed series is stored as the distance from the previous series index followed by
+ * its two deltas (time in state and entry count, or energy and 0).
+ */
+static std::vector<uint8_t> encode(const std::map<uint32_t, std::pair<int64_t, int64_t>> &deltas) {
+    std::vector<uint8_t> data;
+    uint32_t previous = 0;
+    for (const auto &[series, delta] : deltas) {
+        putVarint(series - previous, &data);
+        putSigned(delta.first, &data);
+        putSigned(delta.second, &data);
+        previous = series;
+    }
+    data.shrink_to_fit();
+    return data;
+}
+
+ResidencyHistoryStore::ResidencyHistoryStore(std::shared_ptr<PowerStats> p,
+                                             std::chrono::milliseconds period)
+    : mPowerStats(p), kPeriod(period), mLastSampleMs(0), mStopping(false) {
+    mRings.push_back({.resolutionMs = period.count(),
+                      .retentionMs = 10 * MS_PER_MINUTE,
+                      .pendingStartMs = -1,
+                      .pendingEndMs = -1});
+    mRings.push_back({.resolutionMs = MS_PER_MINUTE,
+                      .retentionMs = MS_PER_DAY,
+                      .pendingStartMs = -1,
+                      .pendingEndMs = -1});
+    mRings.push_back({.resolutionMs = 15 * MS_PER_MINUTE,
+                      .retentionMs = 7 * MS_PER_DAY,
+                      .pendingStartMs = -1,
+                      .pendingEndMs = -1});
+}
+
+ResidencyHistoryStore::~ResidencyHistoryStore() {
+    {
+        std::scoped_lock lock(mLock);
+        mStopping = true;
+    }
+    mCv.notify_all();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+void ResidencyHistoryStore::start(std::chrono::milliseconds initialDelay) {
+    mThread = std::thread(&ResidencyHistoryStore::run, this, initialDelay);
+}
+
+uint32_t ResidencyHistoryStore::getSeriesLocked(bool energy, int32_t id, int32_t stateId) {
+    auto [it, inserted] = mSeriesIndex.try_emplace({energy, id, stateId}, mSeries.size());
+    if (inserted) {
+        mSeries.push_back({.energy = energy, .id = id, .stateId = stateId});
+        mLast.emplace_back(0, 0);
+        mHasLast.push_back(false);
+    }
+    return it->second;
+}
+
+void ResidencyHistoryStore::addDeltaLocked(uint32_t series, int64_t value, int64_t count,
+                                           Deltas *deltas) {
+    auto &last = mLast[series];
+    if (mHasLast[series]) {
+        int64_t valueDelta = value - last.first;
+        int64_t countDelta = count - last.second;
+        // A counter going backwards was reset by its provider
+        if (valueDelta < 0 || countDelta < 0) {
+            valueDelta = value;
+            countDelta = count;
+        }
+        if (valueDelta != 0 || countDelta != 0) {
+            (*deltas)[series] = {valueDelta, countDelta};
+        }
+    }
+    last = {value, count};
+    mHasLast[series] = true;
+}
+
+void ResidencyHistoryStore::appendLocked(Ring *ring, int64_t startMs, int64_t durationMs,
+                                         const Deltas &deltas) {
+    const int64_t endMs = startMs + durationMs;
+
+    if (ring->resolutionMs <= kPeriod.count()) {
+        ring->buckets.push_back({.startMs = startMs, .durationMs = durationMs,
+                                 .data = encode(deltas)});
+    } else {
+        // Coarse buckets are aligned to their resolution and hold the samples ending in them
+        const int64_t bucketStartMs = endMs - endMs % ring->resolutionMs;
+        if (bucketStartMs != ring->pendingStartMs) {
+            if (ring->pendingStartMs >= 0) {
+                ring->buckets.push_back({.startMs = ring->pendingStartMs,
+                                         .durationMs = ring->resolutionMs,
+                                         .data = encode(ring->pending)});
+            }
+            ring->pending.clear();
+            ring->pendingStartMs = bucketStartMs;
+        }
+        ring->pendingEndMs = endMs;
+        for (const auto &[series, delta] : deltas) {
+            auto &sum = ring->pending[series];
+            sum.first += delta.first;
+            sum.second += delta.second;
+        }
+    }
+
+    while (!ring->buckets.empty() &&
+           ring->buckets.front().startMs + ring->buckets.front().durationMs <=
+                   endMs - ring->retentionMs) {
+        ring->buckets.pop_front();
+    }
+}
+
+void ResidencyHistoryStore::decodeLocked(const Bucket &bucket, Sample *sample) {
+    sample->startMs = bucket.startMs;
+    sample->durationMs = bucket.durationMs;
+
+    std::unordered_map<int32_t, size_t> entityIndex;
+    const uint8_t *cp = bucket.data.data();
+    const uint8_t *end = cp + bucket.data.size();
+    uint64_t series = 0;
+    while (cp < end) {
+        uint64_t distance;
+        int64_t value;
+        int64_t count;
+        if (!getVarint(&cp, end, &distance) || !getSigned(&cp, end, &value) ||
+            !getSigned(&cp, end, &count)) {
+            LOG(ERROR) << "Truncated history bucket at " << bucket.startMs;
+            break;
+        }
+        series += distance;
+        if (series >= mSeries.size()) {
+            break;
+        }
+
+        const Series &s = mSeries[series];
+        if (s.energy) {
+            sample->energies.push_back({.id = s.id,
+                                        .timestampMs = bucket.startMs + bucket.durationMs,
+                                        .energyUWs = value});
+            continue;
+        }
+        auto [it, inserted] = entityIndex.try_emplace(s.id, sample->residencies.size());
+        if (inserted) {
+            sample->residencies.push_back({.id = s.id});
+        }
+        sample->residencies[it->second].stateResidencyData.push_back(
+                {.id = s.stateId, .totalTimeInStateMs = value, .totalStateEntryCount = count});
+    }
+}
+
+int64_t ResidencyHistoryStore::getOldestMs(const Ring &ring) {
+    if (!ring.buckets.empty()) {
+        return ring.buckets.front().startMs;
+    }
+    return ring.pendingStartMs;
+}
+
+void ResidencyHistoryStore::query(int64_t startMs, int64_t endMs, std::vector<Sample> *samples) {
+    std::scoped_lock lock(mLock);
+
+    const Ring *ring = nullptr;
+    for (const auto &r : mRings) {
+        const int64_t oldestMs = getOldestMs(r);
+        if (oldestMs < 0) {
+            continue;
+        }
+        if (oldestMs <= startMs) {
+            ring = &r;
+            break;
+        }
+        if (!ring || oldestMs < getOldestMs(*ring)) {
+            ring = &r;
+        }
+    }
+    if (!ring) {
+        return;
+    }
+
+    auto append = [&](const Bucket &bucket) {
+        if (bucket.startMs + bucket.durationMs <= startMs || bucket.startMs >= endMs) {
+            return;
+        }
+        Sample sample;
+        decodeLocked(bucket, &sample);
+        samples->push_back(std::move(sample));
+    };
+    for (const auto &bucket : ring->buckets) {
+        if (bucket.startMs >= endMs) {
+            break;
+        }
+        append(bucket);
+    }
+    // The bucket still being filled covers the most recent samples, up to the last read
+    if (ring->pendingStartMs >= 0) {
+        append({.startMs = ring->pendingStartMs,
+                .durationMs = ring->pendingEndMs - ring->pendingStartMs,
+                .data = encode(ring->pending)});
+    }
+}
+
+size_t ResidencyHistoryStore::getEncodedSize() {
+    std::scoped_lock lock(mLock);
+    size_t size = 0;
+    for (const auto &ring : mRings) {
+        for (const auto &bucket : ring.buckets) {
+            size += bucket.data.size();
+        }
+    }
+    return size;
+}
+
+void ResidencyHistoryStore::sample() {
+    auto p = mPowerStats.lock();
+    if (!p) {
+        return;
+    }
+
+    std::vector<StateResidencyResult> residencies;
+    std::vector<EnergyConsumerResult> energies;
+    p->getStateResidency({}, &residencies);
+    p->getEnergyConsumed({}, &energies);
+    const int64_t nowMs = bootTimeMs();
+
+    std::scoped_lock lock(mLock);
+    Deltas deltas;
+    for (const auto &result : residencies) {
+        for (const auto &residency : result.stateResidencyData) {
+            addDeltaLocked(getSeriesLocked(false, result.id, residency.id),
+                           residency.totalTimeInStateMs, residency.totalStateEntryCount, &deltas);
+        }
+    }
+    for (const auto &energy : energies) {
+        addDeltaLocked(getSeriesLocked(true, energy.id, 0), energy.energyUWs, 0, &deltas);
+    }
+
+    // The first read only establishes the baseline
+    if (mLastSampleMs == 0) {
+        mLastSampleMs = nowMs;
+        return;
+    }
+    const int64_t startMs = mLastSampleMs;
+    mLastSampleMs = nowMs;
+    for (auto &ring : mRings) {
+        appendLocked(&ring, startMs, nowMs - startMs, deltas);
+    }
+}
+
+void ResidencyHistoryStore::run(std::chrono::milliseconds initialDelay) {
+    std::unique_lock lock(mLock);
+
+    auto delay = initialDelay;
+    while (!mStopping) {
+        mCv.wait_for(lock, delay, [this] { return mStopping; });
+        delay = kPeriod;
+        if (mStopping) {
+            break;
+        }
+        lock.unlock();
+        sample();
+        lock.lock();
+    }
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
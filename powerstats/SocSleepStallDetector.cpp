@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SocSleepStallDetector.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+
+#include <algorithm>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+static const std::string kEntityName = "SoC-SleepStall";
+static const std::string kUnknownRequester = "UNKNOWN";
+static const std::vector<std::string> kSleepStates = {"SLEEP", "SLEEP_SLCMON", "SLEEP_HSI1ON",
+                                                      "STOP"};
+// A window is stalled when deep sleep and MIF down each cover less than this share of it
+static const double kMinSleepRatio = 0.1;
+// A requester is blamed when it held MIF or SLC up for at least this share of the window
+static const double kMinHoldRatio = 0.5;
+static const size_t kMaxEvents = 64;
+
+SocSleepStallDetector::SocSleepStallDetector(std::shared_ptr<PowerStats> p,
+                                             std::vector<Requester> requesters,
+                                             const std::string &displayStatePath)
+    : mPowerStats(p),
+      kRequesters(std::move(requesters)),
+      kDisplayStatePath(displayStatePath),
+      mSubscription(-1),
+      mResolved(false),
+      mLpmId(-1),
+      mMifId(-1),
+      mDisplayWasOff(false) {
+    mStalls.resize(kRequesters.size() + 1);
+    for (size_t i = 0; i < mStalls.size(); i++) {
+        mStalls[i].id = i;
+    }
+}
+
+SocSleepStallDetector::~SocSleepStallDetector() {
+    auto manager = mManager.lock();
+    if (manager && mSubscription != -1) {
+        manager->unsubscribe(mSubscription);
+    }
+}
+
+void SocSleepStallDetector::start(std::shared_ptr<StateResidencySubscriptionManager> manager,
+                                  std::chrono::milliseconds window) {
+    std::vector<std::string> entities = {"LPM", "MIF"};
+    for (const auto &requester : kRequesters) {
+        if (std::find(entities.begin(), entities.end(), requester.entity) == entities.end()) {
+            entities.push_back(requester.entity);
+        }
+    }
+
+    mManager = manager;
+    mSubscription = manager->subscribe(entities, window, {.timeInStateMs = 0, .entryCount = 0},
+            [this](const std::vector<StateResidencySubscriptionManager::StateDelta> &deltas) {
+                onDeltas(deltas);
+            });
+    if (mSubscription == -1) {
+        LOG(ERROR) << "SoC sleep stall detection disabled";
+    }
+}
+
+bool SocSleepStallDetector::resolveStatesLocked() {
+    auto p = mPowerStats.lock();
+    if (!p) {
+        return false;
+    }
+    std::vector<PowerEntity> entities;
+    p->getPowerEntityInfo(&entities);
+
+    auto findState = [](const PowerEntity &entity, const std::string &name) {
+        for (const auto &state : entity.states) {
+            if (state.name == name) {
+                return state.id;
+            }
+        }
+        return -1;
+    };
+
+    mRequesterStates.assign(kRequesters.size(), {-1, -1});
+    for (const auto &entity : entities) {
+        if (entity.name == "LPM") {
+            mLpmId = entity.id;
+            for (const auto &name : kSleepStates) {
+                const int32_t state = findState(entity, name);
+                if (state != -1) {
+                    mLpmSleepStates.push_back(state);
+                }
+            }
+        } else if (entity.name == "MIF") {
+            mMifId = entity.id;
+        }
+        for (size_t i = 0; i < kRequesters.size(); i++) {
+            if (entity.name == kRequesters[i].entity) {
+                mRequesterStates[i] = {entity.id, findState(entity, kRequesters[i].state)};
+            }
+        }
+    }
+
+    mResolved = mLpmId != -1 && mMifId != -1 && !mLpmSleepStates.empty();
+    if (!mResolved) {
+        LOG(ERROR) << "SoC power entities not found";
+    }
+    return mResolved;
+}
+
+bool SocSleepStallDetector::isDisplayOff() {
+    std::string state;
+    if (!::android::base::ReadFileToString(kDisplayStatePath, &state)) {
+        return false;
+    }
+    // "Off", "LP: <mode>" in AOD, or "On: <mode>"
+    return ::android::base::StartsWith(state, "Off") || ::android::base::StartsWith(state, "LP");
+}
+
+void SocSleepStallDetector::onDeltas(
+        const std::vector<StateResidencySubscriptionManager::StateDelta> &deltas) {
+    // Subscribed with a zero threshold: every delta covers the time since the previous read
+    const int64_t elapsedMs = deltas.front().elapsedMs;
+    const bool displayOff = isDisplayOff();
+    const int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            ::android::base::boot_clock::now().time_since_epoch()).count();
+
+    std::unique_lock lock(mLock);
+    const bool displayWasOff = mDisplayWasOff;
+    mDisplayWasOff = displayOff;
+    if (!displayWasOff || !displayOff || elapsedMs <= 0) {
+        return;
+    }
+    if (!mResolved && !resolveStatesLocked()) {
+        return;
+    }
+
+    int64_t sleepMs = 0;
+    int64_t mifDownMs = 0;
+    std::vector<int64_t> holdMs(kRequesters.size(), 0);
+    for (const auto &delta : deltas) {
+        const StateResidency &residency = delta.residency;
+        if (delta.entityId == mLpmId &&
+            std::find(mLpmSleepStates.begin(), mLpmSleepStates.end(), residency.id) !=
+                    mLpmSleepStates.end()) {
+            sleepMs += residency.totalTimeInStateMs;
+        } else if (delta.entityId == mMifId) {
+            mifDownMs += residency.totalTimeInStateMs;
+        }
+        for (size_t i = 0; i < kRequesters.size(); i++) {
+            if (mRequesterStates[i] == std::make_pair(delta.entityId, residency.id)) {
+                holdMs[i] += residency.totalTimeInStateMs;
+            }
+        }
+    }
+
+    if (sleepMs >= kMinSleepRatio * elapsedMs || mifDownMs >= kMinSleepRatio * elapsedMs) {
+        return;
+    }
+
+    size_t blamed = kRequesters.size();
+    const auto longest = std::max_element(holdMs.begin(), holdMs.end());
+    if (longest != holdMs.end() && *longest >= kMinHoldRatio * elapsedMs) {
+        blamed = longest - holdMs.begin();
+    }
+
+    const Event event = {.timestampMs = nowMs,
+                         .windowMs = static_cast<int32_t>(elapsedMs),
+                         .sleepMs = static_cast<int32_t>(sleepMs),
+                         .mifDownMs = static_cast<int32_t>(mifDownMs),
+                         .requester = static_cast<int32_t>(blamed),
+                         .requesterHoldMs = blamed < holdMs.size()
+                                                    ? static_cast<int32_t>(holdMs[blamed]) : 0};
+    mEvents.push_back(event);
+    if (mEvents.size() > kMaxEvents) {
+        mEvents.pop_front();
+    }
+
+    StateResidency &stall = mStalls[blamed];
+    stall.totalStateEntryCount++;
+    stall.totalTimeInStateMs += elapsedMs - sleepMs;
+    stall.lastEntryTimestampMs = nowMs - elapsedMs;
+    lock.unlock();
+
+    LOG(WARNING) << "SoC sleep stalled for " << event.windowMs << " ms with display off: sleep "
+                 << event.sleepMs << " ms, MIF down " << event.mifDownMs << " ms, blamed "
+                 << (blamed < kRequesters.size() ? kRequesters[blamed].name : kUnknownRequester)
+                 << " (" << event.requesterHoldMs << " ms)";
+}
+
+std::vector<SocSleepStallDetector::Event> SocSleepStallDetector::getEvents() {
+    std::scoped_lock lock(mLock);
+    return std::vector<Event>(mEvents.begin(), mEvents.end());
+}
+
+void SocSleepStallDetector::dump(std::ostream &out) {
+    const auto events = getEvents();
+    if (events.empty()) {
+        out << "No stall\n";
+        return;
+    }
+    for (const auto &event : events) {
+        out << "  at " << event.timestampMs << " ms: window " << event.windowMs << " ms, sleep "
+            << event.sleepMs << " ms, MIF down " << event.mifDownMs << " ms, blamed "
+            << (event.requester < static_cast<int32_t>(kRequesters.size())
+                        ? kRequesters[event.requester].name : kUnknownRequester)
+            << " (" << event.requesterHoldMs << " ms)\n";
+    }
+}
+
+bool SocSleepStallDetector::getStateResidencies(
+        std::unordered_map<std::string, std::vector<StateResidency>> *residencies) {
+    std::scoped_lock lock(mLock);
+    residencies->emplace(kEntityName, mStalls);
+    return true;
+}
+
+std::unordered_map<std::string, std::vector<State>> SocSleepStallDetector::getInfo() {
+    std::vector<State> states;
+    for (size_t i = 0; i < kRequesters.size(); i++) {
+        states.push_back({.id = static_cast<int32_t>(i), .name = kRequesters[i].name});
+    }
+    states.push_back({.id = static_cast<int32_t>(kRequesters.size()), .name = kUnknownRequester});
+    return {{kEntityName, states}};
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StateResidencySubscriptionManager.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/logging.h>
+
+#include <algorithm>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+static int64_t bootTimeMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            ::android::base::boot_clock::now().time_since_epoch()).count();
+}
+
+StateResidencySubscriptionManager::StateResidencySubscriptionManager(std::shared_ptr<PowerStats> p)
+    : mPowerStats(p), mNextId(1), mStopping(false) {}
+
+StateResidencySubscriptionManager::~StateResidencySubscriptionManager() {
+    {
+        std::scoped_lock lock(mLock);
+        mStopping = true;
+    }
+    mCv.notify_all();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+void StateResidencySubscriptionManager::start(std::chrono::milliseconds initialDelay) {
+    std::scoped_lock lock(mLock);
+    if (mThread.joinable()) {
+        return;
+    }
+
+    // Subscriptions made during registration get their baseline after the delay
+    mFirstRead = std::chrono::steady_clock::now() + initialDelay;
+    for (auto &[interval, group] : mGroups) {
+        group.nextRead = mFirstRead;
+    }
+    mThread = std::thread(&StateResidencySubscriptionManager::run, this);
+}
+
+bool StateResidencySubscriptionManager::resolveEntityIdsLocked(
+        const std::vector<std::string> &entityNames, std::vector<int32_t> *ids) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        ids->clear();
+        bool complete = true;
+        for (const auto &name : entityNames) {
+            auto it = mEntityIds.find(name);
+            if (it == mEntityIds.end()) {
+                complete = false;
+            } else {
+                ids->push_back(it->second);
+            }
+        }
+        if (complete || attempt > 0) {
+            break;
+        }
+
+        // Entities may have been registered since the last lookup
+        auto p = mPowerStats.lock();
+        if (!p) {
+            break;
+        }
+        std::vector<PowerEntity> entities;
+        p->getPowerEntityInfo(&entities);
+        mEntityIds.clear();
+        for (const auto &entity : entities) {
+            mEntityIds.emplace(entity.name, entity.id);
+        }
+    }
+    return !ids->empty();
+}
+
+int32_t StateResidencySubscriptionManager::subscribe(const std::vector<std::string> &entityNames,
+                                                     std::chrono::milliseconds minInterval,
+                                                     const Threshold &threshold,
+                                                     Callback callback) {
+    std::scoped_lock lock(mLock);
+
+    Subscription sub = {.threshold = threshold, .callback = std::move(callback)};
+    if (!resolveEntityIdsLocked(entityNames, &sub.entityIds)) {
+        LOG(ERROR) << "No known power entity to subscribe to";
+        return -1;
+    }
+
+    const int32_t id = mNextId++;
+    mSubscriptions.emplace(id, std::move(sub));
+
+    auto [group, created] = mGroups.try_emplace(minInterval);
+    group->second.subscriptionIds.push_back(id);
+    if (created) {
+        // Read right away to establish the baseline of the new cadence, but not before the
+        // first read
+        group->second.nextRead = std::max(std::chrono::steady_clock::now(), mFirstRead);
+    }
+    mCv.notify_all();
+    return id;
+}
+
+void StateResidencySubscriptionManager::unsubscribe(int32_t id) {
+    std::scoped_lock lock(mLock);
+
+    if (!mSubscriptions.erase(id)) {
+        return;
+    }
+    for (auto it = mGroups.begin(); it != mGroups.end(); it++) {
+        auto &ids = it->second.subscriptionIds;
+        ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+        if (ids.empty()) {
+            mGroups.erase(it);
+            break;
+        }
+    }
+}
+
+void StateResidencySubscriptionManager::readGroup(std::chrono::milliseconds interval) {
+    std::vector<int32_t> entityIds;
+    {
+        std::scoped_lock lock(mLock);
+        auto group = mGroups.find(interval);
+        if (group == mGroups.end()) {
+            return;
+        }
+        for (const auto id : group->second.subscriptionIds) {
+            const auto &ids = mSubscriptions.at(id).entityIds;
+            entityIds.insert(entityIds.end(), ids.begin(), ids.end());
+        }
+    }
+    std::sort(entityIds.begin(), entityIds.end());
+    entityIds.erase(std::unique(entityIds.begin(), entityIds.end()), entityIds.end());
+
+    auto p = mPowerStats.lock();
+    if (!p) {
+        return;
+    }
+    std::vector<StateResidencyResult> results;
+    if (!p->getStateResidency(entityIds, &results).isOk()) {
+        LOG(ERROR) << "Failed to read state residency for subscribers";
+        return;
+    }
+    const int64_t nowMs = bootTimeMs();
+
+    std::vector<std::pair<Callback, std::vector<StateDelta>>> deliveries;
+    {
+        std::scoped_lock lock(mLock);
+        auto group = mGroups.find(interval);
+        if (group == mGroups.end()) {
+            return;
+        }
+
+        for (const auto id : group->second.subscriptionIds) {
+            Subscription &sub = mSubscriptions.at(id);
+            std::vector<StateDelta> deltas;
+
+            for (const auto &result : results) {
+                if (std::find(sub.entityIds.begin(), sub.entityIds.end(), result.id) ==
+                    sub.entityIds.end()) {
+                    continue;
+                }
+
+                auto &baseline = sub.baseline[result.id];
+                for (const auto &residency : result.stateResidencyData) {
+                    auto base = std::find_if(baseline.begin(), baseline.end(),
+                            [&](const Baseline &b) { return b.residency.id == residency.id; });
+                    if (base == baseline.end()) {
+                        // First read of this state
+                        baseline.push_back({.residency = residency, .timeMs = nowMs});
+                        continue;
+                    }
+
+                    const int64_t timeDelta = residency.totalTimeInStateMs -
+                                              base->residency.totalTimeInStateMs;
+                    const int64_t countDelta = residency.totalStateEntryCount -
+                                               base->residency.totalStateEntryCount;
+                    if (timeDelta == 0 && countDelta == 0) {
+                        // Nothing to accumulate: the next delta starts from this read
+                        base->timeMs = nowMs;
+                        continue;
+                    }
+                    const bool timeMet = sub.threshold.timeInStateMs > 0 &&
+                                         timeDelta >= sub.threshold.timeInStateMs;
+                    const bool countMet = sub.threshold.entryCount > 0 &&
+                                          countDelta >= sub.threshold.entryCount;
+                    const bool anyChange = sub.threshold.timeInStateMs <= 0 &&
+                                           sub.threshold.entryCount <= 0;
+                    if (!timeMet && !countMet && !anyChange) {
+                        continue;
+                    }
+
+                    deltas.push_back(
+                            {.entityId = result.id,
+                             .residency = {.id = residency.id,
+                                           .totalTimeInStateMs = timeDelta,
+                                           .totalStateEntryCount = countDelta,
+                                           .lastEntryTimestampMs =
+                                                   residency.lastEntryTimestampMs},
+                             .elapsedMs = nowMs - base->timeMs});
+                    *base = {.residency = residency, .timeMs = nowMs};
+                }
+            }
+
+            if (!deltas.empty()) {
+                deliveries.emplace_back(sub.callback, std::move(deltas));
+            }
+        }
+    }
+
+    // Callbacks run without the lock so that they may subscribe or unsubscribe
+    for (const auto &[callback, deltas] : deliveries) {
+        callback(deltas);
+    }
+}
+
+void StateResidencySubscriptionManager::run() {
+    std::unique_lock lock(mLock);
+
+    while (!mStopping) {
+        if (mGroups.empty()) {
+            mCv.wait(lock);
+            continue;
+        }
+
+        auto due = mGroups.begin();
+        for (auto it = mGroups.begin(); it != mGroups.end(); it++) {
+            if (it->second.nextRead < due->second.nextRead) {
+                due = it;
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now < due->second.nextRead) {
+            // Woken early whenever subscriptions change
+            mCv.wait_until(lock, due->second.nextRead);
+            continue;
+        }
+
+        const auto interval = due->first;
+        due->second.nextRead = now + interval;
+        lock.unlock();
+        readGroup(interval);
+        lock.lock();
+    }
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
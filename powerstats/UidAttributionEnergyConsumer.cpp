@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UidAttributionEnergyConsumer.h"
+
+#include <android-base/logging.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+static const char kHeaderPrefix[] = "uid:";
+static const size_t kInitialBufferSize = 64 * 1024;
+
+UidAttributionEnergyConsumer::UidAttributionEnergyConsumer(
+        std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter, EnergyConsumerType type,
+        const std::string &name, const std::set<std::string> &channelNames,
+        const std::string &uidTimeInStatePath, const std::map<std::string, int32_t> &stateCoeffs)
+    : kType(type),
+      kName(name),
+      kPath(uidTimeInStatePath),
+      kStateCoeffs(stateCoeffs),
+      mMeter(meter),
+      mTracker(meter, name, channelNames),
+      mLastEnergyUWs(0),
+      mRebaseline(true) {
+    mBuffer.resize(kInitialBufferSize);
+}
+
+bool UidAttributionEnergyConsumer::readFileLocked() {
+    if (mFd == -1) {
+        mFd.reset(TEMP_FAILURE_RETRY(open(kPath.c_str(), O_RDONLY | O_CLOEXEC)));
+        if (mFd == -1) {
+            PLOG(ERROR) << "Failed to open " << kPath;
+            return false;
+        }
+    }
+
+    // The table grows with the number of UIDs, so keep the buffer across reads and only
+    // grow it when the file outgrows it. One byte is reserved for the terminator.
+    size_t size = 0;
+    while (true) {
+        if (size + 1 >= mBuffer.size()) {
+            mBuffer.resize(mBuffer.size() * 2);
+        }
+        ssize_t n = TEMP_FAILURE_RETRY(
+                pread(mFd, mBuffer.data() + size, mBuffer.size() - size - 1, size));
+        if (n < 0) {
+            PLOG(ERROR) << "Failed to read " << kPath;
+            mFd.reset();
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+    mBuffer[size] = '\0';
+    return true;
+}
+
+bool UidAttributionEnergyConsumer::parseHeaderLocked(const char *line, const char *end) {
+    if (mHeader.size() == static_cast<size_t>(end - line) &&
+        !memcmp(mHeader.data(), line, mHeader.size())) {
+        return true;
+    }
+
+    mHeader.assign(line, end);
+    mColumnCoeffs.clear();
+    const char *cp = line + strlen(kHeaderPrefix);
+    while (cp < end) {
+        while (cp < end && *cp == ' ') cp++;
+        const char *tok = cp;
+        while (cp < end && *cp != ' ') cp++;
+        if (tok == cp) {
+            break;
+        }
+        auto coeff = kStateCoeffs.find(std::string(tok, cp));
+        mColumnCoeffs.push_back(coeff == kStateCoeffs.end() ? 0 : coeff->second);
+    }
+
+    // A different set of columns invalidates the stored times, but not the energy already
+    // attributed to each UID. The times of this read become the new baseline.
+    mTimes.assign(mRowUids.size() * mColumnCoeffs.size(), 0);
+    mRebaseline = true;
+    return !mColumnCoeffs.empty();
+}
+
+size_t UidAttributionEnergyConsumer::getRowLocked(int32_t uid) {
+    auto it = mUidRows.find(uid);
+    if (it != mUidRows.end()) {
+        return it->second;
+    }
+
+    size_t row = mRowUids.size();
+    mUidRows.emplace(uid, row);
+    mRowUids.push_back(uid);
+    mRowEnergyUWs.push_back(0);
+    mTimes.resize(mTimes.size() + mColumnCoeffs.size(), 0);
+    return row;
+}
+
+bool UidAttributionEnergyConsumer::updateTableLocked(int64_t *totalWeight) {
+    const char *cp = mBuffer.c_str();
+    bool haveHeader = false;
+
+    *totalWeight = 0;
+    mMoved.clear();
+
+    while (*cp) {
+        const char *end = strchrnul(cp, '\n');
+
+        if (!strncmp(cp, kHeaderPrefix, strlen(kHeaderPrefix))) {
+            haveHeader = parseHeaderLocked(cp, end);
+        } else if (haveHeader) {
+            char *next;
+            long uid = strtol(cp, &next, 10);
+            if (next != cp && *next == ':') {
+                const size_t row = getRowLocked(uid);
+                uint64_t *times = &mTimes[row * mColumnCoeffs.size()];
+                int64_t weight = 0;
+
+                cp = next + 1;
+                for (size_t col = 0; col < mColumnCoeffs.size() && cp < end; col++) {
+                    uint64_t t = strtoull(cp, &next, 10);
+                    if (next == cp || next > end) {
+                        break;
+                    }
+                    cp = next;
+                    if (t == times[col]) {
+                        continue;
+                    }
+                    // A counter going backwards means the UID was recycled; start over from 0
+                    uint64_t delta = t > times[col] ? t - times[col] : t;
+                    weight += mColumnCoeffs[col] * static_cast<int64_t>(delta);
+                    times[col] = t;
+                }
+                if (weight > 0 && !mRebaseline) {
+                    mMoved.push_back({row, weight});
+                    *totalWeight += weight;
+                }
+            }
+        }
+
+        cp = *end ? end + 1 : end;
+    }
+
+    if (!haveHeader) {
+        LOG(ERROR) << "Missing header in " << kPath;
+    }
+    return haveHeader;
+}
+
+std::optional<EnergyConsumerResult> UidAttributionEnergyConsumer::getEnergyConsumed() {
+    int64_t totalEnergyUWs = 0;
+    int64_t timestampMs = 0;
+
+    if (!mTracker.isComplete()) {
+        return {};
+    }
+
+    std::vector<EnergyMeasurement> measurements;
+    if (mMeter->readEnergyMeter(mTracker.getChannelIds(), &measurements).isOk() &&
+        measurements.size() == mTracker.getChannelIds().size()) {
+        mTracker.update(measurements);
+        for (const auto &m : measurements) {
+            totalEnergyUWs += m.energyUWs;
+            timestampMs = m.timestampMs;
+        }
+    } else {
+        LOG(ERROR) << "Failed to read energy meter";
+        return {};
+    }
+
+    std::scoped_lock lock(mLock);
+
+    int64_t totalWeight;
+    if (!readFileLocked() || !updateTableLocked(&totalWeight)) {
+        return {};
+    }
+
+    // A baseline read has no time deltas to split the energy by, so it only sets the energy
+    // baseline too
+    const int64_t deltaEnergyUWs = mRebaseline ? 0 : totalEnergyUWs - mLastEnergyUWs;
+    mLastEnergyUWs = totalEnergyUWs;
+    mRebaseline = false;
+    if (deltaEnergyUWs > 0 && totalWeight > 0) {
+        const double energyPerWeight = static_cast<double>(deltaEnergyUWs) / totalWeight;
+        for (const auto &m : mMoved) {
+            mRowEnergyUWs[m.row] += static_cast<int64_t>(m.weight * energyPerWeight);
+        }
+    }
+
+    EnergyConsumerResult result = {.timestampMs = timestampMs, .energyUWs = totalEnergyUWs};
+    result.attribution.reserve(mRowUids.size());
+    for (size_t row = 0; row < mRowUids.size(); row++) {
+        if (mRowEnergyUWs[row] > 0) {
+            result.attribution.push_back({.uid = mRowUids[row], .energyUWs = mRowEnergyUWs[row]});
+        }
+    }
+    return result;
+}
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Cost of the PowerStats query paths over the providers of addGs201CommonDataProviders, which
+ * reads the kernel nodes from the fixture tree in benchmarks/fixtures/sysfs instead of sysfs,
+ * and the energy meter from benchmarks/fixtures/odpm. Besides the latency, every benchmark
+ * reports per call:
+ *  - allocs and alloc_bytes, counted by replacing the global operator new,
+ *  - opens and closes, counted by interposing the open and close symbols of libc, which the
+ *    providers and libbase call directly,
+ *  - rw_syscalls, the read and write syscalls accounted in /proc/thread-self/io.
+ *
+ * As on device, energy consumers read the meter through the 50 ms cache of the common
+ * providers, so back to back getEnergyConsumed calls mostly share one meter snapshot.
+ * readEnergyMeter is never cached.
+ */
+
+#include <Gs201CommonDataProviders.h>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdlib>
+#include <functional>
+
+using aidl::android::hardware::power::stats::Channel;
+using aidl::android::hardware::power::stats::EnergyConsumerResult;
+using aidl::android::hardware::power::stats::EnergyMeasurement;
+using aidl::android::hardware::power::stats::StateResidencyResult;
+
+static std::atomic<uint64_t> gAllocs;
+static std::atomic<uint64_t> gAllocBytes;
+static std::atomic<uint64_t> gOpens;
+static std::atomic<uint64_t> gCloses;
+
+void *operator new(size_t size) {
+    gAllocs++;
+    gAllocBytes += size;
+    void *p = malloc(size);
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// Defined under their libc names, but named differently here to stay clear of the fortified
+// declarations of the libc headers
+extern "C" int countingOpen(const char *path, int flags, ...) __asm__("open");
+extern "C" int countingClose(int fd) __asm__("close");
+
+extern "C" int countingOpen(const char *path, int flags, ...) {
+    static const auto realOpen =
+            reinterpret_cast<int (*)(const char *, int, ...)>(dlsym(RTLD_NEXT, "open"));
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, int);
+        va_end(args);
+    }
+    gOpens++;
+    return realOpen(path, flags, mode);
+}
+
+extern "C" int countingClose(int fd) {
+    static const auto realClose = reinterpret_cast<int (*)(int)>(dlsym(RTLD_NEXT, "close"));
+    gCloses++;
+    return realClose(fd);
+}
+
+// Read syscalls counted for reading /proc/thread-self/io once (the data, then EOF)
+static const int64_t kIoReadSyscalls = 2;
+
+static int64_t readWriteSyscalls() {
+    std::string io;
+    if (!::android::base::ReadFileToString("/proc/thread-self/io", &io)) {
+        return 0;
+    }
+
+    int64_t count = 0;
+    for (const auto &line : ::android::base::Split(io, "\n")) {
+        for (const std::string prefix : {"syscr: ", "syscw: "}) {
+            int64_t value;
+            if (::android::base::StartsWith(line, prefix) &&
+                ::android::base::ParseInt(line.substr(prefix.size()), &value)) {
+                count += value;
+            }
+        }
+    }
+    return count;
+}
+
+static std::string fixture(const std::string &name) {
+    return ::android::base::GetExecutableDirectory() + "/benchmarks/fixtures/" + name;
+}
+
+/**
+ * ODPM meter over a fixture in the format of the energy_value node of the IIO device:
+ *
+ *   t=<ms>
+ *   CH<n>(T=<ms>)[<rail>], <energy uWs>
+ *
+ * Like the real meter, every read reads the node.
+ */
+class FixtureEnergyMeter : public PowerStats::IEnergyMeterDataProvider {
+  public:
+    explicit FixtureEnergyMeter(const std::string &path) : kPath(path) {}
+
+    ndk::ScopedAStatus readEnergyMeter(const std::vector<int32_t> &in_channelIds,
+                                       std::vector<EnergyMeasurement> *_aidl_return) override {
+        std::vector<std::pair<Channel, EnergyMeasurement>> channels;
+        if (!parse(&channels)) {
+            return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+        }
+        for (const auto &[channel, measurement] : channels) {
+            if (in_channelIds.empty() || std::find(in_channelIds.begin(), in_channelIds.end(),
+                                                   channel.id) != in_channelIds.end()) {
+                _aidl_return->push_back(measurement);
+            }
+        }
+        return ndk::ScopedAStatus::ok();
+    }
+
+    ndk::ScopedAStatus getEnergyMeterInfo(std::vector<Channel> *_aidl_return) override {
+        std::vector<std::pair<Channel, EnergyMeasurement>> channels;
+        if (!parse(&channels)) {
+            return ndk::ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
+        }
+        for (const auto &[channel, measurement] : channels) {
+            _aidl_return->push_back(channel);
+        }
+        return ndk::ScopedAStatus::ok();
+    }
+
+  private:
+    bool parse(std::vector<std::pair<Channel, EnergyMeasurement>> *channels) {
+        std::string data;
+        if (!::android::base::ReadFileToString(kPath, &data)) {
+            return false;
+        }
+        for (const auto &line : ::android::base::Split(data, "\n")) {
+            int32_t id;
+            int64_t timestampMs;
+            char rail[64];
+            int64_t energyUWs;
+            if (sscanf(line.c_str(), "CH%d(T=%" SCNd64 ")[%63[^]]], %" SCNd64, &id, &timestampMs,
+                       rail, &energyUWs) == 4) {
+                channels->push_back({{.id = id, .name = rail, .subsystem = "ODPM"},
+                                     {.id = id,
+                                      .timestampMs = timestampMs,
+                                      .durationMs = timestampMs,
+                                      .energyUWs = energyUWs}});
+            }
+        }
+        return !channels->empty();
+    }
+
+    const std::string kPath;
+};
+
+/**
+ * The common gs201 providers over the fixtures. There is one instance per process, like the
+ * service: the common providers share process-wide state, e.g. the energy meter cache.
+ */
+static std::shared_ptr<PowerStats> getPowerStats() {
+    static const std::shared_ptr<PowerStats> p = [] {
+        auto p = ndk::SharedRefBase::make<PowerStats>();
+        // Set before the providers, which check their channels at registration
+        p->setEnergyMeterDataProvider(
+                std::make_unique<FixtureEnergyMeter>(fixture("odpm/energy_value")));
+        addGs201CommonDataProviders(p, fixture("sysfs"));
+        return p;
+    }();
+    return p;
+}
+
+/**
+ * Runs call in the benchmark loop, after one untimed call that opens the nodes kept open, and
+ * reports the per call counters.
+ */
+static void measure(benchmark::State &state, const std::function<bool()> &call) {
+    if (!call()) {
+        state.SkipWithError("Query failed, are the fixtures installed?");
+        return;
+    }
+
+    const uint64_t allocs = gAllocs;
+    const uint64_t allocBytes = gAllocBytes;
+    const uint64_t opens = gOpens;
+    const uint64_t closes = gCloses;
+    const int64_t syscalls = readWriteSyscalls();
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(call());
+    }
+
+    // Excludes the open and close of /proc/thread-self/io, which come after the snapshot
+    const auto perCall = benchmark::Counter::kAvgIterations;
+    state.counters["rw_syscalls"] =
+            benchmark::Counter(readWriteSyscalls() - syscalls - kIoReadSyscalls, perCall);
+    state.counters["allocs"] = benchmark::Counter(gAllocs - allocs, perCall);
+    state.counters["alloc_bytes"] = benchmark::Counter(gAllocBytes - allocBytes, perCall);
+    state.counters["opens"] = benchmark::Counter(gOpens - opens, perCall);
+    state.counters["closes"] = benchmark::Counter(gCloses - closes, perCall);
+}
+
+static void BM_GetStateResidency(benchmark::State &state) {
+    auto p = getPowerStats();
+    measure(state, [&p] {
+        std::vector<StateResidencyResult> results;
+        return p->getStateResidency({}, &results).isOk() && !results.empty();
+    });
+}
+BENCHMARK(BM_GetStateResidency);
+
+static void BM_GetEnergyConsumed(benchmark::State &state) {
+    auto p = getPowerStats();
+    measure(state, [&p] {
+        std::vector<EnergyConsumerResult> results;
+        return p->getEnergyConsumed({}, &results).isOk() && !results.empty();
+    });
+}
+BENCHMARK(BM_GetEnergyConsumed);
+
+// Not cached: every call reads the meter
+static void BM_ReadEnergyMeter(benchmark::State &state) {
+    auto p = getPowerStats();
+    measure(state, [&p] {
+        std::vector<EnergyMeasurement> results;
+        return p->readEnergyMeter({}, &results).isOk() && !results.empty();
+    });
+}
+BENCHMARK(BM_ReadEnergyMeter);
+
+BENCHMARK_MAIN();
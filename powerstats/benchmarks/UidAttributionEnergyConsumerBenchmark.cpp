@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <UidAttributionEnergyConsumer.h>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cinttypes>
+
+using aidl::android::hardware::power::stats::Channel;
+using aidl::android::hardware::power::stats::EnergyConsumerType;
+using aidl::android::hardware::power::stats::EnergyMeasurement;
+using aidl::android::hardware::power::stats::PowerStats;
+using aidl::android::hardware::power::stats::UidAttributionEnergyConsumer;
+
+static const std::vector<std::string> kRails = {"S8S_VDD_G3D_L2", "S2S_VDD_G3D"};
+static const std::map<std::string, int32_t> kStateCoeffs = {
+        {"202000", 890},  {"251000", 1102}, {"302000", 1308}, {"351000", 1522},
+        {"400000", 1772}, {"471000", 2105}, {"510000", 2292}, {"572000", 2528},
+        {"701000", 3127}, {"762000", 3452}, {"848000", 4044}};
+
+/**
+ * Meter whose every channel gains a fixed amount of energy per read.
+ */
+class FakeEnergyMeter : public PowerStats::IEnergyMeterDataProvider {
+  public:
+    ndk::ScopedAStatus readEnergyMeter(const std::vector<int32_t> &in_channelIds,
+                                       std::vector<EnergyMeasurement> *_aidl_return) override {
+        mReads++;
+        for (int32_t id = 0; id < static_cast<int32_t>(kRails.size()); id++) {
+            if (in_channelIds.empty() ||
+                std::find(in_channelIds.begin(), in_channelIds.end(), id) != in_channelIds.end()) {
+                _aidl_return->push_back({.id = id,
+                                         .timestampMs = mReads * 100,
+                                         .durationMs = mReads * 100,
+                                         .energyUWs = mReads * 100000});
+            }
+        }
+        return ndk::ScopedAStatus::ok();
+    }
+
+    ndk::ScopedAStatus getEnergyMeterInfo(std::vector<Channel> *_aidl_return) override {
+        for (int32_t id = 0; id < static_cast<int32_t>(kRails.size()); id++) {
+            _aidl_return->push_back({.id = id, .name = kRails[id], .subsystem = "GPU"});
+        }
+        return ndk::ScopedAStatus::ok();
+    }
+
+  private:
+    int64_t mReads = 0;
+};
+
+/**
+ * Writes a uid_time_in_state table of the given number of UIDs, in which the first movedUids
+ * rows advance by one tick per column since the previous generation.
+ */
+static void writeTable(const std::string &path, int32_t uids, int32_t movedUids,
+                       int64_t generation) {
+    std::string table = "uid:";
+    for (const auto &[state, coeff] : kStateCoeffs) {
+        table += " " + state;
+    }
+    table += "\n";
+    for (int32_t i = 0; i < uids; i++) {
+        // Idle UIDs keep the counters of the first generation
+        const int64_t ticks = 1000 + (i < movedUids ? generation : 0);
+        table += ::android::base::StringPrintf("%d:", 10000 + i);
+        for (size_t col = 0; col < kStateCoeffs.size(); col++) {
+            table += ::android::base::StringPrintf(" %" PRId64, ticks + col);
+        }
+        table += "\n";
+    }
+    ::android::base::WriteStringToFile(table, path);
+}
+
+/**
+ * One getEnergyConsumed over a table of state.range(0) UIDs, state.range(1) of which moved
+ * since the previous query.
+ */
+static void BM_UidAttributionGetEnergyConsumed(benchmark::State &state) {
+    const int32_t uids = state.range(0);
+    const int32_t movedUids = state.range(1);
+
+    TemporaryFile file;
+    UidAttributionEnergyConsumer consumer(std::make_shared<FakeEnergyMeter>(),
+                                          EnergyConsumerType::OTHER, "GPU",
+                                          {kRails.begin(), kRails.end()}, file.path, kStateCoeffs);
+
+    // The first query only establishes the per-UID baseline
+    int64_t generation = 0;
+    writeTable(file.path, uids, movedUids, generation);
+    consumer.getEnergyConsumed();
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        writeTable(file.path, uids, movedUids, ++generation);
+        state.ResumeTiming();
+
+        auto result = consumer.getEnergyConsumed();
+        if (!result) {
+            state.SkipWithError("getEnergyConsumed failed");
+            break;
+        }
+        benchmark::DoNotOptimize(result);
+    }
+}
+BENCHMARK(BM_UidAttributionGetEnergyConsumed)
+        ->Args({1000, 10})
+        ->Args({1000, 1000})
+        ->Args({4000, 10})
+        ->Args({4000, 400})
+        ->Args({10000, 100});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+namespace acpm {
+
+constexpr uint32_t hashKey(std::string_view key, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : key) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Collision-free hash of a fixed set of keys into a power of two slot table, found at compile
+ * time. Slots hold the key index plus one, 0 marking an empty slot.
+ */
+template <size_t N>
+struct PerfectHash {
+    static_assert(N > 0 && N < 256, "slots hold 8-bit key indices");
+    static constexpr size_t kSlots = [] {
+        size_t slots = 1;
+        while (slots < 2 * N) slots <<= 1;
+        return slots;
+    }();
+
+    uint32_t seed = 0;
+    std::array<uint8_t, kSlots> slots = {};
+    bool valid = false;
+
+    // Returns the index of key, or -1 if it is not one of the keys
+    int lookup(std::string_view key, const std::array<std::string_view, N> &keys) const {
+        const uint8_t slot = slots[hashKey(key, seed) & (kSlots - 1)];
+        return slot && keys[slot - 1] == key ? slot - 1 : -1;
+    }
+};
+
+template <size_t N>
+constexpr PerfectHash<N> buildPerfectHash(const std::array<std::string_view, N> &keys) {
+    for (uint32_t seed = 0; seed < 4096; seed++) {
+        PerfectHash<N> hash;
+        hash.seed = seed;
+        hash.valid = true;
+        for (size_t i = 0; i < N && hash.valid; i++) {
+            uint8_t &slot = hash.slots[hashKey(keys[i], seed) & (PerfectHash<N>::kSlots - 1)];
+            if (slot) {
+                hash.valid = false;
+            } else {
+                slot = i + 1;
+            }
+        }
+        if (hash.valid) {
+            return hash;
+        }
+    }
+    return PerfectHash<N>();
+}
+
+/**
+ * Layout of an ACPM stats node with one state per entity:
+ *
+ *   <entity>:
+ *     <countKey>: <count>
+ *     <timeKey>: <time>
+ *     <lastKey>: <time>
+ *
+ * where the colon after the entity name is optional and times are in nanoseconds.
+ */
+struct Format {
+    std::string_view stateName;
+    std::string_view countKey;
+    std::string_view timeKey;
+    std::string_view lastKey;
+};
+
+}  // namespace acpm
+
+/**
+ * Reports a fixed table of ACPM entities with a single state each, such as the power domains
+ * of pd_stats or the CPU cores of core_stats.
+ *
+ * The entity table and its perfect hash are built at compile time. The node is kept open and
+ * read with pread into a fixed buffer, entity headers are found through the hash regardless
+ * of their order in the node, and values are converted without std::function transforms.
+ */
+template <size_t N>
+class AcpmStatsStateResidencyDataProvider : public PowerStats::IStateResidencyDataProvider {
+  public:
+    AcpmStatsStateResidencyDataProvider(const std::string &path, const acpm::Format &format,
+                                        const std::array<std::string_view, N> &entities,
+                                        const acpm::PerfectHash<N> &hash)
+        : kPath(path), kFormat(format), kEntities(entities), kHash(hash) {
+        for (size_t i = 0; i < N; i++) {
+            mNames[i] = kEntities[i];
+        }
+    }
+    ~AcpmStatsStateResidencyDataProvider() = default;
+
+    /*
+     * See IStateResidencyDataProvider::getStateResidencies
+     */
+    bool getStateResidencies(
+            std::unordered_map<std::string, std::vector<StateResidency>> *residencies) override {
+        std::scoped_lock lock(mLock);
+
+        if (mFd == -1) {
+            mFd.reset(TEMP_FAILURE_RETRY(open(kPath.c_str(), O_RDONLY | O_CLOEXEC)));
+            if (mFd == -1) {
+                PLOG(ERROR) << "Failed to open " << kPath;
+                return false;
+            }
+        }
+        const ssize_t n = TEMP_FAILURE_RETRY(pread(mFd, mBuffer, sizeof(mBuffer) - 1, 0));
+        if (n <= 0) {
+            PLOG(ERROR) << "Failed to read " << kPath;
+            mFd.reset();
+            return false;
+        }
+        mBuffer[n] = '\0';
+
+        std::array<StateResidency, N> values = {};
+        std::array<bool, N> found = {};
+        int entity = -1;
+        for (char *cp = mBuffer; *cp;) {
+            char *end = strchrnul(cp, '\n');
+            char *next = *end ? end + 1 : end;
+
+            while (cp < end && (*cp == ' ' || *cp == '\t')) cp++;
+            const char *colon = static_cast<const char *>(memchr(cp, ':', end - cp));
+            const char *keyEnd = colon ? colon : end;
+            while (keyEnd > cp && (keyEnd[-1] == ' ' || keyEnd[-1] == '\r')) keyEnd--;
+            const std::string_view key(cp, keyEnd - cp);
+            const char *rest = colon ? colon + 1 : end;
+            while (rest < end && (*rest == ' ' || *rest == '\t' || *rest == '\r')) rest++;
+
+            if (rest == end) {
+                // A line without a value starts a new entity, known or not
+                entity = kHash.lookup(key, kEntities);
+                if (entity != -1) {
+                    found[entity] = true;
+                }
+            } else if (entity != -1) {
+                const uint64_t value = strtoull(rest, nullptr, 10);
+                if (key == kFormat.countKey) {
+                    values[entity].totalStateEntryCount = value;
+                } else if (key == kFormat.timeKey) {
+                    values[entity].totalTimeInStateMs = value / NS_PER_MS;
+                } else if (key == kFormat.lastKey) {
+                    values[entity].lastEntryTimestampMs = value / NS_PER_MS;
+                }
+            }
+            cp = next;
+        }
+
+        for (size_t i = 0; i < N; i++) {
+            if (found[i]) {
+                residencies->emplace(mNames[i], std::vector<StateResidency>{values[i]});
+            }
+        }
+        return true;
+    }
+
+    /*
+     * See IStateResidencyDataProvider::getInfo
+     */
+    std::unordered_map<std::string, std::vector<State>> getInfo() override {
+        std::unordered_map<std::string, std::vector<State>> info;
+        for (size_t i = 0; i < N; i++) {
+            info.emplace(mNames[i], std::vector<State>{{.id = 0,
+                                                        .name = std::string(kFormat.stateName)}});
+        }
+        return info;
+    }
+
+  private:
+    static constexpr uint64_t NS_PER_MS = 1000000;
+
+    const std::string kPath;
+    const acpm::Format kFormat;
+    const std::array<std::string_view, N> kEntities;
+    const acpm::PerfectHash<N> kHash;
+    // Entity names as reported
+    std::array<std::string, N> mNames;
+
+    std::mutex mLock;
+    ::android::base::unique_fd mFd;
+    char mBuffer[8192];
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+
+#include <chrono>
+#include <mutex>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Read-through cache in front of an energy meter. A read that finds the cached snapshot older
+ * than maxAge reads every channel of the underlying meter in one pass; any read that lands
+ * inside that window (e.g. the remaining consumers of one getEnergyConsumed sweep) is served
+ * from the same snapshot, so all energy consumers derive their values from one ODPM read.
+ *
+ * Channels on different PMICs are sampled at slightly different times. Each snapshot is
+ * aligned to the oldest channel timestamp in it: the other channels are interpolated between
+ * their previous and current samples and carry that common timestamp. A channel that has no
+ * sample at or before the common timestamp keeps its closest sample and its own timestamp;
+ * the distance to it is the residual skew of the snapshot. When the residual skew exceeds
+ * maxSkew the meter is read once more. Alignment is best effort: a snapshot still out of
+ * bounds after that is served, so readers that need aligned channels must check the spread
+ * of the returned timestamps (see RailBreakdown::skewMs). Such snapshots are counted by
+ * getSkewViolations() and logged.
+ */
+class CachedEnergyMeterDataProvider : public PowerStats::IEnergyMeterDataProvider {
+  public:
+    CachedEnergyMeterDataProvider(std::unique_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+                                  std::chrono::milliseconds maxAge,
+                                  std::chrono::milliseconds maxSkew);
+    ~CachedEnergyMeterDataProvider() = default;
+
+    // Methods from PowerStats::IEnergyMeterDataProvider
+    ndk::ScopedAStatus readEnergyMeter(const std::vector<int32_t> &in_channelIds,
+                                       std::vector<EnergyMeasurement> *_aidl_return) override;
+    ndk::ScopedAStatus getEnergyMeterInfo(std::vector<Channel> *_aidl_return) override;
+
+    // Snapshots served with a residual skew above maxSkew
+    uint64_t getSkewViolations();
+
+  private:
+    ndk::ScopedAStatus readMeterLocked();
+    ndk::ScopedAStatus refreshLocked();
+    ndk::ScopedAStatus copyLocked(const std::vector<int32_t> &in_channelIds,
+                                  std::vector<EnergyMeasurement> *_aidl_return);
+
+    const std::unique_ptr<PowerStats::IEnergyMeterDataProvider> mMeter;
+    const std::chrono::milliseconds kMaxAge;
+    const std::chrono::milliseconds kMaxSkew;
+
+    std::mutex mLock;
+    // Last raw reading of the meter, indexed by channel id
+    std::vector<EnergyMeasurement> mRaw;
+    // Last aligned reading of the meter, indexed by channel id
+    std::vector<EnergyMeasurement> mSnapshot;
+    int64_t mSnapshotSkewMs;
+    // Snapshots served with a residual skew above maxSkew
+    uint64_t mSkewViolations;
+    std::chrono::steady_clock::time_point mSnapshotTime;
+    bool mSnapshotValid;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
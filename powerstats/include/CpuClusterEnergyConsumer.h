@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+#include <android-base/unique_fd.h>
+
+#include <map>
+#include <mutex>
+#include <set>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * CPU cluster energy consumer that models energy from the cpufreq residency of the cluster
+ * policy and the idle residency of its cores, and rebases the model on every read of the
+ * cluster rail:
+ *
+ *   busy   = 1 - sum(core DOWN time) / (cores * policy time)
+ *   model  = busy * sum(time at frequency * freqCoeffs[frequency])
+ *   energy = last rail reading + scale * model since that reading
+ *
+ * Coefficients between the frequencies of freqCoeffs are interpolated linearly, and are the
+ * cluster power with every core busy. The rail is read at most once per meterPeriodMs; each
+ * successful read moves scale towards the ratio of metered to modeled energy since the
+ * previous read. Reported energy never decreases, so a model overshoot is held until the rail
+ * catches up rather than carried forward.
+ *
+ * The policy time_in_state node is kept open and read with pread, so a query between rail
+ * reads costs that read plus the core residencies of the acpm core_stats provider.
+ */
+class CpuClusterEnergyConsumer : public PowerStats::IEnergyConsumer {
+  public:
+    // Reads the core residencies from p and the cluster rail from meter
+    CpuClusterEnergyConsumer(std::shared_ptr<PowerStats> p,
+                             std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+                             const std::string &name,
+                             const std::set<std::string> &channelNames,
+                             const std::string &policyStatsPath,
+                             const std::vector<std::string> &coreEntityNames,
+                             const std::map<int32_t, int32_t> &freqCoeffs,
+                             int64_t meterPeriodMs);
+    ~CpuClusterEnergyConsumer() = default;
+
+    std::pair<EnergyConsumerType, std::string> getInfo() override {
+        return {EnergyConsumerType::CPU_CLUSTER, kName};
+    }
+
+    std::optional<EnergyConsumerResult> getEnergyConsumed() override;
+
+    std::string getConsumerName() override { return kName; }
+
+  private:
+    bool readFullyBusyEnergyLocked(double *energyUWs, int64_t *elapsedMs);
+    bool readCoreDownTimeLocked(int64_t *downMs);
+    bool updateModelLocked();
+    bool calibrateLocked(int64_t nowMs);
+
+    const std::string kName;
+    const std::string kTimeInStatePath;
+    const int64_t kMeterPeriodMs;
+    const int64_t kClockTicksPerSecond;
+    // Frequency (MHz) to cluster power (mW) with every core busy
+    const std::map<int32_t, int32_t> kFreqCoeffs;
+    std::shared_ptr<PowerStats> mPowerStats;
+    std::shared_ptr<PowerStats::IEnergyMeterDataProvider> mMeter;
+    std::vector<int32_t> mChannelIds;
+    std::vector<int32_t> mCoreEntityIds;
+
+    std::mutex mLock;
+    ::android::base::unique_fd mFd;
+    char mBuffer[4096];
+    // Whether the counters below hold a previous read to diff against
+    bool mHaveBaseline;
+    // Clock ticks at each frequency (kHz) as of the previous read
+    std::unordered_map<int64_t, int64_t> mLastTicks;
+    // Total DOWN time of each core entity as of the previous read
+    std::unordered_map<int32_t, int64_t> mLastDownMs;
+    // Calibration of the model against the rail
+    double mScale;
+    // Unscaled model energy since the previous rail reading
+    double mModelSinceMeterUWs;
+    int64_t mLastMeterUWs;
+    int64_t mLastMeterReadMs;
+    // Last reported energy
+    int64_t mEnergyUWs;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
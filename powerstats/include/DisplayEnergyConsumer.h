@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+
+#include <map>
+#include <mutex>
+#include <set>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Display energy consumer. When all of the given energy meter channels exist their energy is
+ * reported directly. Otherwise the energy is modeled from the refresh rate residency of the
+ * display MRR entity and the panel backlight:
+ *
+ *   energy += time in state * (refreshRateCoeffs[rate] + fullBrightnessMw * brightness / max)
+ *
+ * The rate is parsed from the "@<rate>" part of the MRR state name; states without a known
+ * rate (e.g. the panel being off) draw nothing. The brightness read at each query is applied
+ * to the whole interval since the previous query, and is 0 while the backlight state is Off.
+ */
+class DisplayEnergyConsumer : public PowerStats::IEnergyConsumer {
+  public:
+    // Reads the MRR residency from p and the display rails from meter
+    DisplayEnergyConsumer(std::shared_ptr<PowerStats> p,
+                          std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+                          const std::string &name,
+                          const std::set<std::string> &channelNames,
+                          const std::string &entityName,
+                          const std::map<int32_t, int32_t> &refreshRateCoeffs,
+                          int32_t fullBrightnessMw, const std::string &backlightPath);
+    ~DisplayEnergyConsumer() = default;
+
+    std::pair<EnergyConsumerType, std::string> getInfo() override {
+        return {EnergyConsumerType::DISPLAY, kName};
+    }
+
+    std::optional<EnergyConsumerResult> getEnergyConsumed() override;
+
+    std::string getConsumerName() override { return kName; }
+
+  private:
+    std::optional<EnergyConsumerResult> getMeteredEnergy();
+    std::optional<EnergyConsumerResult> getModeledEnergyLocked();
+    double getBrightnessFraction();
+
+    const std::string kName;
+    const int32_t kFullBrightnessMw;
+    const std::string kBacklightPath;
+    std::shared_ptr<PowerStats> mPowerStats;
+    std::shared_ptr<PowerStats::IEnergyMeterDataProvider> mMeter;
+    std::vector<int32_t> mChannelIds;
+    int32_t mEntityId;
+    // Refresh rate coefficient (mW) by MRR state id
+    std::unordered_map<int32_t, int32_t> mStateCoeffs;
+    int64_t mMaxBrightness;
+
+    std::mutex mLock;
+    // Time in state as of the previous query, by MRR state id
+    std::unordered_map<int32_t, int64_t> mLastTimeMs;
+    int64_t mEnergyUWs;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -17,26 +17,38 @@
 #pragma once
 
 #include <PowerStatsAidl.h>
+#include <ResidencyHistoryStore.h>
+#include <StateResidencySubscriptionManager.h>
 
 using aidl::android::hardware::power::stats::PowerStats;
+using aidl::android::hardware::power::stats::ResidencyHistoryStore;
+using aidl::android::hardware::power::stats::StateResidencySubscriptionManager;
 
-void addAoC(std::shared_ptr<PowerStats> p);
-void addCPUclusters(std::shared_ptr<PowerStats> p);
+void addAoC(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addCPUclusters(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
 void addCamera(std::shared_ptr<PowerStats> p);
-void addDevfreq(std::shared_ptr<PowerStats> p);
-void addDisplayMrr(std::shared_ptr<PowerStats> p);
+void addDevfreq(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addDisplayMrr(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
 void addDisplayMrrByEntity(std::shared_ptr<PowerStats> p, std::string name, std::string path);
-void addDvfsStats(std::shared_ptr<PowerStats> p);
-void addGNSS(std::shared_ptr<PowerStats> p);
-void addGs201CommonDataProviders(std::shared_ptr<PowerStats> p);
-void addMobileRadio(std::shared_ptr<PowerStats> p);
+void addDvfsStats(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addGNSS(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addGs201CommonDataProviders(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addMobileRadio(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
 void addNFC(std::shared_ptr<PowerStats> p, const std::string& path);
-void addPCIe(std::shared_ptr<PowerStats> p);
+void addPCIe(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addPcieAspmMonitor(std::shared_ptr<PowerStats> p);
 void addPixelStateResidencyDataProvider(std::shared_ptr<PowerStats> p);
-void addPowerDomains(std::shared_ptr<PowerStats> p);
-void addSoC(std::shared_ptr<PowerStats> p);
-void addTPU(std::shared_ptr<PowerStats> p);
-void addUfs(std::shared_ptr<PowerStats> p);
-void addWifi(std::shared_ptr<PowerStats> p);
-void addWlan(std::shared_ptr<PowerStats> p);
+void addPowerDomains(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addSoC(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addSocSleepStallDetector(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addTPU(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addUfs(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addWifi(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+void addWlan(std::shared_ptr<PowerStats> p, const std::string &sysfsRoot = "/");
+std::shared_ptr<ResidencyHistoryStore> getResidencyHistoryStore();
+std::shared_ptr<StateResidencySubscriptionManager> getStateResidencySubscriptionManager(
+        std::shared_ptr<PowerStats> p);
 void setEnergyMeter(std::shared_ptr<PowerStats> p);
+void startProfiling(std::shared_ptr<PowerStats> p);
+void startResidencyHistory(std::shared_ptr<PowerStats> p);
+void startSharedMemoryExport(std::shared_ptr<PowerStats> p);
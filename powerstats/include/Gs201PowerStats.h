@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+
+#include <functional>
+#include <mutex>
+#include <ostream>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * PowerStats whose dumpsys output is followed by the sections registered by the gs201 data
+ * providers, e.g. the residency history or the SoC sleep stalls. Device services instantiate
+ * it in place of PowerStats; with plain PowerStats the sections are simply not dumped.
+ */
+class Gs201PowerStats : public PowerStats {
+  public:
+    using DumpSection = std::function<void(std::ostream &out)>;
+
+    // Sections are dumped in the order they were added
+    static void addDumpSection(const std::string &title, DumpSection section);
+
+    binder_status_t dump(int fd, const char **args, uint32_t numArgs) override;
+
+  private:
+    static std::mutex sSectionsLock;
+    static std::vector<std::pair<std::string, DumpSection>> sSections;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
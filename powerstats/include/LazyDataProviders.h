@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Base of the deferred-construction wrappers below. The wrapped object is built by a factory
+ * the first time it is needed, either by a query or by the idle-time warmup started with
+ * startWarmup(), whichever comes first. Construction time is logged.
+ */
+class LazyInitializer {
+  public:
+    explicit LazyInitializer(const std::string &name);
+    virtual ~LazyInitializer();
+
+    void ensureInitialized();
+
+    // Initializes every pending object on a low priority thread once delay has elapsed
+    static void startWarmup(std::chrono::milliseconds delay);
+
+  protected:
+    virtual void initialize() = 0;
+
+  private:
+    static void warmupAll();
+
+    const std::string kName;
+    std::once_flag mOnce;
+};
+
+/**
+ * Energy consumer registered with its type and name only; the consumer itself, including the
+ * resolution of its energy meter channels, is built on first use.
+ */
+class LazyEnergyConsumer : public PowerStats::IEnergyConsumer, public LazyInitializer {
+  public:
+    using Factory = std::function<std::unique_ptr<PowerStats::IEnergyConsumer>()>;
+
+    LazyEnergyConsumer(EnergyConsumerType type, const std::string &name, Factory factory);
+
+    std::pair<EnergyConsumerType, std::string> getInfo() override { return {kType, kName}; }
+    std::optional<EnergyConsumerResult> getEnergyConsumed() override;
+    std::string getConsumerName() override { return kName; }
+
+  protected:
+    void initialize() override;
+
+  private:
+    const EnergyConsumerType kType;
+    const std::string kName;
+    Factory mFactory;
+    std::unique_ptr<PowerStats::IEnergyConsumer> mConsumer;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
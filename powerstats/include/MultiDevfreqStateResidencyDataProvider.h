@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+#include <android-base/unique_fd.h>
+
+#include <mutex>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Reports the frequency residency of several devfreq domains from one provider. Each domain
+ * is reported as its own "<name>-DVFS" entity, like DevfreqStateResidencyDataProvider.
+ *
+ * The frequency table of every domain is parsed once, since it does not change after boot. A
+ * domain whose node cannot be read at construction is retried on every getInfo and
+ * getStateResidencies call until it can; PowerStats only learns of its entity from a getInfo
+ * call after that. The time_in_state (or, if absent, trans_stat) node of every domain is kept
+ * open and all domains are read in one pass with pread into a shared buffer, which grows when
+ * a node does not fit.
+ */
+class MultiDevfreqStateResidencyDataProvider : public PowerStats::IStateResidencyDataProvider {
+  public:
+    // Pairs of entity name and devfreq device path
+    explicit MultiDevfreqStateResidencyDataProvider(
+            const std::vector<std::pair<std::string, std::string>> &domains);
+    ~MultiDevfreqStateResidencyDataProvider() = default;
+
+    /*
+     * See IStateResidencyDataProvider::getStateResidencies
+     */
+    bool getStateResidencies(
+            std::unordered_map<std::string, std::vector<StateResidency>> *residencies) override;
+
+    /*
+     * See IStateResidencyDataProvider::getInfo
+     */
+    std::unordered_map<std::string, std::vector<State>> getInfo() override;
+
+  private:
+    struct Domain {
+        std::string name;
+        std::string path;
+        bool transStat;
+        ::android::base::unique_fd fd;
+        // Whether frequencies holds the frequency table
+        bool initialized;
+        // Frequencies in the order the node reports them
+        std::vector<int64_t> frequencies;
+    };
+
+    // Reads the frequency table of domain if not done yet. Returns whether it is known.
+    bool initDomain(Domain *domain);
+    bool openDomain(Domain *domain);
+    ssize_t preadDomain(Domain *domain);
+    /*
+     * Parses the node content in mBuffer. Fills frequencies with the frequency of each row and,
+     * if residencies is not null, the time (and entry count for trans_stat) of each row.
+     */
+    bool parseDomain(const Domain &domain, std::vector<int64_t> *frequencies,
+                     std::vector<StateResidency> *residencies);
+
+    std::vector<Domain> mDomains;
+    // Protects the domains and the shared read buffer
+    std::mutex mLock;
+    std::vector<char> mBuffer;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+#include <StateResidencySubscriptionManager.h>
+
+#include <deque>
+#include <mutex>
+#include <ostream>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Rates how well PCIe links use their low power states while the device behind them is idle.
+ *
+ * For every window of the residency subscription, and every link, it derives:
+ *  - the share of the device idle time spent in L1.2, when the link reports ASPM residency,
+ *  - the L1 exit rate, counted as entries into L0,
+ *  - a lower bound of the time the link was UP while the device was idle,
+ *    max(0, UP + idle - window).
+ *
+ * Windows in which the device was idle for at least half the time are rated EFFICIENT or
+ * REGRESSED, the latter when any of the three is out of bounds; the others are ACTIVE. Each link is reported as a "<name>-ASPM" power entity with
+ * those three states, and a transition to REGRESSED is logged and kept as an event.
+ */
+class PcieAspmMonitor : public PowerStats::IStateResidencyDataProvider {
+  public:
+    struct LinkConfig {
+        std::string name;
+        // Entity with the UP state of the link, e.g. PCIe-WiFi
+        std::string linkEntity;
+        // Entity and state of the device being idle, e.g. WIFI and ASLEEP
+        std::string idleEntity;
+        std::string idleState;
+        // Entity with L0/L1/L1_1/L1_2 residency, empty if the link does not report it
+        std::string aspmEntity;
+    };
+
+    struct Report {
+        // CLOCK_BOOTTIME at the end of the window
+        int64_t timestampMs;
+        int64_t windowMs;
+        int64_t idleMs;
+        // Both -1 when the link does not report ASPM residency
+        double l12IdleRatio;
+        double l1ExitsPerSecond;
+        int64_t upWhileIdleMs;
+        bool regressed;
+    };
+
+    struct Event {
+        std::string link;
+        Report report;
+    };
+
+    PcieAspmMonitor(std::shared_ptr<PowerStats> p, std::vector<LinkConfig> links);
+    ~PcieAspmMonitor();
+
+    // Subscribes to the link entities, which must be registered by then
+    void start(std::shared_ptr<StateResidencySubscriptionManager> manager,
+               std::chrono::milliseconds window);
+
+    // Latest report of each link that completed a window, keyed by link name
+    std::unordered_map<std::string, Report> getReports();
+    // Most recent regressions, oldest first
+    std::vector<Event> getEvents();
+
+    // Prints the reports and events for dumpsys
+    void dump(std::ostream &out);
+
+    /*
+     * See IStateResidencyDataProvider::getStateResidencies
+     */
+    bool getStateResidencies(
+            std::unordered_map<std::string, std::vector<StateResidency>> *residencies) override;
+
+    /*
+     * See IStateResidencyDataProvider::getInfo
+     */
+    std::unordered_map<std::string, std::vector<State>> getInfo() override;
+
+  private:
+    struct Link {
+        LinkConfig config;
+        // Resolved entity and state ids, -1 if unknown
+        int32_t linkId;
+        int32_t upState;
+        int32_t idleId;
+        int32_t idleState;
+        int32_t aspmId;
+        int32_t l0State;
+        int32_t l12State;
+        // Rating of the previous window
+        int32_t currentState;
+        bool hasReport;
+        Report report;
+        std::vector<StateResidency> residencies;
+    };
+
+    bool resolveStatesLocked();
+    void onDeltas(const std::vector<StateResidencySubscriptionManager::StateDelta> &deltas);
+
+    const std::weak_ptr<PowerStats> mPowerStats;
+
+    std::mutex mLock;
+    std::weak_ptr<StateResidencySubscriptionManager> mManager;
+    int32_t mSubscription;
+    bool mResolved;
+    std::vector<Link> mLinks;
+    std::deque<Event> mEvents;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
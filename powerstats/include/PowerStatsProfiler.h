@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+
+#include <chrono>
+#include <map>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Measures the cost of the PowerStats query paths on the running device: getStateResidency,
+ * getEnergyConsumed and readEnergyMeter, each over all entities, consumers or channels.
+ *
+ * Every call is repeated and timed individually, with a pause between calls long enough for
+ * the energy meter cache to expire, so that each call pays for a real read. Read and write
+ * syscalls are taken from /proc/thread-self/io around the whole loop and averaged per call;
+ * the kernel does not account other syscalls such as open and close there. Allocations are
+ * not profiled, since the net heap usage of a steady state loop is about 0; the benchmark in
+ * benchmarks/ counts them, along with opens and closes.
+ */
+class PowerStatsProfiler {
+  public:
+    struct CallStats {
+        std::string call;
+        int32_t iterations;
+        int64_t p50Us;
+        int64_t p99Us;
+        int64_t maxUs;
+        double readWriteSyscallsPerCall;
+    };
+
+    explicit PowerStatsProfiler(std::shared_ptr<PowerStats> p);
+
+    // spacing is the untimed pause between two calls
+    std::vector<CallStats> run(int32_t iterations, std::chrono::milliseconds spacing);
+
+    /*
+     * Runs the profile and logs it. Returns false, and logs a warning for each call, if the p99
+     * latency of a call exceeds its budget in p99BudgetsUs.
+     */
+    bool runAndCheck(int32_t iterations, std::chrono::milliseconds spacing,
+                     const std::map<std::string, int64_t> &p99BudgetsUs);
+
+  private:
+    const std::weak_ptr<PowerStats> mPowerStats;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+#include <android-base/cmsg.h>
+#include <android-base/unique_fd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/*
+ * Layout of the exported counter region. The region starts with PowerStatsShmHeader, followed
+ * by entityStateCount PowerStatsShmResidency records and consumerCount PowerStatsShmEnergy
+ * records. Entity, state and consumer ids match the ones returned by the IPowerStats info
+ * methods, so a reader resolves names once over binder and samples counters from here.
+ *
+ * The region is an anonymous shared memory object. Readers obtain a read-only file descriptor of
+ * it with openPowerStatsShm(), which connects to the abstract kPowerStatsShmSocketName socket of
+ * the HAL.
+ *
+ * The header sequence number is a seqlock: it is odd while the writer updates the records.
+ * Readers should use readPowerStatsShmSnapshot() to obtain a consistent copy.
+ */
+constexpr uint32_t kPowerStatsShmMagic = 0x4d485350;  // "PSHM"
+constexpr uint32_t kPowerStatsShmVersion = 1;
+constexpr char kPowerStatsShmSocketName[] = "vendor.powerstats.counters";
+
+struct PowerStatsShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> sequence;
+    uint32_t entityStateCount;
+    uint32_t consumerCount;
+    uint32_t reserved;
+    // CLOCK_BOOTTIME of the last update
+    int64_t timestampMs;
+};
+
+struct PowerStatsShmResidency {
+    int32_t entityId;
+    int32_t stateId;
+    int64_t totalTimeInStateMs;
+    int64_t totalStateEntryCount;
+    int64_t lastEntryTimestampMs;
+};
+
+struct PowerStatsShmEnergy {
+    int32_t consumerId;
+    int32_t reserved;
+    int64_t timestampMs;
+    int64_t energyUWs;
+};
+
+/*
+ * Receives the region from the HAL. Returns an invalid fd if the export is disabled or not
+ * published yet; size receives the size to map otherwise.
+ */
+inline ::android::base::unique_fd openPowerStatsShm(size_t *size) {
+    ::android::base::unique_fd sock(
+            TEMP_FAILURE_RETRY(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)));
+    if (sock == -1) {
+        return {};
+    }
+
+    // Abstract socket: the name starts with a NUL byte and is not NUL terminated
+    sockaddr_un addr = {.sun_family = AF_UNIX};
+    memcpy(addr.sun_path + 1, kPowerStatsShmSocketName, sizeof(kPowerStatsShmSocketName) - 1);
+    const socklen_t addrLen = offsetof(sockaddr_un, sun_path) + sizeof(kPowerStatsShmSocketName);
+    if (TEMP_FAILURE_RETRY(connect(sock, reinterpret_cast<sockaddr *>(&addr), addrLen))) {
+        return {};
+    }
+
+    uint64_t regionSize = 0;
+    std::vector<::android::base::unique_fd> fds;
+    if (::android::base::ReceiveFileDescriptorVector(sock, &regionSize, sizeof(regionSize), 1,
+                                                     &fds) != sizeof(regionSize) ||
+        fds.size() != 1) {
+        return {};
+    }
+    *size = regionSize;
+    return std::move(fds[0]);
+}
+
+/*
+ * Copies the records of a mapped region into out, retrying while the writer is active.
+ * Returns false if the region is not a compatible export or the copy could not be completed
+ * within maxRetries attempts.
+ */
+inline bool readPowerStatsShmSnapshot(const void *region, size_t regionSize, void *out,
+                                      int maxRetries = 64) {
+    const auto *header = static_cast<const PowerStatsShmHeader *>(region);
+    if (regionSize < sizeof(*header) || header->magic != kPowerStatsShmMagic ||
+        header->version != kPowerStatsShmVersion) {
+        return false;
+    }
+
+    for (int i = 0; i < maxRetries; i++) {
+        uint32_t begin = header->sequence.load(std::memory_order_acquire);
+        if (begin & 1) {
+            continue;
+        }
+        memcpy(out, region, regionSize);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->sequence.load(std::memory_order_relaxed) == begin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Periodically publishes every entity residency and energy consumer total into an anonymous
+ * shared memory region, so that high-rate polling clients can sample counters without a binder
+ * transaction per sample. The region never touches storage; it is handed out read-only, as a
+ * file descriptor, to every client of the abstract kPowerStatsShmSocketName socket. The binder
+ * API is unaffected.
+ */
+class PowerStatsSharedMemoryExporter {
+  public:
+    PowerStatsSharedMemoryExporter(std::shared_ptr<PowerStats> p,
+                                   std::chrono::milliseconds period);
+    ~PowerStatsSharedMemoryExporter();
+
+    // Maps the region and makes the first update after initialDelay, or one period if longer;
+    // all providers must be registered by then
+    void start(std::chrono::milliseconds initialDelay);
+
+  private:
+    bool mapRegion();
+    void update();
+    void run(std::chrono::milliseconds initialDelay);
+    void serve();
+
+    const std::weak_ptr<PowerStats> mPowerStats;
+    const std::chrono::milliseconds kPeriod;
+
+    ::android::base::unique_fd mRegionFd;
+    void *mRegion;
+    size_t mRegionSize;
+    PowerStatsShmHeader *mHeader;
+    PowerStatsShmResidency *mResidencies;
+    PowerStatsShmEnergy *mEnergies;
+    // Record index of the first state of each entity, indexed by entity id
+    std::vector<size_t> mEntityOffsets;
+    // Record index of each consumer, indexed by consumer id
+    std::vector<size_t> mConsumerOffsets;
+
+    std::mutex mLock;
+    std::condition_variable mCv;
+    bool mStopping;
+    std::thread mThread;
+
+    ::android::base::unique_fd mSocket;
+    std::thread mServerThread;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+
+#include <mutex>
+#include <set>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+struct RailContribution {
+    std::string rail;
+    int64_t energyUWs;
+    // Average power between the last two distinct meter samples, 0 until there are two
+    int64_t averagePowerUW;
+};
+
+struct RailBreakdown {
+    int64_t timestampMs;
+    // Interval the average powers cover
+    int64_t windowMs;
+    /*
+     * Spread of the sample timestamps of the rails in the latest read, 0 when they were all
+     * aligned to a common time. The split is only as precise as this.
+     */
+    int64_t skewMs;
+    std::vector<RailContribution> rails;
+};
+
+/**
+ * Keeps the per-rail values of the meter reads an energy consumer already makes, so that the
+ * split of its total across rails can be queried without another meter read.
+ *
+ * Trackers register themselves by consumer name for query() and getLast(). The breakdown is an
+ * in-process interface, for dumps and for the code linked into the HAL: IPowerStats is a frozen
+ * stable AIDL interface, and its clients read the same rails with getEnergyMeterInfo and
+ * readEnergyMeter.
+ */
+class RailBreakdownTracker {
+  public:
+    // Resolves the channels of the given rails; rails missing from the meter are left out
+    RailBreakdownTracker(std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+                         const std::string &consumer, const std::set<std::string> &rails);
+    ~RailBreakdownTracker();
+
+    /*
+     * Whether every rail was found. Consumers must not read an incomplete tracker: with no
+     * channel found, getChannelIds() is empty, which readEnergyMeter takes as every channel.
+     */
+    bool isComplete() const { return mComplete; }
+
+    const std::vector<int32_t> &getChannelIds() const { return mChannelIds; }
+
+    // Records a read of getChannelIds()
+    void update(const std::vector<EnergyMeasurement> &measurements);
+
+    /*
+     * Reads the named energy consumer through p, which also refreshes its tracker, and returns
+     * the per-rail split of that same read. Returns false if the consumer has no tracker.
+     */
+    static bool query(std::shared_ptr<PowerStats> p, const std::string &consumer,
+                      RailBreakdown *breakdown);
+
+    /*
+     * Returns the per-rail split of the last read the named energy consumer made, without
+     * reading it. Returns false if the consumer has no tracker or has not been read yet.
+     */
+    static bool getLast(const std::string &consumer, RailBreakdown *breakdown);
+
+  private:
+    bool get(RailBreakdown *breakdown);
+
+    const std::string kConsumer;
+    bool mComplete;
+    std::vector<int32_t> mChannelIds;
+    std::vector<std::string> mRails;
+
+    std::mutex mLock;
+    // Latest and previous distinct reads, in the order of mChannelIds
+    std::vector<EnergyMeasurement> mLatest;
+    std::vector<EnergyMeasurement> mPrevious;
+};
+
+/**
+ * Energy consumer summing a set of energy meter rails, like
+ * PowerStatsEnergyConsumer::createMeterConsumer, with a per-rail breakdown. Reads fail unless
+ * every rail is on the meter, rather than reporting a partial sum.
+ */
+class RailEnergyConsumer : public PowerStats::IEnergyConsumer {
+  public:
+    // Reads the rails from meter, e.g. the cache shared by the consumers of one sweep
+    RailEnergyConsumer(std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+                       EnergyConsumerType type, const std::string &name,
+                       const std::set<std::string> &rails);
+    ~RailEnergyConsumer() = default;
+
+    std::pair<EnergyConsumerType, std::string> getInfo() override { return {kType, kName}; }
+
+    std::optional<EnergyConsumerResult> getEnergyConsumed() override;
+
+    std::string getConsumerName() override { return kName; }
+
+  private:
+    const EnergyConsumerType kType;
+    const std::string kName;
+    std::shared_ptr<PowerStats::IEnergyMeterDataProvider> mMeter;
+    RailBreakdownTracker mTracker;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
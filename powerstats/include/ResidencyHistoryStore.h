@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * On-device history of every power entity state and every energy consumer.
+ *
+ * All entities and consumers are read once per period. The change since the previous read is
+ * kept in three rings of decreasing resolution: one bucket per period for the last 10 minutes,
+ * one per minute for the last day and one per 15 minutes for the last week. Each bucket stores
+ * only the series that changed, as varint-encoded deltas.
+ *
+ * Reads happen on a steady_clock timer, so the store does not wake the device from suspend; the
+ * first read after resume covers the whole suspended interval.
+ */
+class ResidencyHistoryStore {
+  public:
+    struct Sample {
+        // CLOCK_BOOTTIME at the start of the covered interval
+        int64_t startMs;
+        int64_t durationMs;
+        /*
+         * Only entities and states that changed. totalTimeInStateMs and totalStateEntryCount are
+         * deltas over the interval; lastEntryTimestampMs is not recorded.
+         */
+        std::vector<StateResidencyResult> residencies;
+        // Only consumers that changed. energyUWs is the energy used over the interval.
+        std::vector<EnergyConsumerResult> energies;
+    };
+
+    ResidencyHistoryStore(std::shared_ptr<PowerStats> p, std::chrono::milliseconds period);
+    ~ResidencyHistoryStore();
+
+    // The first read, which only sets the baseline, happens after initialDelay
+    void start(std::chrono::milliseconds initialDelay);
+
+    /*
+     * Returns the samples overlapping [startMs, endMs), oldest first, from the finest ring
+     * that still holds startMs (or the ring reaching furthest back if none does). The last
+     * sample of a coarse ring is its partial bucket, which ends at the last read.
+     */
+    void query(int64_t startMs, int64_t endMs, std::vector<Sample> *samples);
+
+    // Bytes held by encoded buckets
+    size_t getEncodedSize();
+
+  private:
+    // Series value deltas keyed by series index
+    using Deltas = std::map<uint32_t, std::pair<int64_t, int64_t>>;
+
+    struct Series {
+        bool energy;
+        // Power entity or energy consumer id
+        int32_t id;
+        int32_t stateId;
+    };
+
+    struct Bucket {
+        int64_t startMs;
+        int64_t durationMs;
+        std::vector<uint8_t> data;
+    };
+
+    struct Ring {
+        int64_t resolutionMs;
+        int64_t retentionMs;
+        std::deque<Bucket> buckets;
+        // Sum of the samples in the bucket not yet complete
+        Deltas pending;
+        int64_t pendingStartMs;
+        // End of the last sample added to pending
+        int64_t pendingEndMs;
+    };
+
+    uint32_t getSeriesLocked(bool energy, int32_t id, int32_t stateId);
+    void addDeltaLocked(uint32_t series, int64_t value, int64_t count, Deltas *deltas);
+    void appendLocked(Ring *ring, int64_t startMs, int64_t durationMs, const Deltas &deltas);
+    void decodeLocked(const Bucket &bucket, Sample *sample);
+    // Start of the oldest data held by ring, or -1 if it holds none
+    static int64_t getOldestMs(const Ring &ring);
+    void sample();
+    void run(std::chrono::milliseconds initialDelay);
+
+    const std::weak_ptr<PowerStats> mPowerStats;
+    const std::chrono::milliseconds kPeriod;
+
+    std::mutex mLock;
+    std::condition_variable mCv;
+    std::vector<Series> mSeries;
+    std::map<std::tuple<bool, int32_t, int32_t>, uint32_t> mSeriesIndex;
+    // Absolute values as of the previous read, indexed by series
+    std::vector<std::pair<int64_t, int64_t>> mLast;
+    std::vector<bool> mHasLast;
+    int64_t mLastSampleMs;
+    std::vector<Ring> mRings;
+    bool mStopping;
+    std::thread mThread;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+#include <StateResidencySubscriptionManager.h>
+
+#include <deque>
+#include <mutex>
+#include <ostream>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Flags screen-off windows in which the SoC fails to reach deep sleep while a subsystem holds
+ * MIF or SLC up.
+ *
+ * The LPM, MIF and requester entities registered by addSoC are watched through the residency
+ * subscription manager. A window is stalled when the display was off (or in low power mode) at
+ * both of its ends and the SoC spent less than a tenth of it in the LPM SLEEP or STOP states
+ * with MIF down for less than a tenth of it too. The requester that held MIF (or SLC) up the
+ * longest is blamed if it held it for at least half the window.
+ *
+ * Stalls are logged, kept as compact events, and reported as the "SoC-SleepStall" power
+ * entity: one state per requester, entered once per stalled window, with the stalled time.
+ */
+class SocSleepStallDetector : public PowerStats::IStateResidencyDataProvider {
+  public:
+    struct Requester {
+        // State name of the requester in the SoC-SleepStall entity
+        std::string name;
+        // Requester entity and state, e.g. MIF-REQ and AOC
+        std::string entity;
+        std::string state;
+    };
+
+    struct Event {
+        // CLOCK_BOOTTIME at the end of the stalled window
+        int64_t timestampMs;
+        int32_t windowMs;
+        int32_t sleepMs;
+        int32_t mifDownMs;
+        // Index of the blamed requester in the SoC-SleepStall states
+        int32_t requester;
+        int32_t requesterHoldMs;
+    };
+
+    SocSleepStallDetector(std::shared_ptr<PowerStats> p, std::vector<Requester> requesters,
+                          const std::string &displayStatePath);
+    ~SocSleepStallDetector();
+
+    // Subscribes to the SoC entities, which must be registered by then
+    void start(std::shared_ptr<StateResidencySubscriptionManager> manager,
+               std::chrono::milliseconds window);
+
+    // Most recent stall events, oldest first
+    std::vector<Event> getEvents();
+
+    // Prints the events for dumpsys
+    void dump(std::ostream &out);
+
+    /*
+     * See IStateResidencyDataProvider::getStateResidencies
+     */
+    bool getStateResidencies(
+            std::unordered_map<std::string, std::vector<StateResidency>> *residencies) override;
+
+    /*
+     * See IStateResidencyDataProvider::getInfo
+     */
+    std::unordered_map<std::string, std::vector<State>> getInfo() override;
+
+  private:
+    bool resolveStatesLocked();
+    bool isDisplayOff();
+    void onDeltas(const std::vector<StateResidencySubscriptionManager::StateDelta> &deltas);
+
+    const std::weak_ptr<PowerStats> mPowerStats;
+    const std::vector<Requester> kRequesters;
+    const std::string kDisplayStatePath;
+
+    std::mutex mLock;
+    std::weak_ptr<StateResidencySubscriptionManager> mManager;
+    int32_t mSubscription;
+    // Entity and state ids, resolved on the first delivery
+    bool mResolved;
+    int32_t mLpmId;
+    std::vector<int32_t> mLpmSleepStates;
+    int32_t mMifId;
+    std::vector<std::pair<int32_t, int32_t>> mRequesterStates;
+    // Whether the display was off at the end of the previous window
+    bool mDisplayWasOff;
+    std::deque<Event> mEvents;
+    // Per requester (plus one for unattributed stalls)
+    std::vector<StateResidency> mStalls;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
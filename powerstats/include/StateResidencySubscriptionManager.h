@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Push-based state residency deltas. A subscriber registers a set of power entities, a minimum
+ * interval and a change threshold, and is called back with only the states whose accumulated
+ * change since its last delivery meets the threshold.
+ *
+ * Subscribers sharing the same interval are batched: one getStateResidency read over the union
+ * of their entities serves all of them.
+ *
+ * PowerStats does not lock its provider lists, so no read is made until the delay given to
+ * start() has elapsed, by which time the last provider must be registered. Only clients inside
+ * the HAL process can subscribe: IPowerStats has no push API, and out of process clients still
+ * poll.
+ */
+class StateResidencySubscriptionManager {
+  public:
+    struct Threshold {
+        // A state is reported once its time in state grew by at least this much...
+        int64_t timeInStateMs;
+        // ...or it was entered at least this many times. 0 disables the criterion.
+        int64_t entryCount;
+    };
+
+    struct StateDelta {
+        int32_t entityId;
+        /*
+         * totalTimeInStateMs and totalStateEntryCount are deltas since this state was last
+         * delivered to the subscriber, or last seen unchanged; lastEntryTimestampMs is the
+         * current absolute value.
+         */
+        StateResidency residency;
+        // CLOCK_BOOTTIME time covered by the deltas of this state
+        int64_t elapsedMs;
+    };
+
+    /*
+     * Called from the manager thread with the states meeting the threshold. States below the
+     * threshold keep accumulating, so their deltas may cover a longer time once delivered. With
+     * a zero threshold, all the states of a delivery cover the same time since the previous read.
+     */
+    using Callback = std::function<void(const std::vector<StateDelta> &deltas)>;
+
+    explicit StateResidencySubscriptionManager(std::shared_ptr<PowerStats> p);
+    ~StateResidencySubscriptionManager();
+
+    // Starts reading for the subscribers after initialDelay; all providers must be registered
+    // by then
+    void start(std::chrono::milliseconds initialDelay);
+
+    /*
+     * Returns the subscription id, or -1 if none of the entities exist. Unknown entity names
+     * are ignored. Before start(), the entities must already be registered by the calling
+     * thread.
+     */
+    int32_t subscribe(const std::vector<std::string> &entityNames,
+                      std::chrono::milliseconds minInterval, const Threshold &threshold,
+                      Callback callback);
+    void unsubscribe(int32_t id);
+
+  private:
+    struct Baseline {
+        StateResidency residency;
+        // CLOCK_BOOTTIME of residency
+        int64_t timeMs;
+    };
+
+    struct Subscription {
+        std::vector<int32_t> entityIds;
+        Threshold threshold;
+        Callback callback;
+        // Residency of each state as of its last delivery, keyed by entity id
+        std::unordered_map<int32_t, std::vector<Baseline>> baseline;
+    };
+
+    struct Group {
+        std::vector<int32_t> subscriptionIds;
+        std::chrono::steady_clock::time_point nextRead;
+    };
+
+    bool resolveEntityIdsLocked(const std::vector<std::string> &entityNames,
+                                std::vector<int32_t> *ids);
+    void readGroup(std::chrono::milliseconds interval);
+    void run();
+
+    const std::weak_ptr<PowerStats> mPowerStats;
+
+    std::mutex mLock;
+    std::condition_variable mCv;
+    std::unordered_map<std::string, int32_t> mEntityIds;
+    std::unordered_map<int32_t, Subscription> mSubscriptions;
+    // Subscriptions batched by interval
+    std::map<std::chrono::milliseconds, Group> mGroups;
+    // No read happens before this time
+    std::chrono::steady_clock::time_point mFirstRead;
+    int32_t mNextId;
+    bool mStopping;
+    std::thread mThread;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <PowerStatsAidl.h>
+#include <RailEnergyConsumer.h>
+#include <android-base/unique_fd.h>
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace power {
+namespace stats {
+
+/**
+ * Meter consumer whose energy is attributed to UIDs by a per-UID time-in-state file, e.g.
+ * /sys/devices/platform/28000000.mali/uid_time_in_state:
+ *
+ *   uid: 202000 251000 302000 ...
+ *   10123: 0 12 34 ...
+ *
+ * Per-frequency times are kept in a flat table indexed by a stable per-UID row. Every query
+ * parses the file in place, diffs each row against the previous read, and splits the metered
+ * energy delta only across the UIDs whose counters moved, weighted by the state coefficients.
+ * The per-rail split of each meter read is kept by a RailBreakdownTracker. Reads fail
+ * unless every channel is on the meter.
+ */
+class UidAttributionEnergyConsumer : public PowerStats::IEnergyConsumer {
+  public:
+    UidAttributionEnergyConsumer(std::shared_ptr<PowerStats::IEnergyMeterDataProvider> meter,
+                                 EnergyConsumerType type, const std::string &name,
+                                 const std::set<std::string> &channelNames,
+                                 const std::string &uidTimeInStatePath,
+                                 const std::map<std::string, int32_t> &stateCoeffs);
+    ~UidAttributionEnergyConsumer() = default;
+
+    std::pair<EnergyConsumerType, std::string> getInfo() override { return {kType, kName}; }
+
+    std::optional<EnergyConsumerResult> getEnergyConsumed() override;
+
+    std::string getConsumerName() override { return kName; }
+
+  private:
+    struct MovedRow {
+        size_t row;
+        int64_t weight;
+    };
+
+    bool readFileLocked();
+    bool parseHeaderLocked(const char *line, const char *end);
+    bool updateTableLocked(int64_t *totalWeight);
+    size_t getRowLocked(int32_t uid);
+
+    const EnergyConsumerType kType;
+    const std::string kName;
+    const std::string kPath;
+    const std::map<std::string, int32_t> kStateCoeffs;
+    std::shared_ptr<PowerStats::IEnergyMeterDataProvider> mMeter;
+    RailBreakdownTracker mTracker;
+
+    std::mutex mLock;
+    ::android::base::unique_fd mFd;
+    std::string mBuffer;
+    // Header line of the last read, used to skip re-resolving the coefficient columns
+    std::string mHeader;
+    // Coefficient of each time-in-state column
+    std::vector<int64_t> mColumnCoeffs;
+
+    // Flat [row][column] table of the times reported by the previous read
+    std::vector<uint64_t> mTimes;
+    std::vector<int32_t> mRowUids;
+    std::vector<int64_t> mRowEnergyUWs;
+    std::unordered_map<int32_t, size_t> mUidRows;
+    // Rows whose counters moved during the current read
+    std::vector<MovedRow> mMoved;
+
+    int64_t mLastEnergyUWs;
+    /*
+     * Whether the next read only records the times and energy to diff against: on the first
+     * read, and after a header change reset the times.
+     */
+    bool mRebaseline;
+};
+
+}  // namespace stats
+}  // namespace power
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.CallbackDispatcher"
+
+#include "CallbackDispatcher.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+CallbackDispatcher::CallbackDispatcher() : mStopping(false) {
+    mThread = std::thread(&CallbackDispatcher::run, this);
+}
+
+CallbackDispatcher::~CallbackDispatcher() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopping = true;
+    }
+    mCv.notify_one();
+    mThread.join();
+}
+
+void CallbackDispatcher::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mTasks.push_back(std::move(task));
+    }
+    mCv.notify_one();
+}
+
+void CallbackDispatcher::run() {
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (true) {
+        mCv.wait(lock, [this] { return mStopping || !mTasks.empty(); });
+        // Tasks posted before stopping are still delivered
+        if (mTasks.empty())
+            return;
+
+        std::function<void()> task = std::move(mTasks.front());
+        mTasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * CallbackDispatcher delivers the HAL's IUsbCallback notifications from a thread of its own, so
+ * that the threads producing them never wait on the binder call. Tasks run one at a time in the
+ * order they were posted, which keeps notifications to the framework in order.
+ */
+class CallbackDispatcher {
+  public:
+    CallbackDispatcher();
+    ~CallbackDispatcher();
+
+    void post(std::function<void()> task);
+
+  private:
+    void run();
+
+    std::mutex mLock;
+    std::condition_variable mCv;
+    std::deque<std::function<void()>> mTasks;
+    bool mStopping;
+    std::thread mThread;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
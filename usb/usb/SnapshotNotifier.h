@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "SnapshotPublisher.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Decides which results published through a SnapshotPublisher are notified, e.g. to the
+ * IUsbCallback for the port status.
+ *
+ * A published result is notified unless quiet says it can be skipped after the previous one,
+ * e.g. because it is unchanged and successful. A forced result is always notified, as the newer
+ * snapshot if it turned out stale. requestResend() forces the next result, so that a callback
+ * registered after updates stopped gets a fresh one. Notifications are queued under the
+ * publication lock and so stay in computation order.
+ */
+template <typename T>
+class SnapshotNotifier {
+  public:
+    using Snapshot = typename SnapshotPublisher<T>::Snapshot;
+    // Returns whether current may be skipped after previous
+    using Quiet = std::function<bool(const T &previous, const T &current)>;
+    // Queues the notification of snapshot. Must not block.
+    using Notify = std::function<void(const Snapshot &snapshot)>;
+
+    SnapshotNotifier(Quiet quiet, Notify notify)
+        : kQuiet(std::move(quiet)), kNotify(std::move(notify)) {}
+
+    // Returns the generation of a computation about to read its inputs
+    uint64_t begin() { return mPublisher.begin(); }
+
+    // Offers the result of computation generation, notifying it as described above
+    void publish(uint64_t generation, Snapshot snapshot, bool force) {
+        if (mResend.exchange(false))
+            force = true;
+
+        mPublisher.publish(generation, std::move(snapshot),
+                [this, force](const Snapshot &previous, const Snapshot &current) {
+            if (!force && previous != nullptr && kQuiet(*previous, *current)) {
+                mSuppressed++;
+                return;
+            }
+            notify(current);
+        },
+                [this, force](const Snapshot &latest) {
+            // A computation started later was published first; a forced update resends it
+            if (!force) {
+                mSuppressed++;
+                return;
+            }
+            notify(latest);
+        });
+    }
+
+    // Forces the next publication
+    void requestResend() { mResend = true; }
+
+    // Returns the latest snapshot, null until the first publication
+    Snapshot get() const { return mPublisher.get(); }
+
+    uint64_t getPublished() const { return mPublished; }
+    uint64_t getSuppressed() const { return mSuppressed; }
+
+  private:
+    void notify(const Snapshot &snapshot) {
+        mPublished++;
+        kNotify(snapshot);
+    }
+
+    const Quiet kQuiet;
+    const Notify kNotify;
+    SnapshotPublisher<T> mPublisher;
+    std::atomic<bool> mResend{false};
+    // Notifications queued and skipped
+    std::atomic<uint64_t> mPublished{0};
+    std::atomic<uint64_t> mSuppressed{0};
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
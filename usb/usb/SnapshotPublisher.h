@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Latest result of a computation that several threads may run at once, e.g. the port status
+ * computed from sysfs by binder calls and by the event loop.
+ *
+ * Computations run without any lock: each takes a generation with begin() before reading its
+ * inputs and offers its result with publish(). Only publication is serialized, and a result
+ * older than the one already published is dropped, so the latest snapshot and the
+ * notifications queued from publish() follow the order the computations started in. Readers
+ * get the latest snapshot without taking a lock.
+ */
+template <typename T>
+class SnapshotPublisher {
+  public:
+    using Snapshot = std::shared_ptr<const T>;
+    using PublishedCallback = std::function<void(const Snapshot &previous, const Snapshot &current)>;
+    using StaleCallback = std::function<void(const Snapshot &latest)>;
+
+    // Returns the generation of a computation about to read its inputs
+    uint64_t begin() { return mStarted.fetch_add(1) + 1; }
+
+    /*
+     * Offers the result of computation generation. If no later computation was published, it
+     * becomes the latest and onPublished runs; otherwise it is dropped and onStale runs with the
+     * newer snapshot. Either runs under the publication lock, so that what they queue stays in
+     * order. Returns true if snapshot was published.
+     */
+    bool publish(uint64_t generation, Snapshot snapshot, const PublishedCallback &onPublished,
+                 const StaleCallback &onStale) {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (generation <= mPublished) {
+            onStale(std::atomic_load(&mLatest));
+            return false;
+        }
+        mPublished = generation;
+        Snapshot previous = std::atomic_exchange(&mLatest, std::move(snapshot));
+        onPublished(previous, std::atomic_load(&mLatest));
+        return true;
+    }
+
+    // Returns the latest snapshot, null until the first publication
+    Snapshot get() const { return std::atomic_load(&mLatest); }
+
+  private:
+    std::atomic<uint64_t> mStarted{0};
+    std::mutex mLock;
+    // Generation of mLatest. Protected by mLock.
+    uint64_t mPublished = 0;
+    // Accessed with std::atomic_load/std::atomic_store only
+    Snapshot mLatest;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
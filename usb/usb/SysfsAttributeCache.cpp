@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.SysfsAttributeCache"
+
+#include "SysfsAttributeCache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// sysfs attributes are at most a page
+#define SYSFS_ATTR_MAX_LEN 4096
+
+constexpr char kTypecClassPath[] = "/sys/class/typec/";
+
+bool SysfsAttribute::readOnce(std::string *value) {
+    char buf[SYSFS_ATTR_MAX_LEN];
+
+    if (mFd.get() == -1) {
+        mFd.reset(TEMP_FAILURE_RETRY(open(mPath.c_str(), O_RDONLY | O_CLOEXEC)));
+        if (mFd.get() == -1)
+            return false;
+    }
+
+    ssize_t n = TEMP_FAILURE_RETRY(pread(mFd.get(), buf, sizeof(buf), 0));
+    if (n < 0) {
+        mFd.reset();
+        return false;
+    }
+    value->assign(buf, n);
+    return true;
+}
+
+bool SysfsAttribute::read(std::string *value) {
+    bool wasOpen = mFd.get() != -1;
+
+    if (readOnce(value))
+        return true;
+    // A stale fd of a removed kobject; retry on a fresh one
+    return wasOpen && readOnce(value);
+}
+
+SysfsAttributeCache::PortAttrs::PortAttrs(const std::string &portName)
+    : attrs{SysfsAttribute(kTypecClassPath + portName + "/power_role"),
+            SysfsAttribute(kTypecClassPath + portName + "/data_role"),
+            SysfsAttribute(kTypecClassPath + portName + "/device/non_compliant_reasons"),
+            SysfsAttribute(kTypecClassPath + portName + "-partner/accessory_mode"),
+            SysfsAttribute(kTypecClassPath + portName + "-partner/supports_usb_power_delivery")} {}
+
+bool SysfsAttributeCache::readPortAttr(const std::string &portName, PortAttr attr,
+                                       std::string *value) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mPorts.find(portName);
+    if (it == mPorts.end())
+        it = mPorts.emplace(portName, PortAttrs(portName)).first;
+    return it->second.attrs[attr].read(value);
+}
+
+bool SysfsAttributeCache::readFile(const std::string &path, std::string *value) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mFiles.find(path);
+    if (it == mFiles.end())
+        it = mFiles.emplace(path, SysfsAttribute(path)).first;
+    return it->second.read(value);
+}
+
+void SysfsAttributeCache::invalidatePartners() {
+    std::lock_guard<std::mutex> lock(mLock);
+    for (auto &port : mPorts) {
+        port.second.attrs[PARTNER_ACCESSORY_MODE].close();
+        port.second.attrs[PARTNER_SUPPORTS_PD].close();
+    }
+}
+
+void SysfsAttributeCache::invalidatePort(const std::string &portName) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mPorts.erase(portName);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
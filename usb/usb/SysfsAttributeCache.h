@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+
+#include <array>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::unique_fd;
+
+/*
+ * A sysfs attribute kept open once it has been read. Reads pread the whole attribute at offset
+ * 0 into a fixed buffer. If the read fails, e.g. because the kobject went away and came back,
+ * the attribute is reopened and read once more.
+ */
+class SysfsAttribute {
+  public:
+    explicit SysfsAttribute(std::string path) : mPath(std::move(path)) {}
+
+    bool read(std::string *value);
+    void close() { mFd.reset(); }
+
+  private:
+    bool readOnce(std::string *value);
+
+    const std::string mPath;
+    unique_fd mFd;
+};
+
+/*
+ * Per-port table of the Type-C sysfs attributes read for every port status query, plus fixed
+ * path attributes. Path strings are built once per port and each attribute keeps its fd.
+ * Partner attributes are dropped when the partner goes away so that the next read opens the
+ * new partner's attribute.
+ */
+class SysfsAttributeCache {
+  public:
+    enum PortAttr {
+        POWER_ROLE,
+        DATA_ROLE,
+        COMPLIANCE_WARNINGS,
+        PARTNER_ACCESSORY_MODE,
+        PARTNER_SUPPORTS_PD,
+        PORT_ATTR_COUNT,
+    };
+
+    // Reads attr of the given /sys/class/typec port, like ReadFileToString
+    bool readPortAttr(const std::string &portName, PortAttr attr, std::string *value);
+    // Reads the attribute at a fixed path, like ReadFileToString
+    bool readFile(const std::string &path, std::string *value);
+    // Closes the partner attributes of all ports
+    void invalidatePartners();
+    // Closes all attributes of portName
+    void invalidatePort(const std::string &portName);
+
+  private:
+    struct PortAttrs {
+        explicit PortAttrs(const std::string &portName);
+        std::array<SysfsAttribute, PORT_ATTR_COUNT> attrs;
+    };
+
+    std::mutex mLock;
+    std::unordered_map<std::string, PortAttrs> mPorts;
+    std::unordered_map<std::string, SysfsAttribute> mFiles;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.TypecPortRegistry"
+
+#include "TypecPortRegistry.h"
+
+#include <dirent.h>
+#include <utils/Log.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+constexpr char kPartnerSuffix[] = "-partner";
+
+TypecPortRegistry::TypecPortRegistry(const std::string &classPath)
+    : kClassPath(classPath), mValid(false), mRescanCorrections(0) {}
+
+bool TypecPortRegistry::scanLocked(std::map<std::string, bool> *ports) {
+    DIR *dp = opendir(kClassPath.c_str());
+    if (dp == NULL) {
+        ALOGE("Failed to open %s", kClassPath.c_str());
+        return false;
+    }
+
+    struct dirent *ep;
+    while ((ep = readdir(dp))) {
+        if (ep->d_type != DT_LNK)
+            continue;
+
+        // Partners are named <port>-partner; the port itself may be listed after its partner
+        std::string name(ep->d_name);
+        size_t dash = name.find('-');
+        if (name.find(kPartnerSuffix) == std::string::npos) {
+            ports->emplace(name, false);
+        } else {
+            (*ports)[name.substr(0, dash)] = true;
+        }
+    }
+    closedir(dp);
+    return true;
+}
+
+bool TypecPortRegistry::rescan() {
+    std::map<std::string, bool> ports;
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (!scanLocked(&ports))
+        return false;
+
+    if (mValid && ports != mPorts) {
+        ALOGI("typec port table out of date, %zu ports now", ports.size());
+        mRescanCorrections++;
+    }
+    mPorts = std::move(ports);
+    mValid = true;
+    return true;
+}
+
+bool TypecPortRegistry::handleUevent(const UeventMessage &uevent) {
+    const std::string_view devtype = uevent.get("DEVTYPE");
+    const std::string_view action = uevent.action();
+    if ((devtype != "typec_port" && devtype != "typec_partner") ||
+        (action != "add" && action != "remove"))
+        return false;
+
+    const std::string_view devpath = uevent.devpath();
+    std::string_view name = devpath.substr(devpath.rfind('/') + 1);
+    const bool add = action == "add";
+
+    std::lock_guard<std::mutex> lock(mLock);
+    if (devtype == "typec_port") {
+        if (add)
+            return mPorts.emplace(std::string(name), false).second;
+        return mPorts.erase(std::string(name)) > 0;
+    }
+
+    name = name.substr(0, name.find('-'));
+    auto it = mPorts.find(std::string(name));
+    if (it == mPorts.end()) {
+        if (!add)
+            return false;
+        it = mPorts.emplace(std::string(name), false).first;
+    }
+    if (it->second == add)
+        return false;
+    it->second = add;
+    return true;
+}
+
+bool TypecPortRegistry::getPorts(std::vector<std::pair<std::string, bool>> *ports) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (!mValid) {
+        std::map<std::string, bool> scanned;
+        if (!scanLocked(&scanned))
+            return false;
+        mPorts = std::move(scanned);
+        mValid = true;
+    }
+    ports->assign(mPorts.begin(), mPorts.end());
+    return true;
+}
+
+bool TypecPortRegistry::hasPort(const std::string &portName) {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mPorts.count(portName) != 0;
+}
+
+bool TypecPortRegistry::hasPartner(const std::string &portName) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mPorts.find(portName);
+    return it != mPorts.end() && it->second;
+}
+
+uint64_t TypecPortRegistry::getRescanCorrections() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mRescanCorrections;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "UeventMatcher.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * In-memory table of the Type-C ports under /sys/class/typec and whether each has a partner.
+ * It is filled by a directory scan, kept current from typec_port and typec_partner add/remove
+ * uevents, and rescanned periodically to catch missed uevents. Ports are listed by name.
+ */
+class TypecPortRegistry {
+  public:
+    explicit TypecPortRegistry(const std::string &classPath);
+
+    /*
+     * Rebuilds the table from the class directory. Returns false if the directory cannot be
+     * read, in which case the table is left as is.
+     */
+    bool rescan();
+    // Applies a typec uevent. Returns true if the table changed.
+    bool handleUevent(const UeventMessage &uevent);
+
+    // Returns the ports and partner presence, or false if no scan has succeeded yet
+    bool getPorts(std::vector<std::pair<std::string, bool>> *ports);
+    bool hasPort(const std::string &portName);
+    bool hasPartner(const std::string &portName);
+    // Number of rescans that found the table out of date
+    uint64_t getRescanCorrections();
+
+  private:
+    bool scanLocked(std::map<std::string, bool> *ports);
+
+    const std::string kClassPath;
+
+    std::mutex mLock;
+    // Partner presence by port name
+    std::map<std::string, bool> mPorts;
+    bool mValid;
+    uint64_t mRescanCorrections;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
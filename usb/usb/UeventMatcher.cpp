@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.UeventMatcher"
+
+#include "UeventMatcher.h"
+
+#include <utils/Log.h>
+
+#include <cstring>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+bool UeventMessage::parse(const char *msg, size_t len) {
+    mAction = mDevpath = {};
+    mFieldCount = 0;
+
+    const char *end = msg + len;
+    for (const char *cp = msg; cp < end;) {
+        const char *fieldEnd = static_cast<const char *>(memchr(cp, '\0', end - cp));
+        if (!fieldEnd) {
+            fieldEnd = end;
+        }
+        const std::string_view field(cp, fieldEnd - cp);
+        cp = fieldEnd + 1;
+
+        if (field.empty()) {
+            continue;
+        }
+        if (mAction.empty()) {
+            const size_t at = field.find('@');
+            if (at == std::string_view::npos) {
+                return false;
+            }
+            mAction = field.substr(0, at);
+            mDevpath = field.substr(at + 1);
+            continue;
+        }
+        const size_t eq = field.find('=');
+        if (eq != std::string_view::npos && mFieldCount < kMaxFields) {
+            mFields[mFieldCount++] = {field.substr(0, eq), field.substr(eq + 1)};
+        }
+    }
+    return !mAction.empty();
+}
+
+std::string_view UeventMessage::get(std::string_view key) const {
+    for (size_t i = 0; i < mFieldCount; i++) {
+        if (mFields[i].first == key) {
+            return mFields[i].second;
+        }
+    }
+    return {};
+}
+
+bool UeventMessage::hasPrefix(std::string_view key, std::string_view prefix) const {
+    const std::string_view value = get(key);
+    return value.size() >= prefix.size() && value.compare(0, prefix.size(), prefix) == 0;
+}
+
+int UeventMatcher::add(std::string_view pattern) {
+    // Character class of each pattern position
+    std::vector<std::bitset<256>> classes;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        std::bitset<256> cls;
+        const char c = pattern[i];
+        if (c == '.') {
+            cls.set();
+        } else if (c == '\\' && i + 1 < pattern.size()) {
+            cls.set(static_cast<uint8_t>(pattern[++i]));
+        } else if (c == '[') {
+            const size_t close = pattern.find(']', i + 1);
+            if (close == std::string_view::npos || close == i + 1) {
+                ALOGE("unterminated class in uevent pattern %.*s", (int)pattern.size(),
+                      pattern.data());
+                return -1;
+            }
+            // Negated classes are not supported; taking '^' literally would match the opposite
+            if (pattern[i + 1] == '^') {
+                ALOGE("unsupported negated class in uevent pattern %.*s", (int)pattern.size(),
+                      pattern.data());
+                return -1;
+            }
+            for (size_t j = i + 1; j < close; j++) {
+                const uint8_t lo = pattern[j];
+                if (j + 2 < close && pattern[j + 1] == '-') {
+                    const uint8_t hi = pattern[j + 2];
+                    if (hi < lo) {
+                        ALOGE("invalid range in uevent pattern %.*s", (int)pattern.size(),
+                              pattern.data());
+                        return -1;
+                    }
+                    for (int k = lo; k <= hi; k++) cls.set(k);
+                    j += 2;
+                } else {
+                    cls.set(lo);
+                }
+            }
+            i = close;
+        } else if (strchr("*+?()|{}^$", c)) {
+            ALOGE("unsupported operator '%c' in uevent pattern %.*s", c, (int)pattern.size(),
+                  pattern.data());
+            return -1;
+        } else {
+            cls.set(static_cast<uint8_t>(c));
+        }
+        classes.push_back(cls);
+    }
+
+    if (classes.empty() || mFinalPositions.size() == kMaxPatterns ||
+        mPositions + classes.size() > kMaxPositions) {
+        ALOGE("cannot add uevent pattern %.*s", (int)pattern.size(), pattern.data());
+        return -1;
+    }
+
+    mStarts.set(mPositions);
+    for (const auto &cls : classes) {
+        for (int c = 0; c < 256; c++) {
+            if (cls.test(c)) {
+                mMasks[c].set(mPositions);
+            }
+        }
+        mPositions++;
+    }
+    mFinals.set(mPositions - 1);
+    mFinalPositions.push_back(mPositions - 1);
+    return mFinalPositions.size() - 1;
+}
+
+uint32_t UeventMatcher::search(std::string_view text) const {
+    uint32_t found = 0;
+    State state;
+    for (char c : text) {
+        // A bit carried out of the last position of a pattern lands on the first position of
+        // the next one, which mStarts sets anyway
+        state = ((state << 1) | mStarts) & mMasks[static_cast<uint8_t>(c)];
+        if ((state & mFinals).any()) {
+            for (size_t id = 0; id < mFinalPositions.size(); id++) {
+                if (state.test(mFinalPositions[id])) {
+                    found |= 1u << id;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
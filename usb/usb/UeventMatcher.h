@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * View over a received uevent message: an "action@devpath" header followed by NUL separated
+ * KEY=value fields. Parsing only records spans into the receive buffer, which must outlive the
+ * view, and never allocates. Fields past kMaxFields are ignored.
+ */
+class UeventMessage {
+  public:
+    static constexpr size_t kMaxFields = 64;
+
+    // Parses the first len bytes of msg. Returns false if there is no action@devpath header.
+    bool parse(const char *msg, size_t len);
+
+    std::string_view action() const { return mAction; }
+    std::string_view devpath() const { return mDevpath; }
+    // Returns the value of key, or an empty view if the message has no such field
+    std::string_view get(std::string_view key) const;
+    // Returns true if the value of key starts with prefix
+    bool hasPrefix(std::string_view key, std::string_view prefix) const;
+
+  private:
+    std::string_view mAction;
+    std::string_view mDevpath;
+    std::array<std::pair<std::string_view, std::string_view>, kMaxFields> mFields;
+    size_t mFieldCount = 0;
+};
+
+/*
+ * Set of device path patterns compiled once into a single shift-and automaton, so that a text
+ * is searched for all of them in one pass without any allocation.
+ *
+ * Patterns use the subset of regex syntax the HAL needs: literal characters, '.' for any
+ * character, bracket classes such as [0-9] and backslash escapes. Other operators, including
+ * negated classes such as [^0-9], are rejected. A pattern matches anywhere in the text, as with
+ * std::regex_search.
+ */
+class UeventMatcher {
+  public:
+    static constexpr size_t kMaxPatterns = 32;
+    static constexpr size_t kMaxPositions = 512;
+
+    // Adds pattern and returns its id, or -1 if it is empty, malformed or does not fit
+    int add(std::string_view pattern);
+
+    // Returns a bit mask of the ids of the patterns found in text
+    uint32_t search(std::string_view text) const;
+
+  private:
+    using State = std::bitset<kMaxPositions>;
+
+    // Positions that accept each input character
+    std::array<State, 256> mMasks;
+    // First position of each pattern
+    State mStarts;
+    // Last position of each pattern
+    State mFinals;
+    // Last position of each pattern, by id
+    std::vector<size_t> mFinalPositions;
+    size_t mPositions = 0;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Devpath patterns, in the UeventMatcher syntax, of the uevents UsbDataSessionMonitor follows:
+ * the dwc3 gadget and the two root hub ports of the xhci host. Shared with the tests and the
+ * benchmark so that they exercise the patterns the HAL uses.
+ */
+inline constexpr char kUdcUeventRegex[] =
+    "/devices/platform/11210000.usb/11210000.dwc3/udc/11210000.dwc3";
+inline constexpr char kHost1UeventRegex[] =
+    "/devices/platform/11210000.usb/11210000.dwc3/xhci-hcd-exynos.[0-9].auto/usb2/2-0:1.0";
+inline constexpr char kHost2UeventRegex[] =
+    "/devices/platform/11210000.usb/11210000.dwc3/xhci-hcd-exynos.[0-9].auto/usb3/3-0:1.0";
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
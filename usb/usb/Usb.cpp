@@ -23,23 +23,26 @@
 #include <assert.h>
 #include <cstring>
 #include <dirent.h>
+#include <inttypes.h>
 #include <private/android_filesystem_config.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <usbhost/usbhost.h>
-#include <regex>
-#include <thread>
 #include <unordered_map>
 
-#include <cutils/uevent.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <utils/Errors.h>
 #include <utils/StrongPointer.h>
 #include <utils/Vector.h>
 
 #include "Usb.h"
+#include "SysfsAttributeCache.h"
+#include "TypecPortRegistry.h"
+#include "UeventMatcher.h"
+#include "UeventPatterns.h"
 
 #include <aidl/android/frameworks/stats/IStats.h>
 #include <android_hardware_usb_flags.h>
@@ -65,14 +68,13 @@ namespace aidl {
 namespace android {
 namespace hardware {
 namespace usb {
-// Set by the signal handler to destroy the thread
-volatile bool destroyThread;
-
-string enabledPath;
+// Type-C and charger attributes read on every port status query
+static SysfsAttributeCache sSysfs;
 constexpr char kHsi2cPath[] = "/sys/devices/platform/10d60000.hsi2c";
 constexpr char kTcpcDevName[] = "i2c-max77759tcpc";
 constexpr char kI2cClientId[] = "0025";
-constexpr char kComplianceWarningsPath[] = "device/non_compliant_reasons";
+// Type-C port wired to the TCPC and the dwc3 controller
+constexpr char kBuiltinPortName[] = "port0";
 constexpr char kComplianceWarningBC12[] = "bc12";
 constexpr char kComplianceWarningDebugAccessory[] = "debug-accessory";
 constexpr char kComplianceWarningMissingRp[] = "missing_rp";
@@ -84,9 +86,12 @@ constexpr char kSinkLimitEnable[] = "usb_limit_sink_enable";
 constexpr char kSourceLimitEnable[] = "usb_limit_source_enable";
 constexpr char kSinkLimitCurrent[] = "usb_limit_sink_current";
 constexpr char kTypecPath[] = "/sys/class/typec";
+// Type-C ports and partners, maintained from uevents
+static TypecPortRegistry sTypecPorts(kTypecPath);
 constexpr char kDisableContatminantDetection[] = "vendor.usb.contaminantdisable";
+constexpr char kPortStatusDebounceMs[] = "vendor.usb.port_status_debounce_ms";
 constexpr char kOverheatStatsPath[] = "/sys/devices/platform/google,usbc_port_cooling_dev/";
-constexpr char kOverheatStatsDev[] = "DRIVER=google,usbc_port_cooling_dev";
+constexpr char kOverheatStatsDriver[] = "google,usbc_port_cooling_dev";
 constexpr char kThermalZoneForTrip[] = "VIRTUAL-USB-THROTTLING";
 constexpr char kThermalZoneForTempReadPrimary[] = "usb_pwr_therm2";
 constexpr char kThermalZoneForTempReadSecondary1[] = "usb_pwr_therm";
@@ -96,21 +101,22 @@ constexpr char kPogoEnableHub[] = "/sys/devices/platform/google,pogo/enable_hub"
 constexpr char kInternalHubDevnum[] = "/sys/bus/usb/devices/1-1/devnum";
 constexpr char KPogoMoveDataToUsb[] = "/sys/devices/platform/google,pogo/move_data_to_usb";
 constexpr char kPowerSupplyUsbType[] = "/sys/class/power_supply/usb/usb_type";
-constexpr char kUdcUeventRegex[] =
-    "/devices/platform/11210000.usb/11210000.dwc3/udc/11210000.dwc3";
 constexpr char kUdcStatePath[] =
     "/sys/devices/platform/11210000.usb/11210000.dwc3/udc/11210000.dwc3/state";
-constexpr char kHost1UeventRegex[] =
-    "/devices/platform/11210000.usb/11210000.dwc3/xhci-hcd-exynos.[0-9].auto/usb2/2-0:1.0";
 constexpr char kHost1StatePath[] = "/sys/bus/usb/devices/usb2/2-0:1.0/usb2-port1/state";
-constexpr char kHost2UeventRegex[] =
-    "/devices/platform/11210000.usb/11210000.dwc3/xhci-hcd-exynos.[0-9].auto/usb3/3-0:1.0";
 constexpr char kHost2StatePath[] = "/sys/bus/usb/devices/usb3/3-0:1.0/usb3-port1/state";
 constexpr char kDataRolePath[] = "/sys/devices/platform/11210000.usb/new_data_role";
 
 constexpr int kSamplingIntervalSec = 5;
+// Default window over which bursts of port status updates are merged into one
+constexpr uint64_t kDefaultPortStatusDebounceMs = 50;
+// Period of the rescan of /sys/class/typec that catches uevents the port table missed
+constexpr int kTypecRevalidateSec = 30;
 void queryVersionHelper(android::hardware::usb::Usb *usb,
-                        std::vector<PortStatus> *currentPortStatus);
+                        std::vector<PortStatus> *currentPortStatus, bool forceNotify = false);
+static void uevent_event(android::hardware::usb::Usb *usb, const UeventMessage &uevent);
+static void notifyPortStatusChange(android::hardware::usb::Usb *usb,
+                                   std::shared_ptr<const PortStatusSnapshot> snapshot);
 
 #define CTRL_TRANSFER_TIMEOUT_MSEC 1000
 #define GL852G_VENDOR_ID 0x05e3
@@ -177,16 +183,10 @@ ScopedAStatus Usb::enableUsbData(const string& in_portName, bool in_enable,
     if (result) {
         mUsbDataEnabled = in_enable;
     }
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyEnableUsbDataStatus(
+    notifyCallback("notifyEnableUsbDataStatus", [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyEnableUsbDataStatus(
             in_portName, in_enable, result ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyEnableUsbDataStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    });
     queryVersionHelper(this, &currentPortStatus);
 
     return ScopedAStatus::ok();
@@ -210,17 +210,12 @@ ScopedAStatus Usb::enableUsbDataWhileDocked(const string& in_portName,
         }
     }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyEnableUsbDataWhileDockedStatus(
+    notifyCallback("notifyEnableUsbDataWhileDockedStatus",
+                   [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyEnableUsbDataWhileDockedStatus(
                 in_portName, notSupported ? Status::NOT_SUPPORTED :
                 success ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyEnableUsbDataStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    });
     queryVersionHelper(this, &currentPortStatus);
 
     return ScopedAStatus::ok();
@@ -237,79 +232,78 @@ ScopedAStatus Usb::resetUsbPort(const std::string& in_portName, int64_t in_trans
         result = false;
     }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ::ndk::ScopedAStatus ret = mCallback->notifyResetUsbPortStatus(
+    notifyCallback("notifyResetUsbPortStatus", [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyResetUsbPortStatus(
             in_portName, result ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyTransactionStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    });
 
     return ::ndk::ScopedAStatus::ok();
 }
 
-Status queryMoistureDetectionStatus(android::hardware::usb::Usb *usb,
-                                    std::vector<PortStatus> *currentPortStatus) {
-    string enabled, status, DetectedPath;
-
-    (*currentPortStatus)[0].supportedContaminantProtectionModes
-            .push_back(ContaminantProtectionMode::FORCE_DISABLE);
-    (*currentPortStatus)[0].contaminantProtectionStatus = ContaminantProtectionStatus::NONE;
-    (*currentPortStatus)[0].contaminantDetectionStatus = ContaminantDetectionStatus::DISABLED;
-    (*currentPortStatus)[0].supportsEnableContaminantPresenceDetection = true;
-    (*currentPortStatus)[0].supportsEnableContaminantPresenceProtection = false;
-
-    if (usb->mI2cClientPath.empty()) {
-        usb->mI2cClientPath = getI2cClientPath(kHsi2cPath, kTcpcDevName, kI2cClientId);
-        if (usb->mI2cClientPath.empty()) {
+// Returns the TCPC i2c client directory of the port, or "" if it has none
+static string getTcpcPath(UsbPortState *state) {
+    if (state == nullptr)
+        return "";
+    if (state->hasTcpc && state->i2cClientPath.empty()) {
+        state->i2cClientPath = getI2cClientPath(kHsi2cPath, kTcpcDevName, kI2cClientId);
+        if (state->i2cClientPath.empty())
             ALOGE("%s: Unable to locate i2c bus node", __func__);
-            return Status::ERROR;
-        }
     }
+    return state->i2cClientPath;
+}
+
+Status queryMoistureDetectionStatus(UsbPortState *state, PortStatus *portStatus) {
+    string enabled, status;
+
+    portStatus->contaminantProtectionStatus = ContaminantProtectionStatus::NONE;
+    portStatus->contaminantDetectionStatus = ContaminantDetectionStatus::NOT_SUPPORTED;
+    if (!state->hasTcpc)
+        return Status::SUCCESS;
+
+    portStatus->supportedContaminantProtectionModes
+            .push_back(ContaminantProtectionMode::FORCE_DISABLE);
+    portStatus->contaminantDetectionStatus = ContaminantDetectionStatus::DISABLED;
+    portStatus->supportsEnableContaminantPresenceDetection = true;
+    portStatus->supportsEnableContaminantPresenceProtection = false;
+
+    const string i2cClientPath = getTcpcPath(state);
+    if (i2cClientPath.empty())
+        return Status::ERROR;
 
-    enabledPath = usb->mI2cClientPath + kContaminantDetectionPath;
-    if (!ReadFileToString(enabledPath, &enabled)) {
+    if (!sSysfs.readFile(i2cClientPath + kContaminantDetectionPath, &enabled)) {
         ALOGE("Failed to open moisture_detection_enabled");
         return Status::ERROR;
     }
 
     enabled = Trim(enabled);
     if (enabled == "1") {
-        DetectedPath = usb->mI2cClientPath + kStatusPath;
-        if (!ReadFileToString(DetectedPath, &status)) {
+        if (!sSysfs.readFile(i2cClientPath + kStatusPath, &status)) {
             ALOGE("Failed to open moisture_detected");
             return Status::ERROR;
         }
         status = Trim(status);
         if (status == "1") {
-            (*currentPortStatus)[0].contaminantDetectionStatus =
-                ContaminantDetectionStatus::DETECTED;
-            (*currentPortStatus)[0].contaminantProtectionStatus =
-                ContaminantProtectionStatus::FORCE_DISABLE;
+            portStatus->contaminantDetectionStatus = ContaminantDetectionStatus::DETECTED;
+            portStatus->contaminantProtectionStatus = ContaminantProtectionStatus::FORCE_DISABLE;
         } else {
-            (*currentPortStatus)[0].contaminantDetectionStatus =
-                ContaminantDetectionStatus::NOT_DETECTED;
+            portStatus->contaminantDetectionStatus = ContaminantDetectionStatus::NOT_DETECTED;
         }
     }
 
-    ALOGI("ContaminantDetectionStatus:%d ContaminantProtectionStatus:%d",
-            (*currentPortStatus)[0].contaminantDetectionStatus,
-            (*currentPortStatus)[0].contaminantProtectionStatus);
+    ALOGI("%s ContaminantDetectionStatus:%d ContaminantProtectionStatus:%d",
+            portStatus->portName.c_str(), portStatus->contaminantDetectionStatus,
+            portStatus->contaminantProtectionStatus);
 
     return Status::SUCCESS;
 }
 
 Status queryNonCompliantChargerStatus(std::vector<PortStatus> *currentPortStatus) {
-    string reasons, path;
+    string reasons;
 
     for (int i = 0; i < currentPortStatus->size(); i++) {
         (*currentPortStatus)[i].supportsComplianceWarnings = true;
-        path = string(kTypecPath) + "/" + (*currentPortStatus)[i].portName + "/" +
-                string(kComplianceWarningsPath);
-        if (ReadFileToString(path.c_str(), &reasons)) {
+        if (sSysfs.readPortAttr((*currentPortStatus)[i].portName,
+                                SysfsAttributeCache::COMPLIANCE_WARNINGS, &reasons)) {
             std::vector<string> reasonsList = Tokenize(reasons.c_str(), "[], \n\0");
             for (string reason : reasonsList) {
                 if (!strncmp(reason.c_str(), kComplianceWarningDebugAccessory,
@@ -421,57 +415,14 @@ void switchToDrp(const string &portName) {
     }
 }
 
-bool switchMode(const string &portName, const PortRole &in_role, struct Usb *usb) {
-    string filename = appendRoleNodeHelper(string(portName.c_str()), in_role.getTag());
-    string written;
-    FILE *fp;
-    bool roleSwitch = false;
-
-    if (filename == "") {
-        ALOGE("Fatal: invalid node type");
-        return false;
-    }
-
-    fp = fopen(filename.c_str(), "w");
-    if (fp != NULL) {
-        // Hold the lock here to prevent loosing connected signals
-        // as once the file is written the partner added signal
-        // can arrive anytime.
-        pthread_mutex_lock(&usb->mPartnerLock);
-        usb->mPartnerUp = false;
-        int ret = fputs(convertRoletoString(in_role).c_str(), fp);
-        fclose(fp);
-
-        if (ret != EOF) {
-            struct timespec to;
-            struct timespec now;
-
-        wait_again:
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            to.tv_sec = now.tv_sec + PORT_TYPE_TIMEOUT;
-            to.tv_nsec = now.tv_nsec;
-
-            int err = pthread_cond_timedwait(&usb->mPartnerCV, &usb->mPartnerLock, &to);
-            // There are no uevent signals which implies role swap timed out.
-            if (err == ETIMEDOUT) {
-                ALOGI("uevents wait timedout");
-                // Validity check.
-            } else if (!usb->mPartnerUp) {
-                goto wait_again;
-                // Role switch succeeded since usb->mPartnerUp is true.
-            } else {
-                roleSwitch = true;
-            }
-        } else {
-            ALOGI("Role switch failed while wrting to file");
-        }
-        pthread_mutex_unlock(&usb->mPartnerLock);
-    }
-
-    if (!roleSwitch)
-        switchToDrp(string(portName.c_str()));
-
-    return roleSwitch;
+// Writes role to a role node. Returns 0 or the errno of the failed open or write.
+static int writeRoleNode(const string &filename, const string &role) {
+    unique_fd fd(TEMP_FAILURE_RETRY(open(filename.c_str(), O_WRONLY | O_CLOEXEC)));
+    if (fd.get() == -1)
+        return errno;
+    if (write(fd.get(), role.c_str(), role.size()) < 0)
+        return errno;
+    return 0;
 }
 
 static int getInternalHubUniqueId() {
@@ -537,36 +488,121 @@ static int usbDeviceAdded(const char *devname, void* client_data) {
     return 0;
 }
 
-void *usbHostWork(void *param) {
+static void startUsbHostMonitor(android::hardware::usb::Usb *usb) {
     struct usb_host_context *ctx;
-
-    ALOGI("creating USB host thread\n");
+    int fd;
 
     ctx = usb_host_init();
     if (!ctx) {
         ALOGE("usb_host_init failed\n");
-        return NULL;
+        return;
     }
 
-    // This will never return, it will keep monitoring USB sysfs inotify events
-    usb_host_run(ctx, usbDeviceAdded, usbDeviceRemoved, NULL, param);
+    // Reports the devices already present, then returns the inotify fd watching for new ones
+    fd = usb_host_load(ctx, usbDeviceAdded, usbDeviceRemoved, NULL, usb);
+    if (fd < 0) {
+        ALOGE("usb_host_load failed\n");
+        usb_host_cleanup(ctx);
+        return;
+    }
 
-    return NULL;
+    if (!usb->mEventLoop.addFd(fd, EPOLLIN, [ctx](uint32_t) { usb_host_read_event(ctx); }))
+        usb_host_cleanup(ctx);
 }
 
 void updatePortStatus(android::hardware::usb::Usb *usb) {
+    usb->requestPortStatusUpdate(false);
+}
+
+void Usb::requestPortStatusUpdate(bool checkDrp) {
+    mPortStatusRequests++;
+    mPortStatusCheckDrp |= checkDrp;
+
+    if (mPortStatusDebounceMs == 0 || mPortStatusTimerFd.get() == -1) {
+        runPortStatusUpdate();
+        return;
+    }
+    // Merged into the update already scheduled
+    if (mPortStatusUpdatePending)
+        return;
+
+    struct itimerspec delay = {};
+    delay.it_value.tv_sec = mPortStatusDebounceMs / 1000;
+    delay.it_value.tv_nsec = (mPortStatusDebounceMs % 1000) * 1000000;
+    if (timerfd_settime(mPortStatusTimerFd.get(), 0, &delay, NULL) == -1) {
+        ALOGE("timerfd_settime failed err:%d", errno);
+        runPortStatusUpdate();
+        return;
+    }
+    mPortStatusUpdatePending = true;
+}
+
+void Usb::runPortStatusUpdate() {
     std::vector<PortStatus> currentPortStatus;
+    bool checkDrp = mPortStatusCheckDrp;
+
+    mPortStatusUpdatePending = false;
+    mPortStatusCheckDrp = false;
+    mPortStatusRecomputes++;
+
+    queryVersionHelper(this, &currentPortStatus);
+    if (!checkDrp)
+        return;
+
+    // Role switch is not in progress and port is in disconnected state
+    for (unsigned long i = 0; i < currentPortStatus.size(); i++) {
+        const string &portName = currentPortStatus[i].portName;
+        if (!isRoleSwitchInProgress(portName) && !sTypecPorts.hasPartner(portName))
+            switchToDrp(portName);
+    }
+}
+
+void Usb::handleTypecRevalidateTimer() {
+    uint64_t numExpiration;
+    uint64_t corrections = sTypecPorts.getRescanCorrections();
+
+    if (read(mTypecRevalidateTimerFd.get(), &numExpiration, sizeof(numExpiration)) !=
+        sizeof(numExpiration))
+        return;
+
+    if (sTypecPorts.rescan() && sTypecPorts.getRescanCorrections() != corrections)
+        requestPortStatusUpdate(true);
+}
+
+void Usb::handleUeventLoss() {
+    // Partners and ports may have come and gone while uevents were dropped
+    sSysfs.invalidatePartners();
+    sTypecPorts.rescan();
+
+    // Mode switches whose partner added uevent was lost
+    for (auto &[portName, sw] : mRoleSwitches) {
+        if (sw.state == PortRoleSwitch::State::WAIT_PARTNER && sTypecPorts.hasPartner(portName))
+            finishRoleSwitch(portName, &sw, true);
+    }
+
+    requestPortStatusUpdate(true);
+}
+
+void Usb::handlePortStatusTimer() {
+    uint64_t numExpiration;
+
+    if (read(mPortStatusTimerFd.get(), &numExpiration, sizeof(numExpiration)) !=
+        sizeof(numExpiration))
+        return;
+
+    runPortStatusUpdate();
+}
 
-    queryVersionHelper(usb, &currentPortStatus);
+Usb::~Usb() {
+    // Handlers on the loop thread use the monitors and post to mCallbackDispatcher, which are
+    // destroyed before mEventLoop
+    mEventLoop.stop();
 }
 
 Usb::Usb()
     : mLock(PTHREAD_MUTEX_INITIALIZER),
-      mRoleSwitchLock(PTHREAD_MUTEX_INITIALIZER),
-      mPartnerLock(PTHREAD_MUTEX_INITIALIZER),
-      mPartnerUp(false),
-      mUsbDataSessionMonitor(kUdcUeventRegex, kUdcStatePath, kHost1UeventRegex, kHost1StatePath,
-                             kHost2UeventRegex, kHost2StatePath, kDataRolePath,
+      mUsbDataSessionMonitor(&mEventLoop, kUdcUeventRegex, kUdcStatePath, kHost1UeventRegex,
+                             kHost1StatePath, kHost2UeventRegex, kHost2StatePath, kDataRolePath,
                              std::bind(&updatePortStatus, this)),
       mOverheat(ZoneInfo(TemperatureType::USB_PORT, kThermalZoneForTrip,
                          ThrottlingSeverity::CRITICAL),
@@ -579,28 +615,43 @@ Usb::Usb()
       mUsbDataEnabled(true),
       mUsbHubVendorCmdValue(GL852G_VENDOR_CMD_VALUE_DEFAULT),
       mUsbHubVendorCmdIndex(GL852G_VENDOR_CMD_INDEX_DEFAULT),
-      mI2cClientPath("") {
-    pthread_condattr_t attr;
-    if (pthread_condattr_init(&attr)) {
-        ALOGE("pthread_condattr_init failed: %s", strerror(errno));
-        abort();
-    }
-    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) {
-        ALOGE("pthread_condattr_setclock failed: %s", strerror(errno));
-        abort();
-    }
-    if (pthread_cond_init(&mPartnerCV, &attr)) {
-        ALOGE("pthread_cond_init failed: %s", strerror(errno));
-        abort();
+      // Unchanged successful results are not notified
+      mPortStatus([](const PortStatusSnapshot &previous, const PortStatusSnapshot &current) {
+                      return previous.ports == current.ports && current.status == Status::SUCCESS;
+                  },
+                  [this](const std::shared_ptr<const PortStatusSnapshot> &snapshot) {
+                      notifyPortStatusChange(this, snapshot);
+                  }),
+      mPortStatusDebounceMs(::android::base::GetUintProperty<uint64_t>(
+              kPortStatusDebounceMs, kDefaultPortStatusDebounceMs)),
+      mPortStatusUpdatePending(false),
+      mPortStatusCheckDrp(false),
+      mPortStatusRequests(0),
+      mPortStatusRecomputes(0) {
+    startUsbHostMonitor(this);
+    mPortStatusTimerFd.reset(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (mPortStatusTimerFd.get() == -1 ||
+        !mEventLoop.addFd(mPortStatusTimerFd.get(), EPOLLIN,
+                          [this](uint32_t) { handlePortStatusTimer(); })) {
+        ALOGE("port status debounce timer unavailable, updating on every event");
+        mPortStatusTimerFd.reset();
     }
-    if (pthread_condattr_destroy(&attr)) {
-        ALOGE("pthread_condattr_destroy failed: %s", strerror(errno));
-        abort();
-    }
-    if (pthread_create(&mUsbHost, NULL, usbHostWork, this)) {
-        ALOGE("pthread creation failed %d\n", errno);
-        abort();
+    sTypecPorts.rescan();
+    struct itimerspec period = {};
+    period.it_interval.tv_sec = kTypecRevalidateSec;
+    period.it_value.tv_sec = kTypecRevalidateSec;
+    mTypecRevalidateTimerFd.reset(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (mTypecRevalidateTimerFd.get() == -1 ||
+        timerfd_settime(mTypecRevalidateTimerFd.get(), 0, &period, NULL) == -1 ||
+        !mEventLoop.addFd(mTypecRevalidateTimerFd.get(), EPOLLIN,
+                          [this](uint32_t) { handleTypecRevalidateTimer(); })) {
+        ALOGE("typec port revalidation timer unavailable");
+        mTypecRevalidateTimerFd.reset();
     }
+    mEventLoop.addUeventHandler(
+            [this](const UeventMessage &uevent) { uevent_event(this, uevent); });
+    mEventLoop.addResyncHandler([this]() { handleUeventLoss(); });
+    mEventLoop.start();
 
     ALOGI("feature flag enable_usb_data_compliance_warning: %d",
           usb_flags::enable_usb_data_compliance_warning());
@@ -610,62 +661,189 @@ Usb::Usb()
 
 ScopedAStatus Usb::switchRole(const string& in_portName, const PortRole& in_role,
         int64_t in_transactionId) {
-    string filename = appendRoleNodeHelper(string(in_portName.c_str()), in_role.getTag());
-    string written;
-    FILE *fp;
-    bool roleSwitch = false;
-
-    if (filename == "") {
+    if (appendRoleNodeHelper(in_portName, in_role.getTag()) == "") {
         ALOGE("Fatal: invalid node type");
         return ScopedAStatus::ok();
     }
 
-    pthread_mutex_lock(&mRoleSwitchLock);
+    // The switch runs on the event loop; completion is reported via notifyRoleSwitchStatus
+    RoleSwitchRequest request = {.role = in_role, .transactionId = in_transactionId};
+    mEventLoop.post([this, in_portName, request]() { queueRoleSwitch(in_portName, request); });
+    return ScopedAStatus::ok();
+}
 
-    ALOGI("filename write: %s role:%s", filename.c_str(), convertRoletoString(in_role).c_str());
+void Usb::notifyRoleSwitchStatus(const string &portName, const PortRole &role, Status status,
+                                 int64_t transactionId) {
+    notifyCallback("notifyRoleSwitchStatus", [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyRoleSwitchStatus(portName, role, status, transactionId);
+    });
+}
 
-    if (in_role.getTag() == PortRole::mode) {
-        roleSwitch = switchMode(in_portName, in_role, this);
-    } else {
-        fp = fopen(filename.c_str(), "w");
-        if (fp != NULL) {
-            int ret = fputs(convertRoletoString(in_role).c_str(), fp);
-            if (ret == EAGAIN) {
-                ALOGI("role switch busy, retry in %d ms", ROLE_SWAP_RETRY_MS);
-                std::this_thread::sleep_for(std::chrono::milliseconds(ROLE_SWAP_RETRY_MS));
-                ret = fputs(convertRoletoString(in_role).c_str(), fp);
-            }
-            fclose(fp);
-            if ((ret != EOF) && ReadFileToString(filename, &written)) {
-                written = Trim(written);
-                extractRole(&written);
-                ALOGI("written: %s", written.c_str());
-                if (written == convertRoletoString(in_role)) {
-                    roleSwitch = true;
-                } else {
-                    ALOGE("Role switch failed");
-                }
-            } else {
-                ALOGE("failed to update the new role");
-            }
-        } else {
-            ALOGE("fopen failed");
+void Usb::queueRoleSwitch(const string &portName, const RoleSwitchRequest &request) {
+    // Only ports in the typec table get a switch state, and with it a timer registration
+    if (!sTypecPorts.hasPort(portName)) {
+        ALOGE("role switch %" PRId64 " for unknown port %s", request.transactionId,
+              portName.c_str());
+        notifyRoleSwitchStatus(portName, request.role, Status::INVALID_ARGUMENT,
+                               request.transactionId);
+        return;
+    }
+
+    PortRoleSwitch *sw = &mRoleSwitches[portName];
+
+    if (sw->state == PortRoleSwitch::State::IDLE) {
+        sw->active = request;
+        startRoleSwitch(portName, sw);
+        return;
+    }
+
+    // Only the latest request waits for the switch in progress, older ones are superseded
+    if (sw->pending) {
+        ALOGI("role switch %" PRId64 " superseded by %" PRId64, sw->pending->transactionId,
+              request.transactionId);
+        notifyRoleSwitchStatus(portName, sw->pending->role, Status::ERROR,
+                               sw->pending->transactionId);
+    }
+    sw->pending = request;
+}
+
+bool Usb::armRoleSwitchTimer(const string &portName, PortRoleSwitch *sw, uint64_t delayMs) {
+    struct itimerspec delay = {};
+
+    if (sw->timerFd.get() == -1) {
+        sw->timerFd.reset(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC));
+        if (sw->timerFd.get() == -1 ||
+            !mEventLoop.addFd(sw->timerFd.get(), EPOLLIN,
+                              [this, portName](uint32_t) { handleRoleSwitchTimer(portName); })) {
+            ALOGE("role switch timer unavailable err:%d", errno);
+            sw->timerFd.reset();
+            return false;
         }
     }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-         ScopedAStatus ret = mCallback->notifyRoleSwitchStatus(
-            in_portName, in_role, roleSwitch ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("RoleSwitchStatus error %s", ret.getDescription().c_str());
+    delay.it_value.tv_sec = delayMs / 1000;
+    delay.it_value.tv_nsec = (delayMs % 1000) * 1000000;
+    if (timerfd_settime(sw->timerFd.get(), 0, &delay, NULL) == -1) {
+        ALOGE("timerfd_settime failed err:%d", errno);
+        return false;
+    }
+    return true;
+}
+
+void Usb::startRoleSwitch(const string &portName, PortRoleSwitch *sw) {
+    const PortRole &role = sw->active.role;
+    string filename = appendRoleNodeHelper(portName, role.getTag());
+
+    ALOGI("filename write: %s role:%s", filename.c_str(), convertRoletoString(role).c_str());
+
+    if (role.getTag() != PortRole::mode) {
+        writeDataOrPowerRole(portName, sw, false);
+        return;
+    }
+
+    // The partner added uevent is handled on this thread too, so it cannot be missed between
+    // the write and entering WAIT_PARTNER
+    if (writeRoleNode(filename, convertRoletoString(role))) {
+        ALOGI("Role switch failed while wrting to file");
+        finishRoleSwitch(portName, sw, false);
+        return;
+    }
+    sw->state = PortRoleSwitch::State::WAIT_PARTNER;
+    if (!armRoleSwitchTimer(portName, sw, PORT_TYPE_TIMEOUT * 1000))
+        finishRoleSwitch(portName, sw, false);
+}
+
+void Usb::writeDataOrPowerRole(const string &portName, PortRoleSwitch *sw, bool retry) {
+    const PortRole &role = sw->active.role;
+    string filename = appendRoleNodeHelper(portName, role.getTag());
+    string written;
+
+    int err = writeRoleNode(filename, convertRoletoString(role));
+    if (err == EAGAIN && !retry) {
+        ALOGI("role switch busy, retry in %d ms", ROLE_SWAP_RETRY_MS);
+        sw->state = PortRoleSwitch::State::WAIT_RETRY;
+        if (armRoleSwitchTimer(portName, sw, ROLE_SWAP_RETRY_MS))
+            return;
+    }
+
+    bool roleSwitch = false;
+    if (!err && ReadFileToString(filename, &written)) {
+        written = Trim(written);
+        extractRole(&written);
+        ALOGI("written: %s", written.c_str());
+        if (written == convertRoletoString(role)) {
+            roleSwitch = true;
+        } else {
+            ALOGE("Role switch failed");
+        }
     } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
+        ALOGE("failed to update the new role err:%d", err);
     }
-    pthread_mutex_unlock(&mLock);
-    pthread_mutex_unlock(&mRoleSwitchLock);
+    finishRoleSwitch(portName, sw, roleSwitch);
+}
 
-    return ScopedAStatus::ok();
+void Usb::finishRoleSwitch(const string &portName, PortRoleSwitch *sw, bool success) {
+    struct itimerspec disarm = {};
+
+    if (sw->timerFd.get() != -1)
+        timerfd_settime(sw->timerFd.get(), 0, &disarm, NULL);
+    if (!success && sw->active.role.getTag() == PortRole::mode)
+        switchToDrp(portName);
+
+    sw->state = PortRoleSwitch::State::IDLE;
+    notifyRoleSwitchStatus(portName, sw->active.role, success ? Status::SUCCESS : Status::ERROR,
+                           sw->active.transactionId);
+
+    if (sw->pending) {
+        sw->active = *sw->pending;
+        sw->pending.reset();
+        startRoleSwitch(portName, sw);
+    }
+}
+
+void Usb::cancelRoleSwitch(const string &portName) {
+    auto it = mRoleSwitches.find(portName);
+    if (it == mRoleSwitches.end() || it->second.state == PortRoleSwitch::State::IDLE)
+        return;
+
+    PortRoleSwitch *sw = &it->second;
+    if (sw->pending) {
+        notifyRoleSwitchStatus(portName, sw->pending->role, Status::ERROR,
+                               sw->pending->transactionId);
+        sw->pending.reset();
+    }
+    ALOGI("role switch %" PRId64 " cancelled", sw->active.transactionId);
+    finishRoleSwitch(portName, sw, false);
+}
+
+void Usb::handleRoleSwitchTimer(const string &portName) {
+    auto it = mRoleSwitches.find(portName);
+    uint64_t numExpiration;
+
+    if (it == mRoleSwitches.end() ||
+        read(it->second.timerFd.get(), &numExpiration, sizeof(numExpiration)) !=
+                sizeof(numExpiration))
+        return;
+
+    PortRoleSwitch *sw = &it->second;
+    if (sw->state == PortRoleSwitch::State::WAIT_PARTNER) {
+        // There are no uevent signals which implies role swap timed out.
+        ALOGI("uevents wait timedout");
+        finishRoleSwitch(portName, sw, false);
+    } else if (sw->state == PortRoleSwitch::State::WAIT_RETRY) {
+        writeDataOrPowerRole(portName, sw, true);
+    }
+}
+
+void Usb::handlePartnerAdded(const string &portName) {
+    auto it = mRoleSwitches.find(portName);
+    if (it != mRoleSwitches.end() && it->second.state == PortRoleSwitch::State::WAIT_PARTNER)
+        finishRoleSwitch(portName, &it->second, true);
+}
+
+bool Usb::isRoleSwitchInProgress(const string &portName) {
+    auto it = mRoleSwitches.find(portName);
+    return it != mRoleSwitches.end() && it->second.state != PortRoleSwitch::State::IDLE;
 }
 
 ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
@@ -674,19 +852,18 @@ ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
     std::vector<PortStatus> currentPortStatus;
     string sinkLimitEnablePath, currentLimitPath, sourceLimitEnablePath;
 
-    if (mI2cClientPath.empty()) {
-        mI2cClientPath = getI2cClientPath(kHsi2cPath, kTcpcDevName, kI2cClientId);
-        if (mI2cClientPath.empty()) {
-            ALOGE("%s: Unable to locate i2c bus node", __func__);
-            return ScopedAStatus::ok();
-        }
+    mPortStatusLock.lock();
+    const string i2cClientPath = getTcpcPath(getPortState(in_portName));
+    if (i2cClientPath.empty()) {
+        ALOGE("%s: no TCPC for %s", __func__, in_portName.c_str());
+        mPortStatusLock.unlock();
+        return ScopedAStatus::ok();
     }
 
-    sinkLimitEnablePath = mI2cClientPath + kSinkLimitEnable;
-    currentLimitPath = mI2cClientPath + kSinkLimitCurrent;
-    sourceLimitEnablePath = mI2cClientPath + kSourceLimitEnable;
+    sinkLimitEnablePath = i2cClientPath + kSinkLimitEnable;
+    currentLimitPath = i2cClientPath + kSinkLimitCurrent;
+    sourceLimitEnablePath = i2cClientPath + kSourceLimitEnable;
 
-    pthread_mutex_lock(&mLock);
     if (in_limit) {
         success = WriteStringToFile("0", currentLimitPath);
         if (!success) {
@@ -708,52 +885,47 @@ ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
     }
 
     ALOGI("limitPowerTransfer limit:%c opId:%ld", in_limit ? 'y' : 'n', in_transactionId);
-    if (mCallback != NULL && in_transactionId >= 0) {
-        ScopedAStatus ret = mCallback->notifyLimitPowerTransferStatus(
-                in_portName, in_limit, sessionFail ? Status::ERROR : Status::SUCCESS,
-                in_transactionId);
-        if (!ret.isOk())
-            ALOGE("limitPowerTransfer error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
+    mPortStatusLock.unlock();
+    if (in_transactionId >= 0) {
+        notifyCallback("notifyLimitPowerTransferStatus",
+                       [=](const shared_ptr<IUsbCallback> &callback) {
+            return callback->notifyLimitPowerTransferStatus(
+                    in_portName, in_limit, sessionFail ? Status::ERROR : Status::SUCCESS,
+                    in_transactionId);
+        });
     }
-
-    pthread_mutex_unlock(&mLock);
     queryVersionHelper(this, &currentPortStatus);
 
     return ScopedAStatus::ok();
 }
 
-Status queryPowerTransferStatus(android::hardware::usb::Usb *usb,
-                                std::vector<PortStatus> *currentPortStatus) {
-    string limitedPath, enabled;
+Status queryPowerTransferStatus(UsbPortState *state, PortStatus *portStatus) {
+    string enabled;
 
-    if (usb->mI2cClientPath.empty()) {
-        usb->mI2cClientPath = getI2cClientPath(kHsi2cPath, kTcpcDevName, kI2cClientId);
-        if (usb->mI2cClientPath.empty()) {
-            ALOGE("%s: Unable to locate i2c bus node", __func__);
-            return Status::ERROR;
-        }
-    }
+    if (!state->hasTcpc)
+        return Status::SUCCESS;
+
+    const string i2cClientPath = getTcpcPath(state);
+    if (i2cClientPath.empty())
+        return Status::ERROR;
 
-    limitedPath = usb->mI2cClientPath + kSinkLimitEnable;
-    if (!ReadFileToString(limitedPath, &enabled)) {
+    if (!sSysfs.readFile(i2cClientPath + kSinkLimitEnable, &enabled)) {
         ALOGE("Failed to open limit_sink_enable");
         return Status::ERROR;
     }
 
     enabled = Trim(enabled);
-    (*currentPortStatus)[0].powerTransferLimited = enabled == "1";
+    portStatus->powerTransferLimited = enabled == "1";
 
-    ALOGI("powerTransferLimited:%d", (*currentPortStatus)[0].powerTransferLimited ? 1 : 0);
+    ALOGI("%s powerTransferLimited:%d", portStatus->portName.c_str(),
+          portStatus->powerTransferLimited ? 1 : 0);
     return Status::SUCCESS;
 }
 
 Status getAccessoryConnected(const string &portName, string *accessory) {
-    string filename = "/sys/class/typec/" + portName + "-partner/accessory_mode";
-
-    if (!ReadFileToString(filename, accessory)) {
-        ALOGE("getAccessoryConnected: Failed to open filesystem node: %s", filename.c_str());
+    if (!sSysfs.readPortAttr(portName, SysfsAttributeCache::PARTNER_ACCESSORY_MODE, accessory)) {
+        ALOGE("getAccessoryConnected: Failed to open filesystem node: %s-partner/accessory_mode",
+              portName.c_str());
         return Status::ERROR;
     }
     *accessory = Trim(*accessory);
@@ -762,20 +934,20 @@ Status getAccessoryConnected(const string &portName, string *accessory) {
 }
 
 Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *currentRole) {
-    string filename;
+    SysfsAttributeCache::PortAttr attr;
     string roleName;
     string accessory;
 
     // Mode
 
     if (currentRole->getTag() == PortRole::powerRole) {
-        filename = "/sys/class/typec/" + portName + "/power_role";
+        attr = SysfsAttributeCache::POWER_ROLE;
         currentRole->set<PortRole::powerRole>(PortPowerRole::NONE);
     } else if (currentRole->getTag() == PortRole::dataRole) {
-        filename = "/sys/class/typec/" + portName + "/data_role";
+        attr = SysfsAttributeCache::DATA_ROLE;
         currentRole->set<PortRole::dataRole>(PortDataRole::NONE);
     } else if (currentRole->getTag() == PortRole::mode) {
-        filename = "/sys/class/typec/" + portName + "/data_role";
+        attr = SysfsAttributeCache::DATA_ROLE;
         currentRole->set<PortRole::mode>(PortMode::NONE);
     } else {
         return Status::ERROR;
@@ -797,8 +969,8 @@ Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *cu
         }
     }
 
-    if (!ReadFileToString(filename, &roleName)) {
-        ALOGE("getCurrentRole: Failed to open filesystem node: %s", filename.c_str());
+    if (!sSysfs.readPortAttr(portName, attr, &roleName)) {
+        ALOGE("getCurrentRole: Failed to read role of %s", portName.c_str());
         return Status::ERROR;
     }
 
@@ -828,39 +1000,18 @@ Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *cu
     return Status::SUCCESS;
 }
 
-Status getTypeCPortNamesHelper(std::unordered_map<string, bool> *names) {
-    DIR *dp;
-
-    dp = opendir(kTypecPath);
-    if (dp != NULL) {
-        struct dirent *ep;
-
-        while ((ep = readdir(dp))) {
-            if (ep->d_type == DT_LNK) {
-                if (string::npos == string(ep->d_name).find("-partner")) {
-                    std::unordered_map<string, bool>::const_iterator portName =
-                        names->find(ep->d_name);
-                    if (portName == names->end()) {
-                        names->insert({ep->d_name, false});
-                    }
-                } else {
-                    (*names)[std::strtok(ep->d_name, "-")] = true;
-                }
-            }
-        }
-        closedir(dp);
+Status getTypeCPortNamesHelper(std::vector<std::pair<string, bool>> *names) {
+    if (sTypecPorts.getPorts(names))
         return Status::SUCCESS;
-    }
 
     ALOGE("Failed to open /sys/class/typec");
     return Status::ERROR;
 }
 
 bool canSwitchRoleHelper(const string &portName) {
-    string filename = "/sys/class/typec/" + portName + "-partner/supports_usb_power_delivery";
     string supportsPD;
 
-    if (ReadFileToString(filename, &supportsPD)) {
+    if (sSysfs.readPortAttr(portName, SysfsAttributeCache::PARTNER_SUPPORTS_PD, &supportsPD)) {
         supportsPD = Trim(supportsPD);
         if (supportsPD == "yes") {
             return true;
@@ -870,155 +1021,204 @@ bool canSwitchRoleHelper(const string &portName) {
     return false;
 }
 
-Status getPortStatusHelper(android::hardware::usb::Usb *usb,
-        std::vector<PortStatus> *currentPortStatus) {
-    std::unordered_map<string, bool> names;
-    Status result = getTypeCPortNamesHelper(&names);
-    int i = -1;
-
-    if (result == Status::SUCCESS) {
-        currentPortStatus->resize(names.size());
-        for (std::pair<string, bool> port : names) {
-            i++;
-            ALOGI("%s", port.first.c_str());
-            (*currentPortStatus)[i].portName = port.first;
-
-            PortRole currentRole;
-            currentRole.set<PortRole::powerRole>(PortPowerRole::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
-                (*currentPortStatus)[i].currentPowerRole = currentRole.get<PortRole::powerRole>();
-            } else {
-                ALOGE("Error while retrieving portNames");
-                goto done;
-            }
+Status getPortStatusHelper(android::hardware::usb::Usb *usb, const std::pair<string, bool> &port,
+                           PortStatus *portStatus) {
+    ALOGI("%s", port.first.c_str());
+    portStatus->portName = port.first;
 
-            currentRole.set<PortRole::dataRole>(PortDataRole::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
-                (*currentPortStatus)[i].currentDataRole = currentRole.get<PortRole::dataRole>();
-            } else {
-                ALOGE("Error while retrieving current port role");
-                goto done;
-            }
+    PortRole currentRole;
+    currentRole.set<PortRole::powerRole>(PortPowerRole::NONE);
+    if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
+        portStatus->currentPowerRole = currentRole.get<PortRole::powerRole>();
+    } else {
+        ALOGE("Error while retrieving portNames");
+        return Status::ERROR;
+    }
 
-            currentRole.set<PortRole::mode>(PortMode::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
-                (*currentPortStatus)[i].currentMode = currentRole.get<PortRole::mode>();
-            } else {
-                ALOGE("Error while retrieving current data role");
-                goto done;
-            }
+    currentRole.set<PortRole::dataRole>(PortDataRole::NONE);
+    if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
+        portStatus->currentDataRole = currentRole.get<PortRole::dataRole>();
+    } else {
+        ALOGE("Error while retrieving current port role");
+        return Status::ERROR;
+    }
 
-            (*currentPortStatus)[i].canChangeMode = true;
-            (*currentPortStatus)[i].canChangeDataRole =
-                port.second ? canSwitchRoleHelper(port.first) : false;
-            (*currentPortStatus)[i].canChangePowerRole =
-                port.second ? canSwitchRoleHelper(port.first) : false;
-
-            (*currentPortStatus)[i].supportedModes.push_back(PortMode::DRP);
-
-            bool dataEnabled = true;
-            string pogoUsbActive = "0";
-            if (ReadFileToString(string(kPogoUsbActive), &pogoUsbActive) &&
-                stoi(Trim(pogoUsbActive)) == 1) {
-                /*
-                 * Always signal USB device mode disabled irrespective of hub enabled while docked.
-                 * Hub gets automatically enabled as needed. Signalling DISABLED_DOCK_HOST_MODE &
-                 * DEVICE_MODE during pogo direct can cause notifications to show for brief windows
-                 * when the state machine is still moving to steady state.
-                 */
-                (*currentPortStatus)[i].usbDataStatus.push_back(UsbDataStatus::DISABLED_DOCK_DEVICE_MODE);
-                dataEnabled = false;
-            }
-            if (!usb->mUsbDataEnabled) {
-                (*currentPortStatus)[i].usbDataStatus.push_back(UsbDataStatus::DISABLED_FORCE);
-                dataEnabled = false;
-            }
-            if (dataEnabled) {
-                (*currentPortStatus)[i].usbDataStatus.push_back(UsbDataStatus::ENABLED);
-            }
+    currentRole.set<PortRole::mode>(PortMode::NONE);
+    if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
+        portStatus->currentMode = currentRole.get<PortRole::mode>();
+    } else {
+        ALOGE("Error while retrieving current data role");
+        return Status::ERROR;
+    }
 
-            // When connected return powerBrickStatus
-            if (port.second) {
-                string usbType;
-                if ((*currentPortStatus)[i].currentPowerRole == PortPowerRole::SOURCE) {
-                    (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::NOT_CONNECTED;
-                } else if (ReadFileToString(string(kPowerSupplyUsbType), &usbType)) {
-                    if (strstr(usbType.c_str(), "[D")) {
-                        (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::CONNECTED;
-                    } else if (strstr(usbType.c_str(), "[U")) {
-                        (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::UNKNOWN;
-                    } else {
-                        (*currentPortStatus)[i].powerBrickStatus =
-                                PowerBrickStatus::NOT_CONNECTED;
-                    }
-                } else {
-                    ALOGE("Error while reading usb_type");
-                }
+    portStatus->canChangeMode = true;
+    portStatus->canChangeDataRole = port.second ? canSwitchRoleHelper(port.first) : false;
+    portStatus->canChangePowerRole = port.second ? canSwitchRoleHelper(port.first) : false;
+
+    portStatus->supportedModes.push_back(PortMode::DRP);
+
+    bool dataEnabled = true;
+    string pogoUsbActive = "0";
+    if (sSysfs.readFile(kPogoUsbActive, &pogoUsbActive) && stoi(Trim(pogoUsbActive)) == 1) {
+        /*
+         * Always signal USB device mode disabled irrespective of hub enabled while docked.
+         * Hub gets automatically enabled as needed. Signalling DISABLED_DOCK_HOST_MODE &
+         * DEVICE_MODE during pogo direct can cause notifications to show for brief windows
+         * when the state machine is still moving to steady state.
+         */
+        portStatus->usbDataStatus.push_back(UsbDataStatus::DISABLED_DOCK_DEVICE_MODE);
+        dataEnabled = false;
+    }
+    if (!usb->mUsbDataEnabled) {
+        portStatus->usbDataStatus.push_back(UsbDataStatus::DISABLED_FORCE);
+        dataEnabled = false;
+    }
+    if (dataEnabled) {
+        portStatus->usbDataStatus.push_back(UsbDataStatus::ENABLED);
+    }
+
+    // When connected return powerBrickStatus
+    if (port.second) {
+        string usbType;
+        if (portStatus->currentPowerRole == PortPowerRole::SOURCE) {
+            portStatus->powerBrickStatus = PowerBrickStatus::NOT_CONNECTED;
+        } else if (sSysfs.readFile(kPowerSupplyUsbType, &usbType)) {
+            if (strstr(usbType.c_str(), "[D")) {
+                portStatus->powerBrickStatus = PowerBrickStatus::CONNECTED;
+            } else if (strstr(usbType.c_str(), "[U")) {
+                portStatus->powerBrickStatus = PowerBrickStatus::UNKNOWN;
             } else {
-                (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::NOT_CONNECTED;
+                portStatus->powerBrickStatus = PowerBrickStatus::NOT_CONNECTED;
             }
-
-            ALOGI("%d:%s connected:%d canChangeMode:%d canChagedata:%d canChangePower:%d "
-                  "usbDataEnabled:%d",
-                i, port.first.c_str(), port.second,
-                (*currentPortStatus)[i].canChangeMode,
-                (*currentPortStatus)[i].canChangeDataRole,
-                (*currentPortStatus)[i].canChangePowerRole,
-                dataEnabled ? 1 : 0);
+        } else {
+            ALOGE("Error while reading usb_type");
         }
-
-        return Status::SUCCESS;
+    } else {
+        portStatus->powerBrickStatus = PowerBrickStatus::NOT_CONNECTED;
     }
-done:
-    return Status::ERROR;
+
+    ALOGI("%s connected:%d canChangeMode:%d canChagedata:%d canChangePower:%d "
+          "usbDataEnabled:%d",
+        port.first.c_str(), port.second,
+        portStatus->canChangeMode,
+        portStatus->canChangeDataRole,
+        portStatus->canChangePowerRole,
+        dataEnabled ? 1 : 0);
+
+    return Status::SUCCESS;
 }
 
-void queryUsbDataSession(android::hardware::usb::Usb *usb,
-                          std::vector<PortStatus> *currentPortStatus) {
+void queryUsbDataSession(UsbPortState *state, PortStatus *portStatus) {
     std::vector<ComplianceWarning> warnings;
 
-    usb->mUsbDataSessionMonitor.getComplianceWarnings(
-        (*currentPortStatus)[0].currentDataRole, &warnings);
-    (*currentPortStatus)[0].complianceWarnings.insert(
-        (*currentPortStatus)[0].complianceWarnings.end(),
+    if (state->dataSessionMonitor == nullptr)
+        return;
+
+    state->dataSessionMonitor->getComplianceWarnings(portStatus->currentDataRole, &warnings);
+    portStatus->complianceWarnings.insert(
+        portStatus->complianceWarnings.end(),
         warnings.begin(),
         warnings.end());
 }
 
-void queryVersionHelper(android::hardware::usb::Usb *usb,
-                        std::vector<PortStatus> *currentPortStatus) {
-    Status status;
-    pthread_mutex_lock(&usb->mLock);
-    status = getPortStatusHelper(usb, currentPortStatus);
-    queryMoistureDetectionStatus(usb, currentPortStatus);
-    queryPowerTransferStatus(usb, currentPortStatus);
-    queryNonCompliantChargerStatus(currentPortStatus);
-    queryUsbDataSession(usb, currentPortStatus);
-    if (usb->mCallback != NULL) {
-        ScopedAStatus ret = usb->mCallback->notifyPortStatusChange(*currentPortStatus,
-            status);
+// Computes the status of one port from its own hardware state only
+static Status queryPort(android::hardware::usb::Usb *usb, const std::pair<string, bool> &port,
+                        UsbPortState *state, PortStatus *portStatus) {
+    Status status = getPortStatusHelper(usb, port, portStatus);
+
+    queryMoistureDetectionStatus(state, portStatus);
+    queryPowerTransferStatus(state, portStatus);
+    queryUsbDataSession(state, portStatus);
+    return status;
+}
+
+UsbPortState *Usb::getPortState(const string &portName) {
+    auto it = mPorts.find(portName);
+    if (it != mPorts.end())
+        return &it->second;
+
+    // Names come from binder callers too; only ports that exist get an entry
+    if (portName != kBuiltinPortName && !sTypecPorts.hasPort(portName))
+        return nullptr;
+
+    UsbPortState *state = &mPorts[portName];
+    if (portName == kBuiltinPortName) {
+        state->hasTcpc = true;
+        state->dataSessionMonitor = &mUsbDataSessionMonitor;
+    }
+    return state;
+}
+
+void Usb::notifyCallback(const char *name,
+                         std::function<ScopedAStatus(const shared_ptr<IUsbCallback> &)> notify) {
+    mCallbackDispatcher.post([this, name, notify = std::move(notify)]() {
+        pthread_mutex_lock(&mLock);
+        shared_ptr<IUsbCallback> callback = mCallback;
+        pthread_mutex_unlock(&mLock);
+
+        if (callback == NULL) {
+            ALOGE("Not notifying the userspace. Callback is not set");
+            return;
+        }
+        ScopedAStatus ret = notify(callback);
         if (!ret.isOk())
-            ALOGE("queryPortStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGI("Notifying userspace skipped. Callback is NULL");
+            ALOGE("%s error %s", name, ret.getDescription().c_str());
+    });
+}
+
+static void notifyPortStatusChange(android::hardware::usb::Usb *usb,
+                                   std::shared_ptr<const PortStatusSnapshot> snapshot) {
+    usb->notifyCallback("notifyPortStatusChange",
+                        [snapshot](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyPortStatusChange(snapshot->ports, snapshot->status);
+    });
+}
+
+void queryVersionHelper(android::hardware::usb::Usb *usb,
+                        std::vector<PortStatus> *currentPortStatus, bool forceNotify) {
+    std::vector<std::pair<string, bool>> names;
+    std::vector<UsbPortState> states;
+
+    // Taken before reading sysfs, which is read without mPortStatusLock
+    const uint64_t generation = usb->mPortStatus.begin();
+    Status status = getTypeCPortNamesHelper(&names);
+    {
+        // The computation works on copies of the port states, with their TCPC path resolved
+        std::lock_guard<std::mutex> lock(usb->mPortStatusLock);
+        for (const auto &port : names) {
+            // A port removed since the names were listed reports the defaults
+            UsbPortState *state = usb->getPortState(port.first);
+            getTcpcPath(state);
+            states.push_back(state ? *state : UsbPortState());
+        }
     }
-    pthread_mutex_unlock(&usb->mLock);
+    currentPortStatus->assign(names.size(), PortStatus());
+
+    /*
+     * Ports are evaluated one after the other: their reads all go through sSysfs, whose lock
+     * would serialize them anyway, and most take microseconds once the attributes are open.
+     */
+    for (size_t i = 0; i < names.size(); i++) {
+        if (queryPort(usb, names[i], &states[i], &(*currentPortStatus)[i]) != Status::SUCCESS)
+            status = Status::ERROR;
+    }
+    queryNonCompliantChargerStatus(currentPortStatus);
+
+    // Notifications are queued under the publication lock, so they reach the callback in
+    // computation order
+    usb->mPortStatus.publish(generation,
+                             std::make_shared<const PortStatusSnapshot>(PortStatusSnapshot{
+                                     .ports = *currentPortStatus, .status = status}),
+                             forceNotify);
 }
 
 ScopedAStatus Usb::queryPortStatus(int64_t in_transactionId) {
     std::vector<PortStatus> currentPortStatus;
 
-    queryVersionHelper(this, &currentPortStatus);
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyQueryPortStatus(
-            "all", Status::SUCCESS, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyQueryPortStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    queryVersionHelper(this, &currentPortStatus, true);
+    notifyCallback("notifyQueryPortStatus", [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyQueryPortStatus("all", Status::SUCCESS, in_transactionId);
+    });
 
     return ScopedAStatus::ok();
 }
@@ -1029,19 +1229,19 @@ ScopedAStatus Usb::enableContaminantPresenceDetection(const string& in_portName,
     std::vector<PortStatus> currentPortStatus;
     bool success = true;
 
-    if (disable != "true")
-        success = WriteStringToFile(in_enable ? "1" : "0", enabledPath);
+    if (disable != "true") {
+        std::lock_guard<std::mutex> lock(mPortStatusLock);
+        const string i2cClientPath = getTcpcPath(getPortState(in_portName));
+        success = !i2cClientPath.empty() &&
+                  WriteStringToFile(in_enable ? "1" : "0",
+                                    i2cClientPath + kContaminantDetectionPath);
+    }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyContaminantEnabledStatus(
+    notifyCallback("notifyContaminantEnabledStatus",
+                   [=](const shared_ptr<IUsbCallback> &callback) {
+        return callback->notifyContaminantEnabledStatus(
             in_portName, in_enable, success ? Status::SUCCESS : Status::ERROR, in_transactionId);
-        if (!ret.isOk())
-            ALOGE("notifyContaminantEnabledStatus error %s", ret.getDescription().c_str());
-    } else {
-        ALOGE("Not notifying the userspace. Callback is not set");
-    }
-    pthread_mutex_unlock(&mLock);
+    });
 
     queryVersionHelper(this, &currentPortStatus);
     return ScopedAStatus::ok();
@@ -1080,174 +1280,65 @@ void report_overheat_event(android::hardware::usb::Usb *usb) {
     }
 }
 
-struct data {
-    int uevent_fd;
-    ::aidl::android::hardware::usb::Usb *usb;
-};
-
-static void uevent_event(uint32_t /*epevents*/, struct data *payload) {
-    char msg[UEVENT_MSG_LEN + 2];
-    char *cp;
-    int n;
-
-    n = uevent_kernel_multicast_recv(payload->uevent_fd, msg, UEVENT_MSG_LEN);
-    if (n <= 0)
-        return;
-    if (n >= UEVENT_MSG_LEN) /* overflow -- discard */
-        return;
-
-    msg[n] = '\0';
-    msg[n + 1] = '\0';
-    cp = msg;
-
-    while (*cp) {
-        if (std::regex_match(cp, std::regex("(add)(.*)(-partner)"))) {
-            ALOGI("partner added");
-            pthread_mutex_lock(&payload->usb->mPartnerLock);
-            payload->usb->mPartnerUp = true;
-            pthread_cond_signal(&payload->usb->mPartnerCV);
-            pthread_mutex_unlock(&payload->usb->mPartnerLock);
-        } else if (!strncmp(cp, "DEVTYPE=typec_", strlen("DEVTYPE=typec_")) ||
-                   !strncmp(cp, "DRIVER=max77759tcpc",
-                            strlen("DRIVER=max77759tcpc")) ||
-                   !strncmp(cp, "DRIVER=pogo-transport",
-                            strlen("DRIVER=pogo-transport")) ||
-                   !strncmp(cp, "POWER_SUPPLY_NAME=usb",
-                            strlen("POWER_SUPPLY_NAME=usb"))) {
-            std::vector<PortStatus> currentPortStatus;
-            queryVersionHelper(payload->usb, &currentPortStatus);
-
-            // Role switch is not in progress and port is in disconnected state
-            if (!pthread_mutex_trylock(&payload->usb->mRoleSwitchLock)) {
-                for (unsigned long i = 0; i < currentPortStatus.size(); i++) {
-                    DIR *dp =
-                        opendir(string("/sys/class/typec/" +
-                                            string(currentPortStatus[i].portName.c_str()) +
-                                            "-partner").c_str());
-                    if (dp == NULL) {
-                        switchToDrp(currentPortStatus[i].portName);
-                    } else {
-                        closedir(dp);
-                    }
-                }
-                pthread_mutex_unlock(&payload->usb->mRoleSwitchLock);
-            }
-            break;
-        } else if (!strncmp(cp, kOverheatStatsDev, strlen(kOverheatStatsDev))) {
-            ALOGV("Overheat Cooling device suez update");
-            report_overheat_event(payload->usb);
-        }
-        /* advance to after the next \0 */
-        while (*cp++) {
-        }
-    }
-}
-
-void *work(void *param) {
-    int epoll_fd, uevent_fd;
-    struct epoll_event ev;
-    int nevents = 0;
-    struct data payload;
-
-    ALOGE("creating thread");
-
-    uevent_fd = uevent_open_socket(64 * 1024, true);
-
-    if (uevent_fd < 0) {
-        ALOGE("uevent_init: uevent_open_socket failed\n");
-        return NULL;
-    }
-
-    payload.uevent_fd = uevent_fd;
-    payload.usb = (::aidl::android::hardware::usb::Usb *)param;
-
-    fcntl(uevent_fd, F_SETFL, O_NONBLOCK);
-
-    ev.events = EPOLLIN;
-    ev.data.ptr = (void *)uevent_event;
-
-    epoll_fd = epoll_create(64);
-    if (epoll_fd == -1) {
-        ALOGE("epoll_create failed; errno=%d", errno);
-        goto error;
-    }
-
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uevent_fd, &ev) == -1) {
-        ALOGE("epoll_ctl failed; errno=%d", errno);
-        goto error;
-    }
-
-    while (!destroyThread) {
-        struct epoll_event events[64];
-
-        nevents = epoll_wait(epoll_fd, events, 64, -1);
-        if (nevents == -1) {
-            if (errno == EINTR)
-                continue;
-            ALOGE("usb epoll_wait failed; errno=%d", errno);
-            break;
-        }
-
-        for (int n = 0; n < nevents; ++n) {
-            if (events[n].data.ptr)
-                (*(void (*)(int, struct data *payload))events[n].data.ptr)(events[n].events,
-                                                                           &payload);
-        }
+static void uevent_event(::aidl::android::hardware::usb::Usb *usb, const UeventMessage &uevent) {
+    const std::string_view devpath = uevent.devpath();
+
+    // Partner attributes belong to the partner kobject and must be reopened for the next one
+    if (uevent.action() == "remove" && uevent.get("DEVTYPE") == "typec_partner")
+        sSysfs.invalidatePartners();
+    else if (uevent.action() == "remove" && uevent.get("DEVTYPE") == "typec_port")
+        sSysfs.invalidatePort(string(devpath.substr(devpath.rfind('/') + 1)));
+    sTypecPorts.handleUevent(uevent);
+
+    const std::string_view partnerSuffix = "-partner";
+    if (uevent.action() == "add" && devpath.size() >= partnerSuffix.size() &&
+        devpath.compare(devpath.size() - partnerSuffix.size(), partnerSuffix.size(),
+                        partnerSuffix) == 0) {
+        ALOGI("partner added");
+        const std::string_view partner = devpath.substr(devpath.rfind('/') + 1);
+        usb->handlePartnerAdded(string(partner.substr(0, partner.size() - partnerSuffix.size())));
     }
 
-    ALOGI("exiting worker thread");
-error:
-    close(uevent_fd);
-
-    if (epoll_fd >= 0)
-        close(epoll_fd);
-
-    return NULL;
-}
-
-void sighandler(int sig) {
-    if (sig == SIGUSR1) {
-        destroyThread = true;
-        ALOGI("destroy set");
+    // Port status is only tracked while the framework has a callback registered
+    pthread_mutex_lock(&usb->mLock);
+    bool active = usb->mCallback != NULL;
+    pthread_mutex_unlock(&usb->mLock);
+    if (!active)
         return;
+
+    if (uevent.hasPrefix("DEVTYPE", "typec_") || uevent.hasPrefix("DRIVER", "max77759tcpc") ||
+        uevent.hasPrefix("DRIVER", "pogo-transport") ||
+        uevent.hasPrefix("POWER_SUPPLY_NAME", "usb")) {
+        usb->requestPortStatusUpdate(true);
+    } else if (uevent.hasPrefix("DRIVER", kOverheatStatsDriver)) {
+        ALOGV("Overheat Cooling device suez update");
+        report_overheat_event(usb);
     }
-    signal(SIGUSR1, sighandler);
 }
 
 ScopedAStatus Usb::setCallback(const shared_ptr<IUsbCallback>& in_callback) {
     pthread_mutex_lock(&mLock);
-    if ((mCallback == NULL && in_callback == NULL) ||
-            (mCallback != NULL && in_callback != NULL)) {
-        mCallback = in_callback;
-        pthread_mutex_unlock(&mLock);
-        return ScopedAStatus::ok();
+    const bool replaced = mCallback != in_callback;
+    if ((mCallback == NULL) != (in_callback == NULL)) {
+        /*
+         * uevents are handled by the event loop for the lifetime of the HAL; with no callback
+         * set they are ignored.
+         */
+        ALOGI("%s callback", in_callback == NULL ? "unregistering" : "registering");
     }
-
     mCallback = in_callback;
-    ALOGI("registering callback");
+    pthread_mutex_unlock(&mLock);
 
-    if (mCallback == NULL) {
-        if  (!pthread_kill(mPoll, SIGUSR1)) {
-            pthread_join(mPoll, NULL);
-            ALOGI("pthread destroyed");
-        }
-        pthread_mutex_unlock(&mLock);
+    if (in_callback == NULL || !replaced)
         return ScopedAStatus::ok();
-    }
-
-    destroyThread = false;
-    signal(SIGUSR1, sighandler);
 
     /*
-     * Create a background thread if the old callback value is NULL
-     * and being updated with a new value.
+     * The latest port status may be stale: uevents do not trigger updates while no callback is
+     * set. A new callback gets a fresh one instead, sent even if unchanged, in order with the
+     * other updates.
      */
-    if (pthread_create(&mPoll, NULL, work, this)) {
-        ALOGE("pthread creation failed %d", errno);
-        mCallback = NULL;
-    }
-
-    pthread_mutex_unlock(&mLock);
+    mPortStatus.requestResend();
+    mEventLoop.post([this]() { requestPortStatusUpdate(true); });
     return ScopedAStatus::ok();
 }
 
@@ -1281,13 +1372,55 @@ status_t Usb::handleShellCommand(int in, int out, int err, const char** argv,
             ALOGI("USB hub vendor cmd update (wValue 0x%x, wIndex 0x%x)\n",
                   mUsbHubVendorCmdValue, mUsbHubVendorCmdIndex);
             return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("port-status-stats"))) {
+            uint64_t requests = mPortStatusRequests;
+            uint64_t recomputes = mPortStatusRecomputes;
+            dprintf(out, "debounce window: %" PRIu64 " ms\n", mPortStatusDebounceMs);
+            dprintf(out, "update requests: %" PRIu64 "\n", requests);
+            dprintf(out, "recomputations: %" PRIu64 "\n", recomputes);
+            dprintf(out, "saved: %" PRIu64 "\n",
+                    requests > recomputes ? requests - recomputes : 0);
+            dprintf(out, "notifications published: %" PRIu64 "\n", mPortStatus.getPublished());
+            dprintf(out, "notifications suppressed: %" PRIu64 "\n",
+                    mPortStatus.getSuppressed());
+            std::shared_ptr<const PortStatusSnapshot> snapshot = getPortStatusSnapshot();
+            if (snapshot != NULL) {
+                dprintf(out, "latest port status: %zu ports, status %d\n",
+                        snapshot->ports.size(), static_cast<int>(snapshot->status));
+                for (const auto &port : snapshot->ports)
+                    dprintf(out, "  %s\n", port.toString().c_str());
+            }
+            dprintf(out, "typec table rescan corrections: %" PRIu64 "\n",
+                    sTypecPorts.getRescanCorrections());
+            UsbEventLoop::UeventStats uevents = mEventLoop.getUeventStats();
+            dprintf(out, "uevents received: %" PRIu64 "\n", uevents.received);
+            dprintf(out, "uevent socket overflows: %" PRIu64 "\n", uevents.overflows);
+            dprintf(out, "oversized uevents: %" PRIu64 "\n", uevents.oversized);
+            dprintf(out, "resyncs after uevent loss: %" PRIu64 "\n", uevents.resyncs);
+            dprintf(out, "largest uevent burst: %" PRIu64 "\n", uevents.maxBurst);
+            dprintf(out, "uevent receive buffer: %d bytes\n", uevents.receiveBufferBytes);
+            return ::android::NO_ERROR;
+        } else if (!utf8Args[0].compare(String8("role-switch-cancel"))) {
+            if (utf8Args.size() < 2) {
+                dprintf(out, "Incorrect number of argument supplied\n");
+                return ::android::UNKNOWN_ERROR;
+            }
+            string portName(utf8Args[1].c_str());
+            mEventLoop.post([this, portName]() { cancelRoleSwitch(portName); });
+            return ::android::NO_ERROR;
         }
     }
 
     dprintf(out, "usage: adb shell cmd hub-vendor-cmd VALUE INDEX\n"
                  "  VALUE wValue field in hex format, e.g. 0xf321\n"
                  "  INDEX wIndex field in hex format, e.g. 0xf321\n"
-                 "  The settings take effect next time the hub is enabled\n");
+                 "  The settings take effect next time the hub is enabled\n"
+                 "usage: adb shell cmd port-status-stats\n"
+                 "  Prints how many port status updates were merged by the debounce window\n"
+                 "  and how many unchanged notifications were suppressed, and the uevent\n"
+                 "  socket loss counters\n"
+                 "usage: adb shell cmd role-switch-cancel PORT\n"
+                 "  Fails the role switch in progress on PORT and any request queued behind it\n");
 
     return ::android::NO_ERROR;
 }
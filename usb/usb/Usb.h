@@ -17,13 +17,22 @@
 #pragma once
 
 #include <android-base/file.h>
+#include <android-base/unique_fd.h>
 #include <aidl/android/hardware/usb/BnUsb.h>
 #include <aidl/android/hardware/usb/BnUsbCallback.h>
 #include <pixelusb/UsbOverheatEvent.h>
 #include <utils/Log.h>
+#include <CallbackDispatcher.h>
+#include <SnapshotNotifier.h>
 #include <UsbDataSessionMonitor.h>
+#include <UsbEventLoop.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
 
-#define UEVENT_MSG_LEN 2048
 // The type-c stack waits for 4.5 - 5.5 secs before declaring a port non-pd.
 // The -partner directory would not be created until this is done.
 // Having a margin of ~3 secs for the directory and other related bookeeping
@@ -58,8 +67,28 @@ constexpr char kGadgetName[] = "11210000.dwc3";
 
 #define ROLE_SWAP_RETRY_MS 700
 
+/*
+ * Hardware behind one Type-C port. Only the built-in port has a TCPC and a USB controller on
+ * this platform; ports brought in by docks or accessories have neither and report the defaults
+ * of the features that depend on them.
+ */
+struct UsbPortState {
+    bool hasTcpc = false;
+    // TCPC i2c client directory, resolved on first use
+    std::string i2cClientPath;
+    // Data session of the port's USB controller, null if it has none
+    UsbDataSessionMonitor *dataSessionMonitor = nullptr;
+};
+
+// Immutable result of one port status computation
+struct PortStatusSnapshot {
+    std::vector<PortStatus> ports;
+    Status status;
+};
+
 struct Usb : public BnUsb {
     Usb();
+    ~Usb();
 
     ScopedAStatus enableContaminantPresenceDetection(const std::string& in_portName,
             bool in_enable, int64_t in_transactionId) override;
@@ -81,15 +110,9 @@ struct Usb : public BnUsb {
     std::shared_ptr<::aidl::android::hardware::usb::IUsbCallback> mCallback;
     // Protects mCallback variable
     pthread_mutex_t mLock;
-    // Protects roleSwitch operation
-    pthread_mutex_t mRoleSwitchLock;
-    // Threads waiting for the partner to come back wait here
-    pthread_cond_t mPartnerCV;
-    // lock protecting mPartnerCV
-    pthread_mutex_t mPartnerLock;
-    // Variable to signal partner coming back online after type switch
-    bool mPartnerUp;
 
+    // Single event thread of the HAL, shared by all the monitors below
+    UsbEventLoop mEventLoop;
     // Report usb data session event and data incompliance warnings
     UsbDataSessionMonitor mUsbDataSessionMonitor;
     // Usb Overheat object for push suez event
@@ -101,11 +124,93 @@ struct Usb : public BnUsb {
     // Usb hub vendor command settings for JK level tuning
     int mUsbHubVendorCmdValue;
     int mUsbHubVendorCmdIndex;
-    std::string mI2cClientPath;
+    /*
+     * Latest port status, replaced as a whole by every computation, and the notification of
+     * its changes. Computations read sysfs concurrently; readers never take a lock.
+     */
+    SnapshotNotifier<PortStatusSnapshot> mPortStatus;
+    // Protects mPorts and serializes the power limit and contaminant detection writes. Never
+    // held while computing the port status or calling into mCallback.
+    std::mutex mPortStatusLock;
+    // Hardware state by port name. Protected by mPortStatusLock; entries are never removed.
+    std::map<std::string, UsbPortState> mPorts;
+
+    /*
+     * Schedules a port status recomputation. Requests within the debounce window are merged
+     * into one; checkDrp also switches ports without a partner back to DRP. Called on the
+     * event loop thread.
+     */
+    void requestPortStatusUpdate(bool checkDrp);
+    /*
+     * Returns the state of portName, creating it on first use, or null if portName is neither
+     * the built-in port nor a port of the Type-C class. Called with mPortStatusLock held.
+     */
+    UsbPortState *getPortState(const std::string &portName);
+    std::shared_ptr<const PortStatusSnapshot> getPortStatusSnapshot() {
+        return mPortStatus.get();
+    }
+    /*
+     * Queues a notification to the callback registered when the dispatcher gets to it. Calls
+     * are delivered in the order they were queued; name is used for logging.
+     */
+    void notifyCallback(const char *name,
+                        std::function<ScopedAStatus(const shared_ptr<IUsbCallback> &)> notify);
+    // Completes a mode switch of portName waiting for its partner. Called on the event loop thread.
+    void handlePartnerAdded(const string &portName);
 
   private:
-    pthread_t mPoll;
-    pthread_t mUsbHost;
+    struct RoleSwitchRequest {
+        PortRole role;
+        int64_t transactionId;
+    };
+
+    /*
+     * Role switch state of a port. A switch writes the role node and then either waits for the
+     * partner to come back (mode), or for the busy retry delay (data and power roles), on
+     * timerFd. A request arriving meanwhile is queued in pending, replacing an older queued one.
+     */
+    struct PortRoleSwitch {
+        enum class State { IDLE, WAIT_PARTNER, WAIT_RETRY };
+        State state = State::IDLE;
+        RoleSwitchRequest active;
+        std::optional<RoleSwitchRequest> pending;
+        unique_fd timerFd;
+    };
+
+    void queueRoleSwitch(const string &portName, const RoleSwitchRequest &request);
+    void startRoleSwitch(const string &portName, PortRoleSwitch *sw);
+    void writeDataOrPowerRole(const string &portName, PortRoleSwitch *sw, bool retry);
+    void finishRoleSwitch(const string &portName, PortRoleSwitch *sw, bool success);
+    void cancelRoleSwitch(const string &portName);
+    void handleRoleSwitchTimer(const string &portName);
+    bool armRoleSwitchTimer(const string &portName, PortRoleSwitch *sw, uint64_t delayMs);
+    bool isRoleSwitchInProgress(const string &portName);
+    void notifyRoleSwitchStatus(const string &portName, const PortRole &role, Status status,
+                                int64_t transactionId);
+
+    void runPortStatusUpdate();
+    void handlePortStatusTimer();
+    void handleTypecRevalidateTimer();
+    // Resynchronizes the port state after uevents were lost. Called on the event loop thread.
+    void handleUeventLoss();
+
+    // Port status debounce state, owned by the event loop thread
+    unique_fd mPortStatusTimerFd;
+    const uint64_t mPortStatusDebounceMs;
+    bool mPortStatusUpdatePending;
+    bool mPortStatusCheckDrp;
+    // Requested and performed recomputations, the difference being the merged ones
+    std::atomic<uint64_t> mPortStatusRequests;
+    std::atomic<uint64_t> mPortStatusRecomputes;
+    // Periodic rescan of the Type-C port table
+    unique_fd mTypecRevalidateTimerFd;
+    // Role switches by port name, owned by the event loop thread
+    std::map<string, PortRoleSwitch> mRoleSwitches;
+    /*
+     * Declared last so that it is destroyed first, delivering what it has queued. ~Usb stops
+     * mEventLoop before, so that no handler posts to it or uses the members destroyed after it.
+     */
+    CallbackDispatcher mCallbackDispatcher;
 };
 
 } // namespace usb
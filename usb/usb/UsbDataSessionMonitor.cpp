@@ -22,15 +22,12 @@
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android_hardware_usb_flags.h>
-#include <cutils/uevent.h>
 #include <pixelstats/StatsHelper.h>
 #include <pixelusb/CommonUtils.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 #include <utils/Log.h>
 
-#include <regex>
-
 namespace usb_flags = android::hardware::usb::flags;
 
 using aidl::android::frameworks::stats::IStats;
@@ -38,7 +35,6 @@ using android::base::ReadFileToString;
 using android::hardware::google::pixel::getStatsService;
 using android::hardware::google::pixel::reportUsbDataSessionEvent;
 using android::hardware::google::pixel::PixelAtoms::VendorUsbDataSessionEvent;
-using android::hardware::google::pixel::usb::addEpollFd;
 using android::hardware::google::pixel::usb::BuildVendorUsbDataSessionEvent;
 
 namespace aidl {
@@ -46,10 +42,10 @@ namespace android {
 namespace hardware {
 namespace usb {
 
-#define UEVENT_MSG_LEN 2048
 #define USB_STATE_MAX_LEN 20
 #define DATA_ROLE_MAX_LEN 10
 #define WARNING_SURFACE_DELAY_SEC 5
+#define UDC_CHANGE_DELAY_MS 50
 #define ENUM_FAIL_DEFAULT_COUNT_THRESHOLD 3
 #define DEVICE_FLAKY_CONNECTION_CONFIGURED_COUNT_THRESHOLD 5
 
@@ -65,70 +61,66 @@ const std::set<std::string> kValidStates = {kNotAttachedState, kAttachedState,
                                             kDefaultState,     kAddressedState, kConfiguredState,
                                             kSuspendedState};
 
-static int addEpollFile(const int &epollFd, const std::string &filePath, unique_fd &fileFd) {
-    struct epoll_event ev;
-
-    unique_fd fd(open(filePath.c_str(), O_RDONLY));
+static int addEpollFile(UsbEventLoop *eventLoop, const std::string &filePath, unique_fd &fileFd,
+                        UsbEventLoop::FdHandler handler) {
+    unique_fd fd(open(filePath.c_str(), O_RDONLY | O_CLOEXEC));
 
     if (fd.get() == -1) {
         ALOGI("Cannot open %s", filePath.c_str());
         return -1;
     }
 
-    ev.data.fd = fd.get();
-    ev.events = EPOLLPRI;
-
-    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd.get(), &ev) != 0) {
-        ALOGE("epoll_ctl failed; errno=%d", errno);
+    if (!eventLoop->addFd(fd.get(), EPOLLPRI, std::move(handler)))
         return -1;
-    }
 
     fileFd = std::move(fd);
     ALOGI("epoll registered %s", filePath.c_str());
     return 0;
 }
 
-static void removeEpollFile(const int &epollFd, const std::string &filePath, unique_fd &fileFd) {
-    epoll_ctl(epollFd, EPOLL_CTL_DEL, fileFd.get(), NULL);
-    fileFd.release();
+static void removeEpollFile(UsbEventLoop *eventLoop, const std::string &filePath,
+                            unique_fd &fileFd) {
+    if (fileFd.get() == -1)
+        return;
+
+    eventLoop->removeFd(fileFd.get());
+    fileFd.reset();
 
     ALOGI("epoll unregistered %s", filePath.c_str());
 }
 
 UsbDataSessionMonitor::UsbDataSessionMonitor(
-    const std::string &deviceUeventRegex, const std::string &deviceStatePath,
-    const std::string &host1UeventRegex, const std::string &host1StatePath,
-    const std::string &host2UeventRegex, const std::string &host2StatePath,
-    const std::string &dataRolePath, std::function<void()> updatePortStatusCb) {
-    struct epoll_event ev;
+    UsbEventLoop *eventLoop, const std::string &deviceUeventRegex,
+    const std::string &deviceStatePath, const std::string &host1UeventRegex,
+    const std::string &host1StatePath, const std::string &host2UeventRegex,
+    const std::string &host2StatePath, const std::string &dataRolePath,
+    std::function<void()> updatePortStatusCb)
+    : mEventLoop(eventLoop) {
     std::string udc;
 
-    unique_fd epollFd(epoll_create(8));
-    if (epollFd.get() == -1) {
-        ALOGE("epoll_create failed; errno=%d", errno);
+    unique_fd timerFd(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (timerFd.get() == -1) {
+        ALOGE("create timerFd failed");
         abort();
     }
 
-    unique_fd ueventFd(uevent_open_socket(64 * 1024, true));
-    if (ueventFd.get() == -1) {
-        ALOGE("uevent_open_socket failed");
+    if (!mEventLoop->addFd(timerFd.get(), EPOLLIN, [this](uint32_t) { handleTimerEvent(); }))
         abort();
-    }
-    fcntl(ueventFd, F_SETFL, O_NONBLOCK);
+    mTimerFd = std::move(timerFd);
 
-    if (addEpollFd(epollFd, ueventFd))
-        abort();
-
-    unique_fd timerFd(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK));
-    if (timerFd.get() == -1) {
-        ALOGE("create timerFd failed");
+    unique_fd udcChangeTimerFd(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (udcChangeTimerFd.get() == -1) {
+        ALOGE("create udcChangeTimerFd failed");
         abort();
     }
 
-    if (addEpollFd(epollFd, timerFd))
+    if (!mEventLoop->addFd(udcChangeTimerFd.get(), EPOLLIN,
+                           [this](uint32_t) { handleUdcChangeTimerEvent(); }))
         abort();
+    mUdcChangeTimerFd = std::move(udcChangeTimerFd);
 
-    if (addEpollFile(epollFd.get(), dataRolePath, mDataRoleFd) != 0) {
+    if (addEpollFile(mEventLoop, dataRolePath, mDataRoleFd,
+                     [this](uint32_t) { handleDataRoleEvent(); }) != 0) {
         ALOGE("monitor data role failed");
         abort();
     }
@@ -139,20 +131,17 @@ UsbDataSessionMonitor::UsbDataSessionMonitor(
      * will be monitored later when its presence is detected by uevent.
      */
     mDeviceState.filePath = deviceStatePath;
-    mDeviceState.ueventRegex = deviceUeventRegex;
-    addEpollFile(epollFd.get(), mDeviceState.filePath, mDeviceState.fd);
+    mDeviceState.ueventPatternId = mUeventMatcher.add(deviceUeventRegex);
+    addDeviceStateFile(&mDeviceState);
 
     mHost1State.filePath = host1StatePath;
-    mHost1State.ueventRegex = host1UeventRegex;
-    addEpollFile(epollFd.get(), mHost1State.filePath, mHost1State.fd);
+    mHost1State.ueventPatternId = mUeventMatcher.add(host1UeventRegex);
+    addDeviceStateFile(&mHost1State);
 
     mHost2State.filePath = host2StatePath;
-    mHost2State.ueventRegex = host2UeventRegex;
-    addEpollFile(epollFd.get(), mHost2State.filePath, mHost2State.fd);
+    mHost2State.ueventPatternId = mUeventMatcher.add(host2UeventRegex);
+    addDeviceStateFile(&mHost2State);
 
-    mEpollFd = std::move(epollFd);
-    mUeventFd = std::move(ueventFd);
-    mTimerFd = std::move(timerFd);
     mUpdatePortStatusCb = updatePortStatusCb;
 
     if (ReadFileToString(kUdcConfigfsPath, &udc) && !udc.empty())
@@ -160,15 +149,21 @@ UsbDataSessionMonitor::UsbDataSessionMonitor(
     else
         mUdcBind = false;
 
-    if (pthread_create(&mMonitor, NULL, this->monitorThread, this)) {
-        ALOGE("pthread creation failed %d", errno);
-        abort();
-    }
+    mEventLoop->addUeventHandler([this](const UeventMessage &uevent) { handleUevent(uevent); });
+    mEventLoop->addResyncHandler([this]() { resync(); });
 
     ALOGI("feature flag enable_report_usb_data_compliance_warning: %d",
           usb_flags::enable_report_usb_data_compliance_warning());
 }
 
+int UsbDataSessionMonitor::addDeviceStateFile(struct usbDeviceState *deviceState) {
+    if (deviceState->fd.get() != -1)
+        return 0;
+
+    return addEpollFile(mEventLoop, deviceState->filePath, deviceState->fd,
+                        [this, deviceState](uint32_t) { handleDeviceStateEvent(deviceState); });
+}
+
 UsbDataSessionMonitor::~UsbDataSessionMonitor() {}
 
 void UsbDataSessionMonitor::reportUsbDataSessionMetrics() {
@@ -367,7 +362,7 @@ void UsbDataSessionMonitor::handleDataRoleEvent() {
     }
 }
 
-void UsbDataSessionMonitor::updateUdcBindStatus(const std::string &devname) {
+void UsbDataSessionMonitor::updateUdcBindStatus(const std::string &udcPath) {
     std::string function;
     bool newUdcBind;
 
@@ -376,7 +371,7 @@ void UsbDataSessionMonitor::updateUdcBindStatus(const std::string &devname) {
      * Ref: https://www.kernel.org/doc/Documentation/ABI/stable/sysfs-class-udc
      * Empty name string means the udc device is not bound and gadget is pulldown.
      */
-    if (!ReadFileToString("/sys" + devname + "/function", &function))
+    if (!ReadFileToString(udcPath + "/function", &function))
         return;
 
     if (function == "")
@@ -406,52 +401,67 @@ void UsbDataSessionMonitor::updateUdcBindStatus(const std::string &devname) {
     mUdcBind = newUdcBind;
 }
 
-void UsbDataSessionMonitor::handleUevent() {
-    char msg[UEVENT_MSG_LEN + 2];
-    char *cp;
-    int n;
-
-    n = uevent_kernel_multicast_recv(mUeventFd.get(), msg, UEVENT_MSG_LEN);
-    if (n <= 0)
+void UsbDataSessionMonitor::handleUevent(const UeventMessage &uevent) {
+    const uint32_t matches = mUeventMatcher.search(uevent.devpath());
+    if (!matches)
         return;
-    if (n >= UEVENT_MSG_LEN)
-        return;
-
-    msg[n] = '\0';
-    msg[n + 1] = '\0';
-    cp = msg;
 
-    while (*cp) {
-        for (auto e : {&mHost1State, &mHost2State}) {
-            if (std::regex_search(cp, std::regex(e->ueventRegex))) {
-                if (!strncmp(cp, "bind@", strlen("bind@"))) {
-                    addEpollFile(mEpollFd.get(), e->filePath, e->fd);
-                } else if (!strncmp(cp, "unbind@", strlen("unbind@"))) {
-                    removeEpollFile(mEpollFd.get(), e->filePath, e->fd);
-                }
+    for (auto e : {&mHost1State, &mHost2State}) {
+        if (e->ueventPatternId != -1 && (matches & (1u << e->ueventPatternId))) {
+            if (uevent.action() == "bind") {
+                addDeviceStateFile(e);
+            } else if (uevent.action() == "unbind") {
+                removeEpollFile(mEventLoop, e->filePath, e->fd);
             }
         }
+    }
 
-        // TODO: support bind@ unbind@ to detect dynamically allocated udc device
-        if (std::regex_search(cp, std::regex(mDeviceState.ueventRegex))) {
-            if (!strncmp(cp, "change@", strlen("change@"))) {
-                char *devname = cp + strlen("change@");
-                /*
-                 * Udc device emits a KOBJ_CHANGE event on configfs driver bind and unbind.
-                 * TODO: upstream udc driver emits KOBJ_CHANGE event BEFORE unbind is actually
-                 * executed. Add a short delay to get the correct state while working on a fix
-                 * upstream.
-                 */
-                usleep(50000);
-                updateUdcBindStatus(devname);
-            }
-        }
-        /* advance to after the next \0 */
-        while (*cp++) {
+    // TODO: support bind@ unbind@ to detect dynamically allocated udc device
+    if (mDeviceState.ueventPatternId != -1 &&
+        (matches & (1u << mDeviceState.ueventPatternId)) && uevent.action() == "change") {
+        /*
+         * Udc device emits a KOBJ_CHANGE event on configfs driver bind and unbind.
+         * TODO: upstream udc driver emits KOBJ_CHANGE event BEFORE unbind is actually
+         * executed. Read the state after a short delay to get the correct state while
+         * working on a fix upstream. The delay runs on a timerfd so that the event loop keeps
+         * serving other events; a change within the delay restarts it.
+         */
+        struct itimerspec delay = itimerspec();
+        delay.it_value.tv_nsec = UDC_CHANGE_DELAY_MS * 1000000L;
+        mUdcChangePath = "/sys" + std::string(uevent.devpath());
+        if (timerfd_settime(mUdcChangeTimerFd.get(), 0, &delay, NULL) < 0) {
+            ALOGE("timerfd_settime failed err:%d", errno);
+            updateUdcBindStatus(mUdcChangePath);
         }
     }
 }
 
+void UsbDataSessionMonitor::handleUdcChangeTimerEvent() {
+    uint64_t numExpiration;
+
+    if (read(mUdcChangeTimerFd.get(), &numExpiration, sizeof(numExpiration)) !=
+        sizeof(numExpiration)) {
+        ALOGE("incorrect read size");
+        return;
+    }
+
+    updateUdcBindStatus(mUdcChangePath);
+}
+
+void UsbDataSessionMonitor::resync() {
+    for (auto e : {&mHost1State, &mHost2State}) {
+        if (access(e->filePath.c_str(), F_OK) == 0)
+            addDeviceStateFile(e);
+        else
+            removeEpollFile(mEventLoop, e->filePath, e->fd);
+    }
+    addDeviceStateFile(&mDeviceState);
+
+    // The udc state file lives in the udc device directory
+    updateUdcBindStatus(mDeviceState.filePath.substr(0, mDeviceState.filePath.rfind('/')));
+    handleDataRoleEvent();
+}
+
 void UsbDataSessionMonitor::handleTimerEvent() {
     int byteRead;
     uint64_t numExpiration;
@@ -469,39 +479,6 @@ void UsbDataSessionMonitor::handleTimerEvent() {
     evaluateComplianceWarning();
 }
 
-void *UsbDataSessionMonitor::monitorThread(void *param) {
-    UsbDataSessionMonitor *monitor = (UsbDataSessionMonitor *)param;
-    struct epoll_event events[64];
-    int nevents = 0;
-
-    while (true) {
-        nevents = epoll_wait(monitor->mEpollFd.get(), events, 64, -1);
-        if (nevents == -1) {
-            if (errno == EINTR)
-                continue;
-            ALOGE("usb epoll_wait failed; errno=%d", errno);
-            break;
-        }
-
-        for (int n = 0; n < nevents; ++n) {
-            if (events[n].data.fd == monitor->mUeventFd.get()) {
-                monitor->handleUevent();
-            } else if (events[n].data.fd == monitor->mTimerFd.get()) {
-                monitor->handleTimerEvent();
-            } else if (events[n].data.fd == monitor->mDataRoleFd.get()) {
-                monitor->handleDataRoleEvent();
-            } else if (events[n].data.fd == monitor->mDeviceState.fd.get()) {
-                monitor->handleDeviceStateEvent(&monitor->mDeviceState);
-            } else if (events[n].data.fd == monitor->mHost1State.fd.get()) {
-                monitor->handleDeviceStateEvent(&monitor->mHost1State);
-            } else if (events[n].data.fd == monitor->mHost2State.fd.get()) {
-                monitor->handleDeviceStateEvent(&monitor->mHost2State);
-            }
-        }
-    }
-    return NULL;
-}
-
 }  // namespace usb
 }  // namespace hardware
 }  // namespace android
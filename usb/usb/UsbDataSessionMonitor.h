@@ -21,6 +21,9 @@
 #include <android-base/chrono_utils.h>
 #include <android-base/unique_fd.h>
 
+#include "UeventMatcher.h"
+#include "UsbEventLoop.h"
+
 #include <set>
 #include <string>
 #include <vector>
@@ -47,13 +50,17 @@ class UsbDataSessionMonitor {
      * The host mode high-speed port and super-speed port can be assigned to either host1 or
      * host2 without affecting functionality.
      *
-     * UeventRegex: name regex of the device that's being monitored. The regex is matched against
-     *              uevent to detect dynamic creation/deletion/change of the device.
+     * eventLoop: event loop delivering the uevents and the monitored sysfs events. It must
+     *            outlive the monitor.
+     * UeventRegex: name regex of the device that's being monitored, in the syntax supported by
+     *              UeventMatcher. The regex is matched against uevent to detect dynamic
+     *              creation/deletion/change of the device.
      * StatePath: usb device state sysfs path of the device, monitored by epoll.
      * dataRolePath: path to the usb data role sysfs, monitored by epoll.
      * updatePortStatusCb: the callback is invoked when the compliance warings changes.
      */
-    UsbDataSessionMonitor(const std::string &deviceUeventRegex, const std::string &deviceStatePath,
+    UsbDataSessionMonitor(UsbEventLoop *eventLoop, const std::string &deviceUeventRegex,
+                          const std::string &deviceStatePath,
                           const std::string &host1UeventRegex, const std::string &host1StatePath,
                           const std::string &host2UeventRegex, const std::string &host2StatePath,
                           const std::string &dataRolePath,
@@ -61,21 +68,28 @@ class UsbDataSessionMonitor {
     ~UsbDataSessionMonitor();
     // Returns the compliance warnings detected in the current data session.
     void getComplianceWarnings(const PortDataRole &role, std::vector<ComplianceWarning> *warnings);
+    /*
+     * Rebuilds from sysfs what is normally tracked from uevents: the bound host ports, the udc
+     * bind status and the data role. Called on the event loop thread after uevents were lost.
+     */
+    void resync();
 
   private:
     struct usbDeviceState {
         unique_fd fd;
         std::string filePath;
-        std::string ueventRegex;
+        // Id of the device name regex in mUeventMatcher
+        int ueventPatternId;
         // Usb device states reported by state sysfs
         std::vector<std::string> states;
         // Timestamps of when the usb device states were captured
         std::vector<boot_clock::time_point> timestamps;
     };
 
-    static void *monitorThread(void *param);
-    void handleUevent();
+    int addDeviceStateFile(struct usbDeviceState *deviceState);
+    void handleUevent(const UeventMessage &uevent);
     void handleTimerEvent();
+    void handleUdcChangeTimerEvent();
     void handleDataRoleEvent();
     void handleDeviceStateEvent(struct usbDeviceState *deviceState);
     void clearDeviceStateEvents(struct usbDeviceState *deviceState);
@@ -83,13 +97,17 @@ class UsbDataSessionMonitor {
     void reportUsbDataSessionMetrics();
     void evaluateComplianceWarning();
     void notifyComplianceWarning();
-    void updateUdcBindStatus(const std::string &devname);
+    void updateUdcBindStatus(const std::string &udcPath);
 
-    pthread_t mMonitor;
-    unique_fd mEpollFd;
-    unique_fd mUeventFd;
+    UsbEventLoop *mEventLoop;
     unique_fd mTimerFd;
+    // Delays the read of the udc state after its change uevent, see handleUevent
+    unique_fd mUdcChangeTimerFd;
+    // Udc device path of the latest change uevent
+    std::string mUdcChangePath;
     unique_fd mDataRoleFd;
+    // Device name regexes of the monitored devices, compiled once
+    UeventMatcher mUeventMatcher;
     struct usbDeviceState mDeviceState;
     struct usbDeviceState mHost1State;
     struct usbDeviceState mHost2State;
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.UsbEventLoop"
+
+#include "UsbEventLoop.h"
+
+#include <cutils/uevent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include <algorithm>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+#define UEVENT_MSG_LEN 2048
+#define UEVENT_SOCKET_BUF_SIZE (64 * 1024)
+#define UEVENT_SOCKET_MAX_BUF_SIZE (2 * 1024 * 1024)
+// Uevents read per wakeup at most, so that a uevent storm cannot starve the other fds
+#define MAX_UEVENTS_PER_WAKEUP 256
+#define MAX_EVENTS 64
+
+UsbEventLoop::UsbEventLoop()
+    : mUeventsReceived(0),
+      mUeventOverflows(0),
+      mUeventsOversized(0),
+      mUeventResyncs(0),
+      mMaxUeventBurst(0),
+      mReceiveBufferBytes(UEVENT_SOCKET_BUF_SIZE),
+      mRequestedReceiveBufferBytes(UEVENT_SOCKET_BUF_SIZE) {
+    mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+    if (mEpollFd.get() == -1) {
+        ALOGE("epoll_create failed; errno=%d", errno);
+        abort();
+    }
+
+    mUeventFd.reset(uevent_open_socket(UEVENT_SOCKET_BUF_SIZE, true));
+    if (mUeventFd.get() == -1) {
+        ALOGE("uevent_open_socket failed");
+        abort();
+    }
+    fcntl(mUeventFd.get(), F_SETFL, O_NONBLOCK);
+    readReceiveBufferSize();
+
+    mStopFd.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (mStopFd.get() == -1) {
+        ALOGE("eventfd failed; errno=%d", errno);
+        abort();
+    }
+
+    mTaskFd.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (mTaskFd.get() == -1) {
+        ALOGE("eventfd failed; errno=%d", errno);
+        abort();
+    }
+
+    for (int fd : {mUeventFd.get(), mStopFd.get(), mTaskFd.get()}) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &ev) != 0) {
+            ALOGE("epoll_ctl failed; errno=%d", errno);
+            abort();
+        }
+    }
+}
+
+UsbEventLoop::~UsbEventLoop() {
+    stop();
+}
+
+bool UsbEventLoop::addFd(int fd, uint32_t events, FdHandler handler) {
+    std::lock_guard<std::mutex> lock(mLock);
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &ev) != 0) {
+        ALOGE("epoll_ctl add %d failed; errno=%d", fd, errno);
+        return false;
+    }
+    mHandlers[fd] = std::make_shared<FdHandler>(std::move(handler));
+    return true;
+}
+
+void UsbEventLoop::removeFd(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+    epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, fd, NULL);
+    mHandlers.erase(fd);
+}
+
+void UsbEventLoop::addUeventHandler(UeventHandler handler) {
+    mUeventHandlers.push_back(std::move(handler));
+}
+
+void UsbEventLoop::addResyncHandler(std::function<void()> handler) {
+    mResyncHandlers.push_back(std::move(handler));
+}
+
+UsbEventLoop::UeventStats UsbEventLoop::getUeventStats() const {
+    return {.received = mUeventsReceived,
+            .overflows = mUeventOverflows,
+            .oversized = mUeventsOversized,
+            .resyncs = mUeventResyncs,
+            .maxBurst = mMaxUeventBurst,
+            .receiveBufferBytes = mReceiveBufferBytes};
+}
+
+void UsbEventLoop::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mTasks.push_back(std::move(task));
+    }
+
+    uint64_t one = 1;
+    if (write(mTaskFd.get(), &one, sizeof(one)) != sizeof(one))
+        ALOGE("eventfd write failed; errno=%d", errno);
+}
+
+void UsbEventLoop::runTasks() {
+    std::vector<std::function<void()>> tasks;
+    uint64_t count;
+
+    if (read(mTaskFd.get(), &count, sizeof(count)) != sizeof(count))
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        tasks.swap(mTasks);
+    }
+    for (const auto &task : tasks) {
+        task();
+    }
+}
+
+bool UsbEventLoop::start() {
+    if (mThread.joinable())
+        return true;
+    mThread = std::thread(&UsbEventLoop::run, this);
+    return true;
+}
+
+void UsbEventLoop::stop() {
+    if (!mThread.joinable())
+        return;
+
+    uint64_t one = 1;
+    if (write(mStopFd.get(), &one, sizeof(one)) != sizeof(one)) {
+        ALOGE("eventfd write failed; errno=%d", errno);
+        return;
+    }
+    if (isLoopThread()) {
+        mThread.detach();
+    } else {
+        mThread.join();
+    }
+}
+
+void UsbEventLoop::readReceiveBufferSize() {
+    int size;
+    socklen_t len = sizeof(size);
+    if (getsockopt(mUeventFd.get(), SOL_SOCKET, SO_RCVBUF, &size, &len) != 0) {
+        ALOGE("uevent receive buffer size unavailable; errno=%d", errno);
+        return;
+    }
+    mReceiveBufferBytes = size;
+}
+
+void UsbEventLoop::growReceiveBuffer(uint64_t burst, bool overflowed) {
+    // A queued uevent takes up to about UEVENT_MSG_LEN of the receive buffer; keep room for
+    // twice the largest burst, and double the buffer whenever it overflowed anyway
+    int requested = mRequestedReceiveBufferBytes;
+    int wanted = std::min<uint64_t>(burst * UEVENT_MSG_LEN * 2, UEVENT_SOCKET_MAX_BUF_SIZE);
+    if (overflowed)
+        wanted = std::max(wanted, std::min(requested * 2, UEVENT_SOCKET_MAX_BUF_SIZE));
+    if (wanted <= requested)
+        return;
+    // Not retried, whether the kernel grants it in full, caps it or refuses it
+    mRequestedReceiveBufferBytes = wanted;
+
+    /*
+     * SO_RCVBUFFORCE needs CAP_NET_ADMIN, which the service does not have. SO_RCVBUF works
+     * without it, up to net.core.rmem_max.
+     */
+    if (setsockopt(mUeventFd.get(), SOL_SOCKET, SO_RCVBUFFORCE, &wanted, sizeof(wanted)) != 0 &&
+        (errno != EPERM ||
+         setsockopt(mUeventFd.get(), SOL_SOCKET, SO_RCVBUF, &wanted, sizeof(wanted)) != 0)) {
+        ALOGE("uevent receive buffer resize to %d failed; errno=%d", wanted, errno);
+        return;
+    }
+
+    // The kernel doubles the size asked for its bookkeeping, and caps SO_RCVBUF
+    int size = mReceiveBufferBytes;
+    readReceiveBufferSize();
+    ALOGI("uevent receive buffer grown from %d to %d bytes (%d requested)", size,
+          mReceiveBufferBytes.load(), wanted);
+}
+
+void UsbEventLoop::handleUevent() {
+    char msg[UEVENT_MSG_LEN + 2];
+    uint64_t burst = 0;
+    bool overflowed = false;
+    bool lost = false;
+
+    for (int i = 0; i < MAX_UEVENTS_PER_WAKEUP; i++) {
+        int n = uevent_kernel_multicast_recv(mUeventFd.get(), msg, UEVENT_MSG_LEN);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == ENOBUFS) {
+                // The kernel dropped uevents; the error is reported once per overflow
+                ALOGE("uevent socket overflow");
+                mUeventOverflows++;
+                overflowed = lost = true;
+                continue;
+            }
+            // A message not sent by the kernel, already consumed
+            if (errno == EIO || errno == EINTR)
+                continue;
+            ALOGE("uevent recv failed; errno=%d", errno);
+            break;
+        }
+        if (n == 0)
+            break;
+
+        burst++;
+        if (n >= UEVENT_MSG_LEN) {
+            ALOGE("uevent longer than %d bytes discarded", UEVENT_MSG_LEN);
+            mUeventsOversized++;
+            lost = true;
+            continue;
+        }
+
+        UeventMessage uevent;
+        if (!uevent.parse(msg, n))
+            continue;
+
+        mUeventsReceived++;
+        for (const auto &handler : mUeventHandlers) {
+            handler(uevent);
+        }
+    }
+
+    if (burst > mMaxUeventBurst)
+        mMaxUeventBurst = burst;
+    growReceiveBuffer(burst, overflowed);
+
+    if (lost) {
+        ALOGI("uevents lost, resynchronizing");
+        mUeventResyncs++;
+        for (const auto &handler : mResyncHandlers) {
+            handler();
+        }
+    }
+}
+
+void UsbEventLoop::run() {
+    struct epoll_event events[MAX_EVENTS];
+    int nevents = 0;
+
+    ALOGI("event loop started");
+    while (true) {
+        nevents = epoll_wait(mEpollFd.get(), events, MAX_EVENTS, -1);
+        if (nevents == -1) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("usb epoll_wait failed; errno=%d", errno);
+            break;
+        }
+
+        for (int n = 0; n < nevents; ++n) {
+            const int fd = events[n].data.fd;
+            if (fd == mStopFd.get()) {
+                ALOGI("event loop stopped");
+                return;
+            }
+            if (fd == mUeventFd.get()) {
+                handleUevent();
+                continue;
+            }
+            if (fd == mTaskFd.get()) {
+                runTasks();
+                continue;
+            }
+
+            std::shared_ptr<FdHandler> handler;
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                auto it = mHandlers.find(fd);
+                if (it != mHandlers.end())
+                    handler = it->second;
+            }
+            if (handler)
+                (*handler)(events[n].events);
+        }
+    }
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
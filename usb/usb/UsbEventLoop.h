@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "UeventMatcher.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::unique_fd;
+
+/*
+ * UsbEventLoop is the single event thread of the HAL. It owns the netlink uevent socket and an
+ * epoll set of file descriptors registered by the HAL components (timerfds, sysfs attributes
+ * polled for EPOLLPRI, the libusbhost inotify fd), and dispatches each ready fd to its handler.
+ *
+ * Every uevent is received and parsed once, then passed to all uevent handlers in registration
+ * order. Handlers run on the loop thread and may add or remove fds. Other threads hand work to
+ * the loop with post(). The loop is stopped through an eventfd.
+ *
+ * Uevents the kernel drops because the socket receive buffer was full (ENOBUFS), and messages
+ * too long for the receive buffer, are counted. After such a loss the resync handlers run so
+ * that state kept from uevents can be rebuilt from sysfs, and the receive buffer is grown to
+ * fit the bursts seen.
+ */
+class UsbEventLoop {
+  public:
+    using FdHandler = std::function<void(uint32_t events)>;
+    using UeventHandler = std::function<void(const UeventMessage &uevent)>;
+
+    struct UeventStats {
+        uint64_t received;
+        // Times the kernel reported uevents dropped on a full receive buffer
+        uint64_t overflows;
+        // Messages discarded for being longer than the receive buffer
+        uint64_t oversized;
+        uint64_t resyncs;
+        // Most uevents read in one wakeup
+        uint64_t maxBurst;
+        // As reported by the kernel, i.e. including its bookkeeping share
+        int receiveBufferBytes;
+    };
+
+    UsbEventLoop();
+    ~UsbEventLoop();
+
+    // Registers fd for events (EPOLLIN, EPOLLPRI, ...). Returns false if epoll rejects it.
+    bool addFd(int fd, uint32_t events, FdHandler handler);
+    // Unregisters fd; its handler is not called anymore, even for events already received
+    void removeFd(int fd);
+    // Handlers must be added before start()
+    void addUeventHandler(UeventHandler handler);
+    void addResyncHandler(std::function<void()> handler);
+    // Runs task on the loop thread, after the events currently being dispatched
+    void post(std::function<void()> task);
+
+    bool start();
+    void stop();
+    bool isLoopThread() const { return std::this_thread::get_id() == mThread.get_id(); }
+    UeventStats getUeventStats() const;
+
+  private:
+    void run();
+    void handleUevent();
+    void runTasks();
+    void readReceiveBufferSize();
+    void growReceiveBuffer(uint64_t burst, bool overflowed);
+
+    unique_fd mEpollFd;
+    unique_fd mUeventFd;
+    unique_fd mStopFd;
+    unique_fd mTaskFd;
+    std::thread mThread;
+    std::vector<UeventHandler> mUeventHandlers;
+    std::vector<std::function<void()>> mResyncHandlers;
+
+    std::atomic<uint64_t> mUeventsReceived;
+    std::atomic<uint64_t> mUeventOverflows;
+    std::atomic<uint64_t> mUeventsOversized;
+    std::atomic<uint64_t> mUeventResyncs;
+    std::atomic<uint64_t> mMaxUeventBurst;
+    std::atomic<int> mReceiveBufferBytes;
+    // Largest receive buffer size asked for, owned by the loop thread
+    int mRequestedReceiveBufferBytes;
+
+    std::mutex mLock;
+    std::unordered_map<int, std::shared_ptr<FdHandler>> mHandlers;
+    std::vector<std::function<void()>> mTasks;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
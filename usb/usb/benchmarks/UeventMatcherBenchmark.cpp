@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Uevent dispatch throughput over the synthetic corpus in benchmarks/uevent_corpus.txt, which
+ * follows the uevents of a gs201 device but was not captured from one: parsing each
+ * message and running the checks of uevent_event and UsbDataSessionMonitor::handleUevent. The
+ * std::regex benchmark replays what those handlers did before UeventMatcher, one regex built
+ * per field, for comparison.
+ */
+
+#include "../UeventMatcher.h"
+#include "../UeventPatterns.h"
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <regex>
+#include <string>
+#include <vector>
+
+using aidl::android::hardware::usb::UeventMatcher;
+using aidl::android::hardware::usb::UeventMessage;
+using aidl::android::hardware::usb::kHost1UeventRegex;
+using aidl::android::hardware::usb::kHost2UeventRegex;
+using aidl::android::hardware::usb::kUdcUeventRegex;
+
+// The devpath patterns of UsbDataSessionMonitor
+static const char *const kPatterns[] = {kUdcUeventRegex, kHost1UeventRegex, kHost2UeventRegex};
+
+/*
+ * Returns the messages of the corpus in the wire format of the uevent socket, NUL separated
+ * fields, or an empty list if the corpus is missing.
+ */
+static const std::vector<std::string> &corpus() {
+    static const std::vector<std::string> messages = [] {
+        std::vector<std::string> messages;
+        std::string text;
+        if (!::android::base::ReadFileToString(
+                    ::android::base::GetExecutableDirectory() + "/benchmarks/uevent_corpus.txt",
+                    &text)) {
+            return messages;
+        }
+
+        std::string message;
+        for (const auto &line : ::android::base::Split(text, "\n")) {
+            if (::android::base::StartsWith(line, "#")) {
+                continue;
+            }
+            if (line.empty()) {
+                if (!message.empty()) {
+                    messages.push_back(std::move(message));
+                    message.clear();
+                }
+                continue;
+            }
+            message += line;
+            message += '\0';
+        }
+        if (!message.empty()) {
+            messages.push_back(std::move(message));
+        }
+        return messages;
+    }();
+    return messages;
+}
+
+static void reportThroughput(benchmark::State &state) {
+    size_t bytes = 0;
+    for (const auto &message : corpus()) {
+        bytes += message.size();
+    }
+    state.SetItemsProcessed(state.iterations() * corpus().size());
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+static void BM_UeventMatcher(benchmark::State &state) {
+    if (corpus().empty()) {
+        state.SkipWithError("Missing uevent corpus");
+        return;
+    }
+
+    UeventMatcher matcher;
+    for (const char *pattern : kPatterns) {
+        matcher.add(pattern);
+    }
+
+    for (auto _ : state) {
+        for (const auto &message : corpus()) {
+            UeventMessage uevent;
+            if (!uevent.parse(message.data(), message.size())) {
+                continue;
+            }
+            bool handled = uevent.hasPrefix("DEVTYPE", "typec_") ||
+                           uevent.hasPrefix("DRIVER", "max77759tcpc") ||
+                           uevent.hasPrefix("DRIVER", "pogo-transport") ||
+                           uevent.hasPrefix("POWER_SUPPLY_NAME", "usb");
+            benchmark::DoNotOptimize(handled);
+            benchmark::DoNotOptimize(matcher.search(uevent.devpath()));
+        }
+    }
+    reportThroughput(state);
+}
+BENCHMARK(BM_UeventMatcher);
+
+static void BM_UeventRegexPerField(benchmark::State &state) {
+    if (corpus().empty()) {
+        state.SkipWithError("Missing uevent corpus");
+        return;
+    }
+
+    for (auto _ : state) {
+        for (const auto &message : corpus()) {
+            for (const char *cp = message.data(); cp < message.data() + message.size();
+                 cp += strlen(cp) + 1) {
+                bool handled =
+                        std::regex_search(cp, std::regex("^(DEVTYPE=typec_.+|DRIVER=max77759tcpc|"
+                                                         "DRIVER=pogo-transport|"
+                                                         "POWER_SUPPLY_NAME=usb.*)"));
+                benchmark::DoNotOptimize(handled);
+                for (const char *pattern : kPatterns) {
+                    bool matched = std::regex_search(cp, std::regex(pattern));
+                    benchmark::DoNotOptimize(matched);
+                }
+            }
+        }
+    }
+    reportThroughput(state);
+}
+BENCHMARK(BM_UeventRegexPerField);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../CallbackDispatcher.h"
+#include "../SnapshotNotifier.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using aidl::android::hardware::usb::CallbackDispatcher;
+using aidl::android::hardware::usb::SnapshotNotifier;
+
+namespace {
+
+// Stands in for PortStatusSnapshot
+struct Status {
+    uint64_t ports;
+    bool ok;
+};
+
+/*
+ * Wired like the port status of Usb: unchanged successful results are quiet, and notifications
+ * go through a CallbackDispatcher to a callback that records them.
+ */
+class SnapshotNotifierTest : public ::testing::Test {
+  protected:
+    using Notifier = SnapshotNotifier<Status>;
+
+    SnapshotNotifierTest()
+        : mDispatcher(std::make_unique<CallbackDispatcher>()),
+          mNotifier([](const Status &previous, const Status &current) {
+                        return previous.ports == current.ports && current.ok;
+                    },
+                    [this](const Notifier::Snapshot &snapshot) {
+                        mDispatcher->post([this, snapshot] {
+                            std::lock_guard<std::mutex> lock(mLock);
+                            mReceived.push_back(snapshot->ports);
+                        });
+                    }) {}
+
+    // Computes and publishes a result, like queryVersionHelper
+    void update(uint64_t ports, bool ok = true, bool force = false) {
+        const uint64_t generation = mNotifier.begin();
+        mNotifier.publish(generation, std::make_shared<const Status>(Status{ports, ok}), force);
+    }
+
+    // Waits for the queued notifications and returns them
+    std::vector<uint64_t> received() {
+        mDispatcher.reset();
+        mDispatcher = std::make_unique<CallbackDispatcher>();
+        std::lock_guard<std::mutex> lock(mLock);
+        return mReceived;
+    }
+
+    std::unique_ptr<CallbackDispatcher> mDispatcher;
+    Notifier mNotifier;
+    std::mutex mLock;
+    std::vector<uint64_t> mReceived;
+};
+
+TEST_F(SnapshotNotifierTest, SuppressesUnchangedResults) {
+    update(1);
+    update(1);
+    update(2);
+    update(2);
+
+    EXPECT_EQ((std::vector<uint64_t>{1, 2}), received());
+    EXPECT_EQ(2u, mNotifier.getPublished());
+    EXPECT_EQ(2u, mNotifier.getSuppressed());
+}
+
+TEST_F(SnapshotNotifierTest, NotifiesFailuresAndForcedResults) {
+    update(1);
+    update(1, false);
+    update(1, true, true);
+
+    EXPECT_EQ((std::vector<uint64_t>{1, 1, 1}), received());
+}
+
+/*
+ * The setCallback path: updates stopped while no callback was set, so the latest snapshot may
+ * be stale. A resend makes the next computation reach the new callback even if unchanged, and
+ * only that one.
+ */
+TEST_F(SnapshotNotifierTest, ResendForcesTheNextResultOnly) {
+    update(1);
+    update(1);
+    mNotifier.requestResend();
+    update(1);
+    update(1);
+
+    EXPECT_EQ((std::vector<uint64_t>{1, 1}), received());
+    EXPECT_EQ(1u, mNotifier.get()->ports);
+}
+
+TEST_F(SnapshotNotifierTest, ForcedStaleResultResendsLatest) {
+    const uint64_t older = mNotifier.begin();
+    update(2);
+    mNotifier.publish(older, std::make_shared<const Status>(Status{1, true}), true);
+
+    const uint64_t stale = mNotifier.begin();
+    update(3);
+    mNotifier.publish(stale, std::make_shared<const Status>(Status{4, true}), false);
+
+    EXPECT_EQ((std::vector<uint64_t>{2, 2, 3}), received());
+    EXPECT_EQ(3u, mNotifier.get()->ports);
+}
+
+/*
+ * Many threads computing at once, like binder calls and the event loop: the notifications reach
+ * the callback in computation order, and never go back to an older result.
+ */
+TEST_F(SnapshotNotifierTest, NotificationsStayInOrderUnderContention) {
+    static constexpr int kThreads = 8;
+    static constexpr int kIterations = 1000;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([this] {
+            for (int i = 0; i < kIterations; i++) {
+                const uint64_t generation = mNotifier.begin();
+                if (generation % 5 == 0)
+                    std::this_thread::yield();
+                // Every result differs, so each published one is notified
+                mNotifier.publish(generation,
+                                  std::make_shared<const Status>(Status{generation, true}),
+                                  false);
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    const std::vector<uint64_t> notified = received();
+    ASSERT_FALSE(notified.empty());
+    for (size_t i = 1; i < notified.size(); i++)
+        EXPECT_LT(notified[i - 1], notified[i]);
+    EXPECT_EQ(static_cast<uint64_t>(kThreads * kIterations), notified.back());
+    EXPECT_EQ(static_cast<uint64_t>(kThreads * kIterations),
+              mNotifier.getPublished() + mNotifier.getSuppressed());
+}
+
+}  // namespace
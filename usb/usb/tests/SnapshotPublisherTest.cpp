@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../SnapshotPublisher.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <thread>
+#include <vector>
+
+using aidl::android::hardware::usb::SnapshotPublisher;
+
+using Publisher = SnapshotPublisher<uint64_t>;
+
+static Publisher::Snapshot make(uint64_t value) {
+    return std::make_shared<const uint64_t>(value);
+}
+
+TEST(SnapshotPublisherTest, PublishesInOrder) {
+    Publisher publisher;
+    EXPECT_EQ(nullptr, publisher.get());
+
+    const uint64_t first = publisher.begin();
+    const uint64_t second = publisher.begin();
+    EXPECT_LT(first, second);
+
+    bool published = false;
+    EXPECT_TRUE(publisher.publish(first, make(1),
+            [&](const Publisher::Snapshot &previous, const Publisher::Snapshot &current) {
+                EXPECT_EQ(nullptr, previous);
+                EXPECT_EQ(1u, *current);
+                published = true;
+            },
+            [](const Publisher::Snapshot &) { FAIL(); }));
+    EXPECT_TRUE(published);
+
+    EXPECT_TRUE(publisher.publish(second, make(2),
+            [&](const Publisher::Snapshot &previous, const Publisher::Snapshot &current) {
+                EXPECT_EQ(1u, *previous);
+                EXPECT_EQ(2u, *current);
+            },
+            [](const Publisher::Snapshot &) { FAIL(); }));
+    EXPECT_EQ(2u, *publisher.get());
+}
+
+TEST(SnapshotPublisherTest, DropsStaleResults) {
+    Publisher publisher;
+    const uint64_t older = publisher.begin();
+    const uint64_t newer = publisher.begin();
+
+    EXPECT_TRUE(publisher.publish(newer, make(2), [](auto &, auto &) {},
+                                  [](const Publisher::Snapshot &) { FAIL(); }));
+
+    Publisher::Snapshot latest;
+    EXPECT_FALSE(publisher.publish(older, make(1),
+            [](const Publisher::Snapshot &, const Publisher::Snapshot &) { FAIL(); },
+            [&](const Publisher::Snapshot &snapshot) { latest = snapshot; }));
+    ASSERT_NE(nullptr, latest);
+    EXPECT_EQ(2u, *latest);
+    EXPECT_EQ(2u, *publisher.get());
+}
+
+/*
+ * Computations must not exclude each other: both computations below wait for the other to have
+ * started before publishing, which would never happen if they were serialized.
+ */
+TEST(SnapshotPublisherTest, ComputationsRunConcurrently) {
+    Publisher publisher;
+    std::mutex lock;
+    std::condition_variable cv;
+    int running = 0;
+
+    auto compute = [&](uint64_t value) {
+        const uint64_t generation = publisher.begin();
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            running++;
+            cv.notify_all();
+            if (!cv.wait_for(guard, std::chrono::seconds(5), [&] { return running == 2; }))
+                return false;
+        }
+        publisher.publish(generation, make(value), [](auto &, auto &) {}, [](auto &) {});
+        return true;
+    };
+
+    auto a = std::async(std::launch::async, compute, 1);
+    auto b = std::async(std::launch::async, compute, 2);
+    EXPECT_TRUE(a.get());
+    EXPECT_TRUE(b.get());
+    EXPECT_NE(nullptr, publisher.get());
+}
+
+/*
+ * Readers must not wait for a publication in progress: a reader gets the latest snapshot while
+ * a publish callback, e.g. one blocked on queueing a notification, holds the publication lock.
+ */
+TEST(SnapshotPublisherTest, ReadersDoNotWaitForPublication) {
+    Publisher publisher;
+    publisher.publish(publisher.begin(), make(1), [](auto &, auto &) {}, [](auto &) {});
+
+    std::promise<void> inCallback;
+    std::promise<void> release;
+    std::thread writer([&] {
+        publisher.publish(publisher.begin(), make(2), [&](auto &, auto &) {
+            inCallback.set_value();
+            release.get_future().wait();
+        }, [](auto &) {});
+    });
+    inCallback.get_future().wait();
+
+    auto reader = std::async(std::launch::async, [&] { return publisher.get(); });
+    const bool finished = reader.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+    release.set_value();
+    writer.join();
+
+    ASSERT_TRUE(finished);
+    EXPECT_NE(nullptr, reader.get());
+}
+
+/*
+ * Under contention from many computing threads, the published values, which grow with the
+ * generation, never go back, and every computation is either published or reported stale.
+ */
+TEST(SnapshotPublisherTest, ContentionKeepsOrder) {
+    static constexpr int kThreads = 8;
+    static constexpr int kIterations = 2000;
+
+    Publisher publisher;
+    std::atomic<uint64_t> lastPublished{0};
+    std::atomic<int> outOfOrder{0};
+    std::atomic<int> published{0};
+    std::atomic<int> stale{0};
+    std::atomic<bool> done{false};
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < kIterations; i++) {
+                const uint64_t generation = publisher.begin();
+                // Uneven computation times shuffle the order results come back in
+                if (generation % 7 == 0)
+                    std::this_thread::yield();
+                publisher.publish(generation, make(generation),
+                        [&](const Publisher::Snapshot &, const Publisher::Snapshot &current) {
+                            if (*current <= lastPublished)
+                                outOfOrder++;
+                            lastPublished = *current;
+                            published++;
+                        },
+                        [&](const Publisher::Snapshot &) { stale++; });
+            }
+        });
+    }
+
+    uint64_t lastRead = 0;
+    int readsBackwards = 0;
+    std::thread reader([&] {
+        while (!done) {
+            Publisher::Snapshot snapshot = publisher.get();
+            if (snapshot) {
+                if (*snapshot < lastRead)
+                    readsBackwards++;
+                lastRead = *snapshot;
+            }
+        }
+    });
+
+    for (auto &thread : threads)
+        thread.join();
+    done = true;
+    reader.join();
+
+    EXPECT_EQ(0, outOfOrder);
+    EXPECT_EQ(0, readsBackwards);
+    EXPECT_EQ(kThreads * kIterations, published + stale);
+    EXPECT_EQ(static_cast<uint64_t>(kThreads * kIterations), *publisher.get());
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../UeventMatcher.h"
+#include "../UeventPatterns.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+using aidl::android::hardware::usb::UeventMatcher;
+using aidl::android::hardware::usb::UeventMessage;
+using aidl::android::hardware::usb::kHost1UeventRegex;
+using aidl::android::hardware::usb::kHost2UeventRegex;
+using aidl::android::hardware::usb::kUdcUeventRegex;
+
+TEST(UeventMatcherTest, LiteralMatchesAnywhere) {
+    UeventMatcher matcher;
+    ASSERT_EQ(0, matcher.add("udc/11210000"));
+
+    EXPECT_EQ(1u, matcher.search("/devices/platform/11210000.usb/udc/11210000.dwc3"));
+    EXPECT_EQ(1u, matcher.search("udc/11210000"));
+    EXPECT_EQ(0u, matcher.search("udc/1121000"));
+    EXPECT_EQ(0u, matcher.search(""));
+}
+
+TEST(UeventMatcherTest, DotMatchesAnyCharacter) {
+    UeventMatcher matcher;
+    ASSERT_EQ(0, matcher.add("a.c"));
+
+    EXPECT_EQ(1u, matcher.search("abc"));
+    EXPECT_EQ(1u, matcher.search("a.c"));
+    EXPECT_EQ(1u, matcher.search(std::string("a\0c", 3)));
+    EXPECT_EQ(0u, matcher.search("ac"));
+}
+
+TEST(UeventMatcherTest, BracketClasses) {
+    UeventMatcher matcher;
+    ASSERT_EQ(0, matcher.add("exynos.[0-9].auto"));
+    ASSERT_EQ(1, matcher.add("usb[23]/"));
+    ASSERT_EQ(2, matcher.add("port[a-cx]"));
+
+    EXPECT_EQ(1u, matcher.search("xhci-hcd-exynos.0.auto"));
+    EXPECT_EQ(1u, matcher.search("xhci-hcd-exynos.9.auto"));
+    EXPECT_EQ(0u, matcher.search("xhci-hcd-exynos.a.auto"));
+    EXPECT_EQ(2u, matcher.search("/usb2/"));
+    EXPECT_EQ(2u, matcher.search("/usb3/"));
+    EXPECT_EQ(0u, matcher.search("/usb4/"));
+    EXPECT_EQ(4u, matcher.search("portb"));
+    EXPECT_EQ(4u, matcher.search("portx"));
+    EXPECT_EQ(0u, matcher.search("portd"));
+}
+
+TEST(UeventMatcherTest, EscapesAreLiteral) {
+    UeventMatcher matcher;
+    ASSERT_EQ(0, matcher.add("a\\.c"));
+    ASSERT_EQ(1, matcher.add("\\[0\\]"));
+
+    EXPECT_EQ(1u, matcher.search("a.c"));
+    EXPECT_EQ(0u, matcher.search("abc"));
+    EXPECT_EQ(2u, matcher.search("x[0]"));
+    EXPECT_EQ(0u, matcher.search("x0"));
+}
+
+TEST(UeventMatcherTest, RejectsNegatedClasses) {
+    UeventMatcher matcher;
+    EXPECT_EQ(-1, matcher.add("usb[^0-9]"));
+    EXPECT_EQ(-1, matcher.add("[^a]"));
+
+    // '^' elsewhere in a class is a literal
+    ASSERT_EQ(0, matcher.add("[a^]"));
+    EXPECT_EQ(1u, matcher.search("^"));
+    EXPECT_EQ(1u, matcher.search("a"));
+    EXPECT_EQ(0u, matcher.search("b"));
+}
+
+TEST(UeventMatcherTest, RejectsMalformedClasses) {
+    UeventMatcher matcher;
+    EXPECT_EQ(-1, matcher.add("usb[0-9"));
+    EXPECT_EQ(-1, matcher.add("usb[]"));
+    EXPECT_EQ(-1, matcher.add("usb[9-0]"));
+}
+
+TEST(UeventMatcherTest, RejectsUnsupportedOperators) {
+    UeventMatcher matcher;
+    for (const char *pattern : {"a*", "a+", "a?", "(a)", "a|b", "a{2}", "^a", "a$"}) {
+        EXPECT_EQ(-1, matcher.add(pattern)) << pattern;
+    }
+    EXPECT_EQ(-1, matcher.add(""));
+
+    // Rejected patterns take no id
+    EXPECT_EQ(0, matcher.add("a"));
+}
+
+TEST(UeventMatcherTest, ReportsEveryMatchingPattern) {
+    UeventMatcher matcher;
+    ASSERT_EQ(0, matcher.add("abc"));
+    ASSERT_EQ(1, matcher.add("bcd"));
+    ASSERT_EQ(2, matcher.add("xyz"));
+
+    EXPECT_EQ(3u, matcher.search("abcd"));
+    EXPECT_EQ(4u, matcher.search("xyz"));
+    EXPECT_EQ(5u, matcher.search("abc xyz"));
+}
+
+TEST(UeventMatcherTest, AdjacentPatternsDoNotChain) {
+    UeventMatcher matcher;
+    ASSERT_EQ(0, matcher.add("ab"));
+    ASSERT_EQ(1, matcher.add("cd"));
+
+    // The bit leaving the last position of "ab" must not complete "cd" on its own
+    EXPECT_EQ(1u, matcher.search("abd"));
+    EXPECT_EQ(3u, matcher.search("abcd"));
+}
+
+TEST(UeventMatcherTest, Limits) {
+    UeventMatcher matcher;
+    for (size_t i = 0; i < UeventMatcher::kMaxPatterns; i++) {
+        ASSERT_EQ(static_cast<int>(i), matcher.add("p" + std::to_string(i)));
+    }
+    EXPECT_EQ(-1, matcher.add("one too many"));
+
+    UeventMatcher long_matcher;
+    EXPECT_EQ(-1, long_matcher.add(std::string(UeventMatcher::kMaxPositions + 1, 'a')));
+    EXPECT_EQ(0, long_matcher.add(std::string(UeventMatcher::kMaxPositions, 'a')));
+    EXPECT_EQ(-1, long_matcher.add("a"));
+}
+
+TEST(UeventMatcherTest, HalPatterns) {
+    UeventMatcher matcher;
+    ASSERT_EQ(0, matcher.add(kUdcUeventRegex));
+    ASSERT_EQ(1, matcher.add(kHost1UeventRegex));
+    ASSERT_EQ(2, matcher.add(kHost2UeventRegex));
+
+    EXPECT_EQ(1u, matcher.search("/devices/platform/11210000.usb/11210000.dwc3/udc/"
+                                 "11210000.dwc3"));
+    EXPECT_EQ(2u, matcher.search("/devices/platform/11210000.usb/11210000.dwc3/"
+                                 "xhci-hcd-exynos.4.auto/usb2/2-0:1.0/usb2-port1"));
+    EXPECT_EQ(4u, matcher.search("/devices/platform/11210000.usb/11210000.dwc3/"
+                                 "xhci-hcd-exynos.4.auto/usb3/3-0:1.0"));
+    EXPECT_EQ(0u, matcher.search("/devices/platform/11210000.usb/11210000.dwc3/"
+                                 "xhci-hcd-exynos.4.auto/usb1/1-0:1.0"));
+}
+
+TEST(UeventMessageTest, Parse) {
+    const std::string msg("change@/devices/platform/udc\0ACTION=change\0DEVTYPE=typec_port\0"
+                          "DRIVER=max77759tcpc\0",
+                          sizeof("change@/devices/platform/udc\0ACTION=change\0"
+                                 "DEVTYPE=typec_port\0DRIVER=max77759tcpc\0") - 1);
+    UeventMessage uevent;
+    ASSERT_TRUE(uevent.parse(msg.data(), msg.size()));
+
+    EXPECT_EQ("change", uevent.action());
+    EXPECT_EQ("/devices/platform/udc", uevent.devpath());
+    EXPECT_EQ("typec_port", uevent.get("DEVTYPE"));
+    EXPECT_EQ("", uevent.get("SUBSYSTEM"));
+    EXPECT_TRUE(uevent.hasPrefix("DEVTYPE", "typec_"));
+    EXPECT_TRUE(uevent.hasPrefix("DRIVER", "max77759tcpc"));
+    EXPECT_FALSE(uevent.hasPrefix("DRIVER", "max77759tcpc-long"));
+}
+
+TEST(UeventMessageTest, RejectsMessagesWithoutHeader) {
+    const std::string msg("ACTION=change\0DEVTYPE=typec_port\0", 33);
+    UeventMessage uevent;
+    EXPECT_FALSE(uevent.parse(msg.data(), msg.size()));
+    EXPECT_FALSE(uevent.parse("", 0));
+}